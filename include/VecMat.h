@@ -4,7 +4,37 @@
 #define VEC_MAT_HDR
 
 #include <math.h>
+#include <float.h>
+#include <string.h>
+#include <stdint.h>
 #include <iostream>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <functional>
+
+// SIMD paths for the mat4 kernels and batch operations, picked at compile time:
+// SSE2 on x86 (AVX for the batch operations when enabled), NEON on ARM, scalar
+// otherwise. Define VECMAT_NO_SIMD to force scalar code.
+// VECMAT_SIMD names the path in use.
+
+#if !defined(VECMAT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define VECMAT_SSE2
+#include <emmintrin.h>
+#if defined(__AVX__)
+#define VECMAT_AVX
+#include <immintrin.h>
+#define VECMAT_SIMD "AVX"
+#else
+#define VECMAT_SIMD "SSE2"
+#endif
+#elif !defined(VECMAT_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define VECMAT_NEON
+#include <arm_neon.h>
+#define VECMAT_SIMD "NEON"
+#else
+#define VECMAT_SIMD "scalar"
+#endif
 
 // integer pair and triplet
 
@@ -156,7 +186,7 @@ public:
 	vec4 operator + (const vec4 &v) const { return vec4(x+v.x, y+v.y, z+v.z, w+v.w); }
 	vec4 operator - (const vec4 &v) const { return vec4(x-v.x, y-v.y, z-v.z, w-v.w); }
 	vec4 operator * (float s) const { return vec4(s*x, s*y, s*z, s*w); }
-	vec4 operator * (const vec4 &v) const { return vec4(x*v.x, y*v.y, z*v.z, w*v.z); }
+	vec4 operator * (const vec4 &v) const { return vec4(x*v.x, y*v.y, z*v.z, w*v.w); }
 	friend vec4 operator * (float s, const vec4& v) { return v*s; }
 	vec4 operator / (float s) const { float r = 1.f/s; return *this*r; }
 	// reflexive
@@ -171,6 +201,85 @@ inline float dot(const vec4 &a, const vec4 &b) { return a.x*b.x+a.y*b.y+a.z*b.z+
 inline float length(const vec4 &v) { return sqrt(dot(v, v)); }
 inline vec4 normalize(const vec4 &v) { return v/length(v); }
 
+// 4x4 kernels on row major float[16], used by mat4; out may alias the inputs
+// the scalar versions are the fallback without SIMD, and always available to compare against
+
+inline void MultiplyMat4Scalar(const float *a, const float *b, float *out) {
+	float r[16];
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+			r[4*i+j] = a[4*i]*b[j]+a[4*i+1]*b[4+j]+a[4*i+2]*b[8+j]+a[4*i+3]*b[12+j];
+	for (int i = 0; i < 16; i++)
+		out[i] = r[i];
+}
+
+inline void TransposeMat4Scalar(const float *m, float *out) {
+	float r[16];
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+			r[4*j+i] = m[4*i+j];
+	for (int i = 0; i < 16; i++)
+		out[i] = r[i];
+}
+
+inline void MultiplyMat4(const float *a, const float *b, float *out) {
+	// each row of the product is a linear combination of the rows of b
+	// AVX builds use this too: two rows per 256 bit register measured slower than SSE2
+#if defined(VECMAT_SSE2)
+	__m128 b0 = _mm_loadu_ps(b), b1 = _mm_loadu_ps(b+4), b2 = _mm_loadu_ps(b+8), b3 = _mm_loadu_ps(b+12);
+	__m128 r[4];
+	for (int i = 0; i < 4; i++) {
+		__m128 ai = _mm_loadu_ps(a+4*i);
+		r[i] = _mm_mul_ps(_mm_shuffle_ps(ai, ai, 0x00), b0);
+		r[i] = _mm_add_ps(r[i], _mm_mul_ps(_mm_shuffle_ps(ai, ai, 0x55), b1));
+		r[i] = _mm_add_ps(r[i], _mm_mul_ps(_mm_shuffle_ps(ai, ai, 0xaa), b2));
+		r[i] = _mm_add_ps(r[i], _mm_mul_ps(_mm_shuffle_ps(ai, ai, 0xff), b3));
+	}
+	for (int i = 0; i < 4; i++)
+		_mm_storeu_ps(out+4*i, r[i]);
+#elif defined(VECMAT_NEON)
+	float32x4_t b0 = vld1q_f32(b), b1 = vld1q_f32(b+4), b2 = vld1q_f32(b+8), b3 = vld1q_f32(b+12);
+	float32x4_t r[4];
+	for (int i = 0; i < 4; i++) {
+		r[i] = vmulq_n_f32(b0, a[4*i]);
+		r[i] = vmlaq_n_f32(r[i], b1, a[4*i+1]);
+		r[i] = vmlaq_n_f32(r[i], b2, a[4*i+2]);
+		r[i] = vmlaq_n_f32(r[i], b3, a[4*i+3]);
+	}
+	for (int i = 0; i < 4; i++)
+		vst1q_f32(out+4*i, r[i]);
+#else
+	MultiplyMat4Scalar(a, b, out);
+#endif
+}
+
+inline void TransformVec4(const float *m, const float *v, float *out) {
+	// scalar on every path: transposing m into registers cost more than the
+	// multiplies it saved in vecmat-bench
+	float r[4];
+	for (int i = 0; i < 4; i++)
+		r[i] = m[4*i]*v[0]+m[4*i+1]*v[1]+m[4*i+2]*v[2]+m[4*i+3]*v[3];
+	for (int i = 0; i < 4; i++)
+		out[i] = r[i];
+}
+
+inline void TransposeMat4(const float *m, float *out) {
+#if defined(VECMAT_SSE2)
+	__m128 r0 = _mm_loadu_ps(m), r1 = _mm_loadu_ps(m+4), r2 = _mm_loadu_ps(m+8), r3 = _mm_loadu_ps(m+12);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_ps(out, r0);
+	_mm_storeu_ps(out+4, r1);
+	_mm_storeu_ps(out+8, r2);
+	_mm_storeu_ps(out+12, r3);
+#elif defined(VECMAT_NEON)
+	float32x4x4_t c = vld4q_f32(m);
+	for (int i = 0; i < 4; i++)
+		vst1q_f32(out+4*i, c.val[i]);
+#else
+	TransposeMat4Scalar(m, out);
+#endif
+}
+
 // 3x3 matrix representation (used by some quaternion related operations)
 
 class mat3 {
@@ -233,21 +342,25 @@ public:
 	// access
 	vec4 &operator [] (int i) { return row[i]; }
 	const vec4 &operator [] (int i) const { return row[i]; }
-	operator const float *() const { return static_cast<const float*>(&row[0].x); }
+	operator const float *() const { return data(); }
+	// the 16 floats of the rows, row major, as passed to the kernels
+	float *data() { return reinterpret_cast<float*>(this); }
+	const float *data() const { return reinterpret_cast<const float*>(this); }
 	// methods
 	mat4 operator * (float s) const { return mat4(s*row[0], s*row[1], s*row[2], s*row[3]); }
 	friend mat4 operator * (float s, const mat4 &m) { return m*s; }
 	mat4 operator * (const mat4 &m) const {
-		mat4 a(0);
-		for (int i = 0; i < 4; i++)
-			for (int j = 0; j < 4; j++)
-				for (int k = 0; k < 4; k++)
-					a[i][j] += row[i][k]*m[k][j];
-		return a;
+		// every element is written, so the product goes through uninitialized floats
+		// rather than a zero filled mat4
+		float a[16];
+		MultiplyMat4(data(), m.data(), a);
+		return mat4(vec4(a), vec4(a+4), vec4(a+8), vec4(a+12));
 	}
-	vec4 operator * (const vec4 &v) const { return vec4(dot(row[0], v), dot(row[1], v), dot(row[2], v), dot(row[3], v)); }
+	vec4 operator * (const vec4 &v) const { vec4 a; TransformVec4(data(), &v.x, &a.x); return a; }
 };
 
+static_assert(sizeof(mat4) == 16*sizeof(float), "mat4 must be 16 packed floats");
+
 inline mat4 Scale(float x, float y, float z) {
 	mat4 c;
 	c[0][0] = x;
@@ -343,10 +456,9 @@ inline mat4 LookTowards(vec3 eye, vec3 lookV, vec3 up) {
 inline mat4 LookAt(vec3 eye, vec3 lookat, vec3 up) { return LookTowards(eye, lookat-eye, up); }
 
 inline mat4 Transpose(mat4 m) {
-	return mat4(vec4(m[0][0], m[1][0], m[2][0], m[3][0]),
-				vec4(m[0][1], m[1][1], m[2][1], m[3][1]),
-				vec4(m[0][2], m[1][2], m[2][2], m[3][2]),
-				vec4(m[0][3], m[1][3], m[2][3], m[3][3]));
+	mat4 t(0);
+	TransposeMat4(m.data(), t.data());
+	return t;
 }
 
 inline bool InverseMatrix4x4(const float *m, float *out) {
@@ -394,10 +506,299 @@ inline bool InverseMatrix4x4(const float *m, float *out) {
 
 inline mat4 Invert(mat4 m) {
 	mat4 inv;
-	InverseMatrix4x4(&m[0][0], &inv[0][0]);
+	InverseMatrix4x4(m.data(), inv.data());
 	return inv;
 }
 
+// batch operations
+
+// operate on arrays at once, points and vectors as structure of arrays (SoA) streams,
+// one float array per component; outputs may alias inputs
+//     TransformPoints(m, x, y, z, ox, oy, oz, n);      // affine transform of n points
+//     TransformVectors(m, x, y, z, ox, oy, oz, n);     // upper 3x3 only, no translation
+//     TransformNormals(m, x, y, z, ox, oy, oz, n);     // upper 3x3, renormalized
+//     MultiplyMat4s(a, bs, outs, n);                   // outs[i] = a*bs[i]
+//     MultiplyMat4s(as, bs, outs, n);                  // outs[i] = as[i]*bs[i]
+//     TranslateRotate(x, y, z, degrees, axis, outs, n); // outs[i] = Translate(x, y, z)*rotation
+//     ComputeAABB(x, y, z, n, min, max);
+// each takes an optional thread count, large batches are split in chunks across threads,
+// and an optional ParallelExecutor to run the chunks on
+
+// SimdFloat holds SIMD_LANES floats of the path selected at the top of the file,
+// SimdMask the per-lane result of a comparison for SimdSelect; SimdUnpackBytes
+// converts the low three bytes of SIMD_LANES packed 32 bit values (e.g. RGBA8)
+
+#if defined(VECMAT_AVX)
+typedef __m256 SimdFloat;
+const int SIMD_LANES = 8;
+inline SimdFloat SimdLoad(const float *p) { return _mm256_loadu_ps(p); }
+inline void SimdStore(float *p, SimdFloat v) { _mm256_storeu_ps(p, v); }
+inline SimdFloat SimdSet(float s) { return _mm256_set1_ps(s); }
+inline SimdFloat SimdAdd(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a, b); }
+inline SimdFloat SimdMul(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a, b); }
+inline SimdFloat SimdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a, b); }
+inline SimdFloat SimdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a, b); }
+inline SimdFloat SimdSqrt(SimdFloat a) { return _mm256_sqrt_ps(a); }
+inline SimdFloat SimdSub(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a, b); }
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a, b); }
+inline SimdFloat SimdTrunc(SimdFloat a) { return _mm256_round_ps(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+typedef __m256 SimdMask;
+inline SimdMask SimdEqual(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+inline SimdMask SimdLess(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline SimdFloat SimdSelect(SimdMask m, SimdFloat a, SimdFloat b) { return _mm256_blendv_ps(b, a, m); }
+// no 256 bit integer ops before AVX2, so the bytes are unpacked in two halves
+inline void SimdUnpackBytes(const uint32_t *p, SimdFloat &b0, SimdFloat &b1, SimdFloat &b2) {
+	__m128i lo = _mm_loadu_si128((const __m128i*)p), hi = _mm_loadu_si128((const __m128i*)(p+4)), mask = _mm_set1_epi32(0xFF);
+	auto unpack = [&](int shift) {
+		__m128 l = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(lo, shift), mask));
+		__m128 h = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(hi, shift), mask));
+		return _mm256_insertf128_ps(_mm256_castps128_ps256(l), h, 1);
+	};
+	b0 = unpack(0);
+	b1 = unpack(8);
+	b2 = unpack(16);
+}
+#elif defined(VECMAT_SSE2)
+typedef __m128 SimdFloat;
+const int SIMD_LANES = 4;
+inline SimdFloat SimdLoad(const float *p) { return _mm_loadu_ps(p); }
+inline void SimdStore(float *p, SimdFloat v) { _mm_storeu_ps(p, v); }
+inline SimdFloat SimdSet(float s) { return _mm_set1_ps(s); }
+inline SimdFloat SimdAdd(SimdFloat a, SimdFloat b) { return _mm_add_ps(a, b); }
+inline SimdFloat SimdMul(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a, b); }
+inline SimdFloat SimdMin(SimdFloat a, SimdFloat b) { return _mm_min_ps(a, b); }
+inline SimdFloat SimdMax(SimdFloat a, SimdFloat b) { return _mm_max_ps(a, b); }
+inline SimdFloat SimdSqrt(SimdFloat a) { return _mm_sqrt_ps(a); }
+inline SimdFloat SimdSub(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a, b); }
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { return _mm_div_ps(a, b); }
+// only exact for |a| < 2^31, which covers every use here
+inline SimdFloat SimdTrunc(SimdFloat a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a)); }
+typedef __m128 SimdMask;
+inline SimdMask SimdEqual(SimdFloat a, SimdFloat b) { return _mm_cmpeq_ps(a, b); }
+inline SimdMask SimdLess(SimdFloat a, SimdFloat b) { return _mm_cmplt_ps(a, b); }
+inline SimdFloat SimdSelect(SimdMask m, SimdFloat a, SimdFloat b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+inline void SimdUnpackBytes(const uint32_t *p, SimdFloat &b0, SimdFloat &b1, SimdFloat &b2) {
+	__m128i v = _mm_loadu_si128((const __m128i*)p), mask = _mm_set1_epi32(0xFF);
+	b0 = _mm_cvtepi32_ps(_mm_and_si128(v, mask));
+	b1 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 8), mask));
+	b2 = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 16), mask));
+}
+#elif defined(VECMAT_NEON)
+typedef float32x4_t SimdFloat;
+const int SIMD_LANES = 4;
+inline SimdFloat SimdLoad(const float *p) { return vld1q_f32(p); }
+inline void SimdStore(float *p, SimdFloat v) { vst1q_f32(p, v); }
+inline SimdFloat SimdSet(float s) { return vdupq_n_f32(s); }
+inline SimdFloat SimdAdd(SimdFloat a, SimdFloat b) { return vaddq_f32(a, b); }
+inline SimdFloat SimdMul(SimdFloat a, SimdFloat b) { return vmulq_f32(a, b); }
+inline SimdFloat SimdMin(SimdFloat a, SimdFloat b) { return vminq_f32(a, b); }
+inline SimdFloat SimdMax(SimdFloat a, SimdFloat b) { return vmaxq_f32(a, b); }
+#if defined(__aarch64__)
+inline SimdFloat SimdSqrt(SimdFloat a) { return vsqrtq_f32(a); }
+#else
+inline SimdFloat SimdSqrt(SimdFloat a) { float f[4]; vst1q_f32(f, a); for (int i = 0; i < 4; i++) f[i] = sqrtf(f[i]); return vld1q_f32(f); }
+#endif
+inline SimdFloat SimdSub(SimdFloat a, SimdFloat b) { return vsubq_f32(a, b); }
+#if defined(__aarch64__)
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { return vdivq_f32(a, b); }
+#else
+// no divide on 32 bit NEON, and the reciprocal estimate isn't exact
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { float fa[4], fb[4]; vst1q_f32(fa, a); vst1q_f32(fb, b); for (int i = 0; i < 4; i++) fa[i] /= fb[i]; return vld1q_f32(fa); }
+#endif
+inline SimdFloat SimdTrunc(SimdFloat a) { return vcvtq_f32_s32(vcvtq_s32_f32(a)); }
+typedef uint32x4_t SimdMask;
+inline SimdMask SimdEqual(SimdFloat a, SimdFloat b) { return vceqq_f32(a, b); }
+inline SimdMask SimdLess(SimdFloat a, SimdFloat b) { return vcltq_f32(a, b); }
+inline SimdFloat SimdSelect(SimdMask m, SimdFloat a, SimdFloat b) { return vbslq_f32(m, a, b); }
+inline void SimdUnpackBytes(const uint32_t *p, SimdFloat &b0, SimdFloat &b1, SimdFloat &b2) {
+	uint32x4_t v = vld1q_u32(p), mask = vdupq_n_u32(0xFF);
+	b0 = vcvtq_f32_u32(vandq_u32(v, mask));
+	b1 = vcvtq_f32_u32(vandq_u32(vshrq_n_u32(v, 8), mask));
+	b2 = vcvtq_f32_u32(vandq_u32(vshrq_n_u32(v, 16), mask));
+}
+#else
+typedef float SimdFloat;
+const int SIMD_LANES = 1;
+inline SimdFloat SimdLoad(const float *p) { return *p; }
+inline void SimdStore(float *p, SimdFloat v) { *p = v; }
+inline SimdFloat SimdSet(float s) { return s; }
+inline SimdFloat SimdAdd(SimdFloat a, SimdFloat b) { return a+b; }
+inline SimdFloat SimdMul(SimdFloat a, SimdFloat b) { return a*b; }
+inline SimdFloat SimdMin(SimdFloat a, SimdFloat b) { return a < b ? a : b; }
+inline SimdFloat SimdMax(SimdFloat a, SimdFloat b) { return a > b ? a : b; }
+inline SimdFloat SimdSqrt(SimdFloat a) { return sqrtf(a); }
+inline SimdFloat SimdSub(SimdFloat a, SimdFloat b) { return a-b; }
+inline SimdFloat SimdDiv(SimdFloat a, SimdFloat b) { return a/b; }
+inline SimdFloat SimdTrunc(SimdFloat a) { return truncf(a); }
+typedef bool SimdMask;
+inline SimdMask SimdEqual(SimdFloat a, SimdFloat b) { return a == b; }
+inline SimdMask SimdLess(SimdFloat a, SimdFloat b) { return a < b; }
+inline SimdFloat SimdSelect(SimdMask m, SimdFloat a, SimdFloat b) { return m ? a : b; }
+inline void SimdUnpackBytes(const uint32_t *p, SimdFloat &b0, SimdFloat &b1, SimdFloat &b2) {
+	b0 = (float)(*p & 0xFF);
+	b1 = (float)((*p >> 8) & 0xFF);
+	b2 = (float)((*p >> 16) & 0xFF);
+}
+#endif
+
+// threading: chunks are at least PARALLEL_MIN_CHUNK elements, so small batches
+// stay on the calling thread instead of paying for thread startup. Without a
+// ParallelExecutor each call starts a thread per extra chunk, fine for one-off
+// batches; per frame callers should pass one that runs the chunks on persistent
+// threads. It must call fn(chunk) once for every chunk in [0, chunks) and return
+// once all have run.
+
+typedef std::function<void(size_t chunks, const std::function<void(size_t chunk)> &fn)> ParallelExecutor;
+
+const size_t PARALLEL_MIN_CHUNK = 16384;
+
+inline size_t ParallelChunkCount(size_t count, int threads) {
+	size_t chunks = (count+PARALLEL_MIN_CHUNK-1)/PARALLEL_MIN_CHUNK;
+	return std::max<size_t>(1, std::min<size_t>(chunks, threads > 1 ? threads : 1));
+}
+
+template <typename Fn>
+inline void ParallelRanges(size_t count, int threads, Fn fn, const ParallelExecutor &executor = nullptr) {
+	// calls fn(chunk, begin, end) for each chunk, the first on the calling thread
+	// unless an executor runs them
+	size_t chunks = ParallelChunkCount(count, threads);
+	size_t perChunk = (count+chunks-1)/chunks;
+	if (executor && chunks > 1) {
+		executor(chunks, [&](size_t c) { fn(c, std::min(count, c*perChunk), std::min(count, (c+1)*perChunk)); });
+		return;
+	}
+	std::vector<std::thread> workers;
+	for (size_t c = 1; c < chunks; c++)
+		workers.emplace_back(fn, c, std::min(count, c*perChunk), std::min(count, (c+1)*perChunk));
+	fn((size_t)0, (size_t)0, std::min(count, perChunk));
+	for (std::thread &worker : workers)
+		worker.join();
+}
+
+inline void TransformStreams(const mat4 &m, bool translate, bool renormalize, const float *x, const float *y, const float *z,
+							 float *outX, float *outY, float *outZ, size_t count, int threads, const ParallelExecutor &executor) {
+	ParallelRanges(count, threads, [&](size_t, size_t begin, size_t end) {
+		SimdFloat m00 = SimdSet(m[0][0]), m01 = SimdSet(m[0][1]), m02 = SimdSet(m[0][2]), m03 = SimdSet(translate ? m[0][3] : 0);
+		SimdFloat m10 = SimdSet(m[1][0]), m11 = SimdSet(m[1][1]), m12 = SimdSet(m[1][2]), m13 = SimdSet(translate ? m[1][3] : 0);
+		SimdFloat m20 = SimdSet(m[2][0]), m21 = SimdSet(m[2][1]), m22 = SimdSet(m[2][2]), m23 = SimdSet(translate ? m[2][3] : 0);
+		size_t i = begin;
+		for (; i+SIMD_LANES <= end; i += SIMD_LANES) {
+			SimdFloat px = SimdLoad(x+i), py = SimdLoad(y+i), pz = SimdLoad(z+i);
+			SimdFloat ox = SimdAdd(SimdAdd(SimdMul(m00, px), SimdMul(m01, py)), SimdAdd(SimdMul(m02, pz), m03));
+			SimdFloat oy = SimdAdd(SimdAdd(SimdMul(m10, px), SimdMul(m11, py)), SimdAdd(SimdMul(m12, pz), m13));
+			SimdFloat oz = SimdAdd(SimdAdd(SimdMul(m20, px), SimdMul(m21, py)), SimdAdd(SimdMul(m22, pz), m23));
+			if (renormalize) {
+				// divide (not reciprocal estimate) to match normalize()
+				SimdFloat len = SimdSqrt(SimdAdd(SimdAdd(SimdMul(ox, ox), SimdMul(oy, oy)), SimdMul(oz, oz)));
+				float l[SIMD_LANES], r[SIMD_LANES];
+				SimdStore(l, len);
+				for (int k = 0; k < SIMD_LANES; k++)
+					r[k] = 1.f/l[k];
+				SimdFloat rcp = SimdLoad(r);
+				ox = SimdMul(ox, rcp); oy = SimdMul(oy, rcp); oz = SimdMul(oz, rcp);
+			}
+			SimdStore(outX+i, ox);
+			SimdStore(outY+i, oy);
+			SimdStore(outZ+i, oz);
+		}
+		for (; i < end; i++) {
+			vec3 v = vec3(m[0][0]*x[i]+m[0][1]*y[i]+m[0][2]*z[i], m[1][0]*x[i]+m[1][1]*y[i]+m[1][2]*z[i], m[2][0]*x[i]+m[2][1]*y[i]+m[2][2]*z[i]);
+			if (translate)
+				v += vec3(m[0][3], m[1][3], m[2][3]);
+			if (renormalize)
+				v = normalize(v);
+			outX[i] = v.x; outY[i] = v.y; outZ[i] = v.z;
+		}
+	}, executor);
+}
+
+inline void TransformPoints(const mat4 &m, const float *x, const float *y, const float *z, float *outX, float *outY, float *outZ, size_t count, int threads = 1, const ParallelExecutor &executor = nullptr) {
+	// affine, the bottom row of m is ignored
+	TransformStreams(m, true, false, x, y, z, outX, outY, outZ, count, threads, executor);
+}
+
+inline void TransformVectors(const mat4 &m, const float *x, const float *y, const float *z, float *outX, float *outY, float *outZ, size_t count, int threads = 1, const ParallelExecutor &executor = nullptr) {
+	TransformStreams(m, false, false, x, y, z, outX, outY, outZ, count, threads, executor);
+}
+
+inline void TransformNormals(const mat4 &m, const float *x, const float *y, const float *z, float *outX, float *outY, float *outZ, size_t count, int threads = 1, const ParallelExecutor &executor = nullptr) {
+	// m should be the inverse transpose of the point transform if that scales non-uniformly
+	TransformStreams(m, false, true, x, y, z, outX, outY, outZ, count, threads, executor);
+}
+
+inline void MultiplyMat4s(const mat4 &a, const mat4 *b, mat4 *out, size_t count, int threads = 1, const ParallelExecutor &executor = nullptr) {
+	ParallelRanges(count, threads, [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			MultiplyMat4(a.data(), b[i].data(), out[i].data());
+	}, executor);
+}
+
+inline void MultiplyMat4s(const mat4 *a, const mat4 *b, mat4 *out, size_t count, int threads = 1, const ParallelExecutor &executor = nullptr) {
+	ParallelRanges(count, threads, [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			MultiplyMat4(a[i].data(), b[i].data(), out[i].data());
+	}, executor);
+}
+
+inline void TranslateRotate(const float *x, const float *y, const float *z, const float *degrees, vec3 axis, mat4 *out, size_t count,
+							bool transpose = false, int threads = 1, const ParallelExecutor &executor = nullptr) {
+	// rotation by degrees[i] about unit axis (Rodrigues), then translation by (x[i], y[i], z[i])
+	// transpose writes column major matrices, as expected by shaders
+	ParallelRanges(count, threads, [&](size_t, size_t begin, size_t end) {
+		float ax = axis.x, ay = axis.y, az = axis.z;
+		for (size_t i = begin; i < end; i++) {
+			float angle = DegreesToRadians*degrees[i], c = cosf(angle), s = sinf(angle), t = 1-c;
+			float m[16] = {
+				c+ax*ax*t,    ax*ay*t-az*s, ax*az*t+ay*s, x[i],
+				ay*ax*t+az*s, c+ay*ay*t,    ay*az*t-ax*s, y[i],
+				az*ax*t-ay*s, az*ay*t+ax*s, c+az*az*t,    z[i],
+				0,            0,            0,            1 };
+			if (transpose)
+				TransposeMat4(m, out[i].data());
+			else
+				memcpy(out[i].data(), m, sizeof(m));
+		}
+	}, executor);
+}
+
+inline void ComputeAABB(const float *x, const float *y, const float *z, size_t count, vec3 &min, vec3 &max, int threads = 1, const ParallelExecutor &executor = nullptr) {
+	// empty input gives min = FLT_MAX, max = -FLT_MAX
+	std::vector<vec3> mins(ParallelChunkCount(count, threads), vec3(FLT_MAX)), maxs(mins.size(), vec3(-FLT_MAX));
+	ParallelRanges(count, threads, [&](size_t chunk, size_t begin, size_t end) {
+		SimdFloat lo[3] = { SimdSet(FLT_MAX), SimdSet(FLT_MAX), SimdSet(FLT_MAX) };
+		SimdFloat hi[3] = { SimdSet(-FLT_MAX), SimdSet(-FLT_MAX), SimdSet(-FLT_MAX) };
+		const float *p[3] = { x, y, z };
+		size_t i = begin;
+		for (; i+SIMD_LANES <= end; i += SIMD_LANES)
+			for (int k = 0; k < 3; k++) {
+				SimdFloat v = SimdLoad(p[k]+i);
+				lo[k] = SimdMin(lo[k], v);
+				hi[k] = SimdMax(hi[k], v);
+			}
+		vec3 &mn = mins[chunk], &mx = maxs[chunk];
+		for (int k = 0; k < 3; k++) {
+			float l[SIMD_LANES], h[SIMD_LANES];
+			SimdStore(l, lo[k]);
+			SimdStore(h, hi[k]);
+			for (int j = 0; j < SIMD_LANES; j++) {
+				mn[k] = std::min(mn[k], l[j]);
+				mx[k] = std::max(mx[k], h[j]);
+			}
+			for (size_t j = i; j < end; j++) {
+				mn[k] = std::min(mn[k], p[k][j]);
+				mx[k] = std::max(mx[k], p[k][j]);
+			}
+		}
+	}, executor);
+	min = vec3(FLT_MAX);
+	max = vec3(-FLT_MAX);
+	for (size_t c = 0; c < mins.size(); c++)
+		for (int k = 0; k < 3; k++) {
+			min[k] = std::min(min[k], mins[c][k]);
+			max[k] = std::max(max[k], maxs[c][k]);
+		}
+}
+
 #endif // VEC_MAT_HDR
 
 /* void Adjoint3x3(double in[][3], double out[][3]) {
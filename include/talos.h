@@ -6,12 +6,12 @@
 // version.
 // 
 // Includes some basic debugging messages, enabled by defining the preprocessor
-// directive TALOS_ENABLE_DEBUG
+// directive TALOS_ENABLE_DEBUG, and CPU zone tracing, enabled by defining
+// TALOS_ENABLE_TRACING
 //
 // --- TODO ---
 // - Enable / setup vulkan validation layers
 // - Set up specific debug messenger for instance creation/destruction
-// - Add better device suitability checks (score devices, prioritize discrete GPUs)
 
 #ifndef TALOS_HDR
 #define TALOS_HDR
@@ -23,7 +23,38 @@
 #include <fstream>
 #include <stdexcept>
 #include <set>
+#include <map>
 #include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #pragma warning(disable : 26812) // Disable enum class warning from Vulkan enums
 
@@ -52,11 +83,17 @@ namespace Talos {
     // Struct for keeping track of queue family indices, specifically those with
     // graphics and presentation support. On many devices, these two may be the 
     // same, but worth keeping track of both independently for the cases they are
-    // not.
+    // not. When queried without a surface (headless), no present family is needed.
+    // computeFamily and transferFamily are only set for dedicated families (compute
+    // without graphics, transfer without graphics or compute), work submitted there
+    // can overlap with the graphics queue. Without them, use the graphics family.
     struct QueueFamilyIndices {
         std::optional<uint32_t> graphicsFamily = std::nullopt;
         std::optional<uint32_t> presentFamily = std::nullopt;
-        bool isComplete() { return graphicsFamily.has_value() && presentFamily.has_value(); }
+        std::optional<uint32_t> computeFamily = std::nullopt;
+        std::optional<uint32_t> transferFamily = std::nullopt;
+        bool headless = false;
+        bool isComplete() { return graphicsFamily.has_value() && (headless || presentFamily.has_value()); }
     };
 
     // ---- FUNCTIONS ----
@@ -77,9 +114,11 @@ namespace Talos {
     }
 
     // Retrieves queue families from device, takes the physical device to query
-    // and the surface being presented to as a parameter.
+    // and the surface being presented to as a parameter. Passing VK_NULL_HANDLE as
+    // the surface skips the presentation checks for headless use.
     QueueFamilyIndices getQueueFamilies(VkPhysicalDevice device, VkSurfaceKHR surface) {
         QueueFamilyIndices queueFamilyIndices;
+        queueFamilyIndices.headless = surface == VK_NULL_HANDLE;
         // Retrieve queue families for device
         uint32_t queueFamilyCount = 0;
         vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
@@ -87,16 +126,27 @@ namespace Talos {
             return queueFamilyIndices;
         std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
         vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
-        // Check for queue families with graphics and presentation support
+        // Check for queue families with graphics and presentation support, keeping
+        // the first match and preferring a graphics family that can also present
         for (uint32_t i = 0; i < queueFamilyCount; i++) {
-            // Checks if queue family supports graphics
-            if (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
-                queueFamilyIndices.graphicsFamily = i;
+            VkQueueFlags flags = queueFamilies[i].queueFlags;
+            bool graphics = flags & VK_QUEUE_GRAPHICS_BIT;
             // Checks if queue family supports presentation
             VkBool32 present = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &present);
-            if (present)
+            if (!queueFamilyIndices.headless)
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &present);
+            if (graphics && (!queueFamilyIndices.graphicsFamily.has_value() || (present && queueFamilyIndices.graphicsFamily != queueFamilyIndices.presentFamily))) {
+                queueFamilyIndices.graphicsFamily = i;
+                if (present)
+                    queueFamilyIndices.presentFamily = i;
+            }
+            if (present && !queueFamilyIndices.presentFamily.has_value())
                 queueFamilyIndices.presentFamily = i;
+            // Checks for dedicated async compute and transfer-only (DMA) families
+            if ((flags & VK_QUEUE_COMPUTE_BIT) && !graphics && !queueFamilyIndices.computeFamily.has_value())
+                queueFamilyIndices.computeFamily = i;
+            if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) && !queueFamilyIndices.transferFamily.has_value())
+                queueFamilyIndices.transferFamily = i;
         }
         return queueFamilyIndices;
     }
@@ -126,8 +176,9 @@ namespace Talos {
 
     // Checks if physical device is suitable for usage with Vulkan. Takes the physical
     // device, the surface being presented to, and a vector of the required extensions.
-    // No checks for whether a device might be more preferable (integrated vs. discrete),
-    // max buffer sizes, etc.
+    // Only checks whether the device can be used at all. Preference between usable
+    // devices (discrete over integrated, local memory, limits) comes from
+    // scorePhysicalDevice. Without a surface the swapchain checks are skipped.
     bool isDeviceSuitable(VkPhysicalDevice device, VkSurfaceKHR surface, std::vector<const char*> deviceExtensions) {
         // Check if device has queue family with graphics and present capabilities
         QueueFamilyIndices queueFamilyIndices = getQueueFamilies(device, surface);
@@ -140,8 +191,8 @@ namespace Talos {
         for (const VkExtensionProperties& extension : availableExtensions)
             requiredExtensions.erase(extension.extensionName);
         // Check if swapchain adequate
-        bool adequateSwapchain = false;
-        if (requiredExtensions.empty()) {
+        bool adequateSwapchain = surface == VK_NULL_HANDLE;
+        if (requiredExtensions.empty() && !adequateSwapchain) {
             SwapchainSupportDetails swapchainSupport = querySwapchainSupport(device, surface);
             adequateSwapchain = !swapchainSupport.formats.empty() && !swapchainSupport.presentModes.empty();
         }
@@ -149,8 +200,9 @@ namespace Talos {
     }
 
     // Creates and returns the Vulkan instance. Sets the application name and version 
-    // using parameters passed to the function.
-    VkInstance createVkInstance(const char* applicationName, int version[3]) {
+    // using parameters passed to the function. Headless instances don't enable the
+    // surface extensions GLFW asks for, so GLFW doesn't need to be initialized.
+    VkInstance createVkInstance(const char* applicationName, int version[3], bool headless = false) {
         // Create application info struct
         VkApplicationInfo appInfo{};
         appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
@@ -162,7 +214,7 @@ namespace Talos {
         std::vector<const char*> extensions;
         // Get instance extensions required by GLFW
         uint32_t glfwExtensionCount = 0;
-        const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        const char** glfwExtensions = headless ? nullptr : glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
         for (size_t i = 0; i < glfwExtensionCount; i++)
             extensions.push_back(glfwExtensions[i]);
         #ifdef TALOS_ENABLE_DEBUG
@@ -191,8 +243,50 @@ namespace Talos {
         return instance;
     }
 
-    // Select physical device 
-    VkPhysicalDevice selectPhysicalDevice(VkInstance instance, VkSurfaceKHR surface, std::vector<const char*> extensions) {
+    // Returns a readable name for a physical device type
+    const char* deviceTypeName(VkPhysicalDeviceType type) {
+        switch (type) {
+            case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return "Discrete GPU";
+            case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return "Integrated GPU";
+            case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return "Virtual GPU";
+            case VK_PHYSICAL_DEVICE_TYPE_CPU: return "CPU";
+            default: return "Other";
+        }
+    }
+
+    // Scores a physical device for selection, higher is better. Devices are ordered
+    // by type first (discrete > integrated > virtual > CPU > other), then by the size
+    // of their device local heaps, then by max 2D image size and compute workgroup
+    // invocations. Each criterion is packed into its own bits so an earlier one always
+    // wins over a later one.
+    uint64_t scorePhysicalDevice(VkPhysicalDevice device) {
+        VkPhysicalDeviceProperties props;
+        vkGetPhysicalDeviceProperties(device, &props);
+        VkPhysicalDeviceMemoryProperties memProps;
+        vkGetPhysicalDeviceMemoryProperties(device, &memProps);
+        uint64_t typeRank = 0;
+        switch (props.deviceType) {
+            case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: typeRank = 4; break;
+            case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: typeRank = 3; break;
+            case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: typeRank = 2; break;
+            case VK_PHYSICAL_DEVICE_TYPE_CPU: typeRank = 1; break;
+            default: typeRank = 0; break;
+        }
+        // Sum device local heap sizes in MiB
+        uint64_t localMiB = 0;
+        for (uint32_t i = 0; i < memProps.memoryHeapCount; i++)
+            if (memProps.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+                localMiB += memProps.memoryHeaps[i].size >> 20;
+        uint64_t imageDim = std::min<uint64_t>(props.limits.maxImageDimension2D, 0xFFFF);
+        uint64_t invocations = std::min<uint64_t>(props.limits.maxComputeWorkGroupInvocations, 0xFFFF);
+        return (typeRank << 56) | (std::min<uint64_t>(localMiB, 0xFFFFFF) << 32) | (imageDim << 16) | invocations;
+    }
+
+    // Returns all physical devices, best scored first. The TALOS_DEVICE environment
+    // variable overrides the ranking, it takes either a device index (in enumeration
+    // order) or a case insensitive substring of the device name, and moves the
+    // matching device to the front.
+    std::vector<VkPhysicalDevice> rankPhysicalDevices(VkInstance instance) {
         // Get number of physical devices
         uint32_t device_count = 0;
         vkEnumeratePhysicalDevices(instance, &device_count, nullptr);
@@ -201,53 +295,101 @@ namespace Talos {
         // Enumerate all found physical devices
         std::vector<VkPhysicalDevice> devices(device_count);
         vkEnumeratePhysicalDevices(instance, &device_count, devices.data());
-        // Pick a suitable device
+        std::vector<uint64_t> scores(device_count);
+        for (uint32_t i = 0; i < device_count; i++)
+            scores[i] = scorePhysicalDevice(devices[i]);
+        // Check for override, match by index first and then by name
+        const char* env = getenv("TALOS_DEVICE");
+        if (env != nullptr && *env != '\0') {
+            std::string wanted(env);
+            std::transform(wanted.begin(), wanted.end(), wanted.begin(), [](unsigned char c) { return (char)tolower(c); });
+            char* end = nullptr;
+            unsigned long index = strtoul(env, &end, 10);
+            int matched = *end == '\0' && index < device_count ? (int)index : -1;
+            for (uint32_t i = 0; i < device_count && matched < 0; i++) {
+                VkPhysicalDeviceProperties props;
+                vkGetPhysicalDeviceProperties(devices[i], &props);
+                std::string name(props.deviceName);
+                std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return (char)tolower(c); });
+                if (name.find(wanted) != std::string::npos)
+                    matched = (int)i;
+            }
+            if (matched >= 0)
+                scores[matched] = UINT64_MAX;
+            else
+                printf("TALOS_DEVICE='%s' doesn't match any device, ignoring.\n", env);
+        }
+        // Sort devices by descending score, stable so ties keep enumeration order
+        std::vector<uint32_t> order(device_count);
+        for (uint32_t i = 0; i < device_count; i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return scores[a] > scores[b]; });
+        std::vector<VkPhysicalDevice> ranked;
+        for (uint32_t i : order)
+            ranked.push_back(devices[i]);
+        #ifdef TALOS_ENABLE_DEBUG
+        printf("Physical devices by preference:\n");
+        for (uint32_t i : order) {
+            VkPhysicalDeviceProperties props;
+            vkGetPhysicalDeviceProperties(devices[i], &props);
+            printf("\t[%u] '%s' (%s), score %016llx\n", i, props.deviceName, deviceTypeName(props.deviceType), (unsigned long long)scores[i]);
+        }
+        #endif
+        return ranked;
+    }
+
+    // Selects the best scored physical device that is suitable, see rankPhysicalDevices.
+    // An override naming an unsuitable device falls back to the next best one.
+    VkPhysicalDevice selectPhysicalDevice(VkInstance instance, VkSurfaceKHR surface, std::vector<const char*> extensions) {
+        // Pick the first suitable device in order of preference
         VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
-        for (const VkPhysicalDevice device : devices)
+        for (const VkPhysicalDevice device : rankPhysicalDevices(instance))
             if (isDeviceSuitable(device, surface, extensions)) { physicalDevice = device; break; }
         if (physicalDevice == VK_NULL_HANDLE)
             throw std::runtime_error("Failed to find a suitable GPU!");
         // Retrieve device properties, report selected device
         VkPhysicalDeviceProperties device_props;
         vkGetPhysicalDeviceProperties(physicalDevice, &device_props);
-        printf("Selected GPU '%s'.\n", device_props.deviceName);
+        printf("Selected GPU '%s' (%s).\n", device_props.deviceName, deviceTypeName(device_props.deviceType));
         #ifdef TALOS_ENABLE_DEBUG
-        string t;
-        switch (device_props.deviceType) {
-            case VK_PHYSICAL_DEVICE_TYPE_CPU: t = "CPU";
-            case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: t = "Discrete GPU";
-            case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: t = "Integrated GPU";
-            case VK_PHYSICAL_DEVICE_TYPE_OTHER: t = "Other";
-            case VK_PHYSICAL_DEVICE_TYPE_MAX_ENUM: t = "Error";
-        }
-        printf("\tType: %s\n", t);
-        printf("\tAPI version: %d\n", device_props.apiVersion);
-        pritnf("\tDriver version: %d\n", device_props.driverVersion);
+        printf("\tAPI version: %u.%u.%u\n", VK_VERSION_MAJOR(device_props.apiVersion), VK_VERSION_MINOR(device_props.apiVersion), VK_VERSION_PATCH(device_props.apiVersion));
+        printf("\tDriver version: %u\n", device_props.driverVersion);
         #endif
         return physicalDevice;
     }
 
     // Creates logical device along with graphics and presentation queue, which are
-    // written to the addresses passed in the function parameters.
-    VkDevice createLogicalDevice(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface, std::vector<const char*> deviceExtensions, VkQueue* graphicsQueue, VkQueue* presentQueue) {
+    // written to the addresses passed in the function parameters. Without a surface
+    // no present queue is created and presentQueue may be nullptr. If computeQueue or
+    // transferQueue are passed, they receive a queue from the dedicated compute or
+    // transfer family when the device has one, and the graphics queue otherwise.
+    VkDevice createLogicalDevice(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface, std::vector<const char*> deviceExtensions, VkQueue* graphicsQueue, VkQueue* presentQueue, VkQueue* computeQueue = nullptr, VkQueue* transferQueue = nullptr) {
         QueueFamilyIndices queueFamilyIndices = getQueueFamilies(physicalDevice, surface);
+        uint32_t graphicsFamily = queueFamilyIndices.graphicsFamily.value();
+        uint32_t computeFamily = queueFamilyIndices.computeFamily.value_or(graphicsFamily);
+        uint32_t transferFamily = queueFamilyIndices.transferFamily.value_or(graphicsFamily);
         float queuePriority = 1.0f;
-        // Create graphics queue creation info struct
-        VkDeviceQueueCreateInfo gfxQueueCreateInfo{};
-        gfxQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        gfxQueueCreateInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-        gfxQueueCreateInfo.queueCount = 1;
-        gfxQueueCreateInfo.pQueuePriorities = &queuePriority;
-        // Create presentation queue creation info struct
-        VkDeviceQueueCreateInfo prsQueueCreateInfo{};
-        prsQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        prsQueueCreateInfo.queueFamilyIndex = queueFamilyIndices.presentFamily.value();
-        prsQueueCreateInfo.queueCount = 1;
-        prsQueueCreateInfo.pQueuePriorities = &queuePriority;
+        // Create one queue creation info struct per distinct family, graphics and
+        // presentation usually share one (and CPU implementations only have one)
+        std::set<uint32_t> uniqueFamilies{ graphicsFamily };
+        if (queueFamilyIndices.presentFamily.has_value())
+            uniqueFamilies.insert(queueFamilyIndices.presentFamily.value());
+        if (computeQueue != nullptr)
+            uniqueFamilies.insert(computeFamily);
+        if (transferQueue != nullptr)
+            uniqueFamilies.insert(transferFamily);
+        std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+        for (uint32_t family : uniqueFamilies) {
+            VkDeviceQueueCreateInfo queueCreateInfo{};
+            queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+            queueCreateInfo.queueFamilyIndex = family;
+            queueCreateInfo.queueCount = 1;
+            queueCreateInfo.pQueuePriorities = &queuePriority;
+            queueCreateInfos.push_back(queueCreateInfo);
+        }
         // Create device features struct
         VkPhysicalDeviceFeatures deviceFeatures{};
         // Create logical device creation info struct
-        std::vector<VkDeviceQueueCreateInfo> queueCreateInfos{ gfxQueueCreateInfo, prsQueueCreateInfo };
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
@@ -261,8 +403,13 @@ namespace Talos {
         if (res != VK_SUCCESS)
             throw std::runtime_error("Failed to create logical device!");
         // Get graphics queue, write to addresses passed into function parameters
-        vkGetDeviceQueue(logicalDevice, queueFamilyIndices.graphicsFamily.value(), 0, graphicsQueue);
-        vkGetDeviceQueue(logicalDevice, queueFamilyIndices.presentFamily.value(), 0, presentQueue);
+        vkGetDeviceQueue(logicalDevice, graphicsFamily, 0, graphicsQueue);
+        if (presentQueue != nullptr && queueFamilyIndices.presentFamily.has_value())
+            vkGetDeviceQueue(logicalDevice, queueFamilyIndices.presentFamily.value(), 0, presentQueue);
+        if (computeQueue != nullptr)
+            vkGetDeviceQueue(logicalDevice, computeFamily, 0, computeQueue);
+        if (transferQueue != nullptr)
+            vkGetDeviceQueue(logicalDevice, transferFamily, 0, transferQueue);
         return logicalDevice;
     }
 
@@ -361,7 +508,9 @@ namespace Talos {
         return swapchainDetails;
     }
 
-    VkRenderPass createRenderPass(VkDevice logicalDevice, VkFormat imageFormat) {
+    // Creates a single subpass color render pass. Offscreen targets that get read
+    // back afterwards should pass VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL as finalLayout.
+    VkRenderPass createRenderPass(VkDevice logicalDevice, VkFormat imageFormat, VkImageLayout finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR) {
         // Create render pass color attachment description
         VkAttachmentDescription colorAttachment{};
         colorAttachment.format = imageFormat;
@@ -371,7 +520,7 @@ namespace Talos {
         colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
         colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
         colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        colorAttachment.finalLayout = finalLayout;
         // Create render pass color attachment reference
         VkAttachmentReference colorAttachmentRef{};
         colorAttachmentRef.attachment = 0;
@@ -388,6 +537,9 @@ namespace Talos {
         dependency.srcAccessMask = 0;
         dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
         dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        // Offscreen targets are reused right after being copied out, wait for the copy
+        if (finalLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL)
+            dependency.srcStageMask |= VK_PIPELINE_STAGE_TRANSFER_BIT;
         // Create render pass info struct
         VkRenderPassCreateInfo renderPassInfo{};
         renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
@@ -403,6 +555,2771 @@ namespace Talos {
             throw std::runtime_error("Failed to create render pass!");
         return renderPass;
     }
+
+    // ---- CPU TRACING ----
+
+    // Scoped CPU zones for a frame timeline. TALOS_ZONE("name") times the rest of
+    // the enclosing block, TALOS_TRACE_THREAD("name") labels the calling thread in
+    // the trace. Both only record when TALOS_ENABLE_TRACING is defined and expand to
+    // nothing otherwise; names must be string literals, or otherwise outlive the
+    // trace.
+    //
+    // Each thread records into its own fixed size ring with a single producer and a
+    // single consumer, so recording a zone takes two clock reads and no locks.
+    // collectTrace() drains every ring into one list from whichever thread calls it,
+    // a full ring drops new zones until then, so long runs should collect regularly
+    // (e.g. once a frame). writeTrace() writes what's been collected as Chrome trace
+    // event JSON, which chrome://tracing and Perfetto both open.
+
+    // Escapes text for a JSON string, dropping control characters
+    std::string escapeJson(const std::string& text) {
+        std::string escaped;
+        for (char c : text) {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            if ((unsigned char)c >= 0x20)
+                escaped += c;
+        }
+        return escaped;
+    }
+
+    // A finished zone, times in steady clock nanoseconds
+    struct TraceEvent {
+        const char* name = nullptr;
+        uint64_t startNs = 0;
+        uint64_t endNs = 0;
+        uint32_t thread = 0; // Filled in by collectTrace()
+        uint32_t depth = 0;
+    };
+
+    uint64_t traceNow() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+#ifdef TALOS_ENABLE_TRACING
+    // One thread's zones, written by that thread and drained by collectTrace()
+    class TraceRing {
+    public:
+        static constexpr uint64_t CAPACITY = 1 << 14;
+
+        TraceRing(uint32_t _thread) : thread(_thread), events(new TraceEvent[CAPACITY]) {}
+
+        void push(const TraceEvent& event) {
+            uint64_t h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) >= CAPACITY) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            events[h % CAPACITY] = event;
+            head.store(h + 1, std::memory_order_release);
+        }
+
+        template <typename Fn>
+        void drain(Fn fn) {
+            uint64_t t = tail.load(std::memory_order_relaxed);
+            uint64_t h = head.load(std::memory_order_acquire);
+            for (; t < h; t++)
+                fn(events[t % CAPACITY]);
+            tail.store(h, std::memory_order_release);
+        }
+
+        const uint32_t thread;
+        std::string threadName; // Guarded by the registry mutex
+        uint32_t depth = 0; // Open zones, only touched by the owning thread
+        std::atomic<uint64_t> dropped{ 0 };
+
+    private:
+        std::atomic<uint64_t> head{ 0 };
+        std::atomic<uint64_t> tail{ 0 };
+        std::unique_ptr<TraceEvent[]> events;
+    };
+
+    // Every thread's ring, kept alive past the thread so late zones still get collected
+    struct TraceRegistry {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<TraceRing>> rings;
+        std::vector<TraceEvent> collected; // Capped at MAX_COLLECTED, the rest are dropped
+        uint64_t dropped = 0;
+        uint64_t epochNs = traceNow();
+        static constexpr size_t MAX_COLLECTED = 1 << 22;
+    };
+
+    TraceRegistry& traceRegistry() {
+        static TraceRegistry registry;
+        return registry;
+    }
+
+    TraceRing& threadTraceRing() {
+        thread_local std::shared_ptr<TraceRing> ring;
+        if (!ring) {
+            TraceRegistry& registry = traceRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            ring = std::make_shared<TraceRing>((uint32_t)registry.rings.size() + 1);
+            registry.rings.push_back(ring);
+        }
+        return *ring;
+    }
+
+    void setTraceThreadName(const char* name) {
+        TraceRing& ring = threadTraceRing();
+        std::lock_guard<std::mutex> lock(traceRegistry().mutex);
+        ring.threadName = name;
+    }
+
+    class TraceZone {
+    public:
+        TraceZone(const char* name) : ring(threadTraceRing()) {
+            event.name = name;
+            event.depth = ring.depth++;
+            event.startNs = traceNow();
+        }
+        ~TraceZone() {
+            event.endNs = traceNow();
+            ring.depth--;
+            ring.push(event);
+        }
+        TraceZone(const TraceZone&) = delete;
+        TraceZone& operator=(const TraceZone&) = delete;
+
+    private:
+        TraceRing& ring;
+        TraceEvent event;
+    };
+
+#define TALOS_TRACE_CONCAT_(a, b) a##b
+#define TALOS_TRACE_CONCAT(a, b) TALOS_TRACE_CONCAT_(a, b)
+#define TALOS_ZONE(name) Talos::TraceZone TALOS_TRACE_CONCAT(talosZone, __LINE__)(name)
+#define TALOS_TRACE_THREAD(name) Talos::setTraceThreadName(name)
+#else
+#define TALOS_ZONE(name) ((void)0)
+#define TALOS_TRACE_THREAD(name) ((void)0)
+#endif
+
+    // Whether zones are being recorded at all, i.e. TALOS_ENABLE_TRACING was defined
+    constexpr bool traceEnabled() {
+    #ifdef TALOS_ENABLE_TRACING
+        return true;
+    #else
+        return false;
+    #endif
+    }
+
+    // Moves every thread's finished zones into the collected list
+    void collectTrace() {
+    #ifdef TALOS_ENABLE_TRACING
+        TraceRegistry& registry = traceRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (std::shared_ptr<TraceRing>& ring : registry.rings)
+            ring->drain([&](TraceEvent event) {
+                event.thread = ring->thread;
+                if (registry.collected.size() < TraceRegistry::MAX_COLLECTED)
+                    registry.collected.push_back(event);
+                else
+                    registry.dropped++;
+            });
+    #endif
+    }
+
+    // Zones dropped so far because a thread's ring or the collected list was full
+    uint64_t traceDroppedZones() {
+        uint64_t dropped = 0;
+    #ifdef TALOS_ENABLE_TRACING
+        TraceRegistry& registry = traceRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        dropped = registry.dropped;
+        for (const std::shared_ptr<TraceRing>& ring : registry.rings)
+            dropped += ring->dropped.load(std::memory_order_relaxed);
+    #endif
+        return dropped;
+    }
+
+    // Prints each zone's count and average / p95 / max time over everything collected
+    void printTraceSummary() {
+    #ifdef TALOS_ENABLE_TRACING
+        TraceRegistry& registry = traceRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        std::map<std::string, std::vector<double>> zones;
+        for (const TraceEvent& event : registry.collected)
+            zones[event.name].push_back((event.endNs - event.startNs) / 1e6);
+        printf("CPU zones:\n\t%-24s %8s %9s %9s %9s\n", "", "count", "avg", "p95", "max");
+        for (auto& [name, times] : zones) {
+            std::sort(times.begin(), times.end());
+            double sum = 0.0;
+            for (double time : times)
+                sum += time;
+            size_t rank = (size_t)std::ceil(0.95 * times.size());
+            printf("\t%-24s %8zu %6.3f ms %6.3f ms %6.3f ms\n", name.c_str(), times.size(), sum / times.size(),
+                times[rank > 0 ? rank - 1 : 0], times.back());
+        }
+    #endif
+    }
+
+    // Collects, then writes every zone collected as Chrome trace event JSON. Returns
+    // false if tracing is compiled out or the file couldn't be written.
+    bool writeTrace(const std::string& filename, const char* processName = "CPU") {
+    #ifdef TALOS_ENABLE_TRACING
+        collectTrace();
+        TraceRegistry& registry = traceRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        FILE* file = fopen(filename.c_str(), "w");
+        if (!file)
+            return false;
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"%s\"}}", escapeJson(processName).c_str());
+        for (const std::shared_ptr<TraceRing>& ring : registry.rings) {
+            std::string name = ring->threadName.empty() ? "thread " + std::to_string(ring->thread) : ring->threadName;
+            fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", ring->thread, escapeJson(name).c_str());
+        }
+        for (const TraceEvent& event : registry.collected) {
+            double start = event.startNs >= registry.epochNs ? (event.startNs - registry.epochNs) / 1000.0 : 0.0;
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                escapeJson(event.name).c_str(), event.thread, start, (event.endNs - event.startNs) / 1000.0);
+        }
+        fprintf(file, "\n]}\n");
+        return fclose(file) == 0;
+    #else
+        (void)filename;
+        (void)processName;
+        return false;
+    #endif
+    }
+
+    // ---- MEMORY ALLOCATION ----
+
+    // A sub-range of device memory handed out by the Allocator. Resources bind to
+    // (memory, offset); host visible allocations are persistently mapped, with
+    // mapped pointing at the start of the sub-range. pool/block are -1 for
+    // allocations that received their own dedicated VkDeviceMemory.
+    struct Allocation {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        void* mapped = nullptr;
+        uint32_t memoryType = 0;
+        int32_t pool = -1;
+        int32_t block = -1;
+        void* userData = nullptr;
+    };
+
+    // Usage of a single memory heap, as reported by Allocator::getHeapStats.
+    // usedBytes counts whole buddy ranges (including internal fragmentation),
+    // requestedBytes only the sizes actually asked for.
+    struct HeapStats {
+        VkDeviceSize heapSize = 0;
+        VkDeviceSize reservedBytes = 0;
+        VkDeviceSize usedBytes = 0;
+        VkDeviceSize requestedBytes = 0;
+        uint32_t blockCount = 0;
+        uint32_t allocationCount = 0;
+        uint32_t dedicatedCount = 0;
+    };
+
+    // Called by Allocator::defragment for every allocation it wants to relocate,
+    // with the old and new location. The callback must recreate/rebind whatever
+    // resource lives in 'from' (identified through userData) against 'to' and copy
+    // its contents over; returning false vetoes the move and 'to' is released.
+    typedef std::function<bool(const Allocation& from, const Allocation& to)> DefragmentCallback;
+
+    // Device memory allocator, grabbing large blocks per memory type and handing
+    // out aligned sub-ranges with a buddy scheme. Buffers / linear images and
+    // optimal images are kept in separate pools so bufferImageGranularity never
+    // has to be considered. Requests larger than half a block get a dedicated
+    // allocation. Must be created after the logical device and destroyed before it.
+    class Allocator {
+    public:
+        static constexpr VkDeviceSize MIN_ALLOCATION = 256;
+        static constexpr VkDeviceSize MAX_BLOCK_SIZE = 64ull * 1024 * 1024;
+
+        void create(VkPhysicalDevice _physicalDevice, VkDevice _logicalDevice) {
+            physicalDevice = _physicalDevice;
+            logicalDevice = _logicalDevice;
+            vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+            // Two pools per memory type (linear, optimal), block size picked per heap
+            // so small heaps (e.g. host visible device local) aren't eaten by one block
+            pools.resize(memProperties.memoryTypeCount * 2);
+            for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+                VkDeviceSize heapSize = memProperties.memoryHeaps[memProperties.memoryTypes[i].heapIndex].size;
+                uint32_t maxOrder = 0;
+                while ((MIN_ALLOCATION << (maxOrder + 1)) <= std::min(MAX_BLOCK_SIZE, heapSize / 8))
+                    maxOrder++;
+                for (uint32_t j = 0; j < 2; j++) {
+                    pools[i * 2 + j].memoryType = i;
+                    pools[i * 2 + j].maxOrder = maxOrder;
+                }
+            }
+        }
+
+        void destroy() {
+            for (MemoryPool& pool : pools)
+                for (MemoryBlock& block : pool.blocks)
+                    if (block.memory != VK_NULL_HANDLE)
+                        vkFreeMemory(logicalDevice, block.memory, nullptr);
+            for (auto& dedicated : dedicatedAllocations)
+                vkFreeMemory(logicalDevice, dedicated.first, nullptr);
+            pools.clear();
+            dedicatedAllocations.clear();
+            memoryTypeCache.clear();
+        }
+
+        // Checks whether any memory type has all of the given properties, for picking
+        // optional flags (e.g. HOST_CACHED) before committing to them.
+        bool hasMemoryType(VkMemoryPropertyFlags properties) {
+            for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
+                if ((memProperties.memoryTypes[i].propertyFlags & properties) == properties)
+                    return true;
+            return false;
+        }
+
+        // Allocates memory satisfying the given requirements. 'linear' should be false
+        // only for images with optimal tiling.
+        Allocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear = true, void* userData = nullptr) {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, properties);
+            int32_t poolIndex = (int32_t)(memoryType * 2 + (linear ? 0 : 1));
+            MemoryPool& pool = pools[poolIndex];
+            VkDeviceSize blockSize = MIN_ALLOCATION << pool.maxOrder;
+            uint32_t order = getOrder(std::max(requirements.size, requirements.alignment));
+            if (order >= pool.maxOrder)
+                return allocateDedicated(requirements.size, memoryType, userData);
+            // Try existing blocks first, then grab a new one
+            Allocation allocation;
+            for (size_t i = 0; i < pool.blocks.size(); i++)
+                if (allocateFromBlock(pool, poolIndex, (int32_t)i, order, requirements.size, userData, allocation))
+                    return allocation;
+            int32_t blockIndex = createBlock(pool, blockSize);
+            if (!allocateFromBlock(pool, poolIndex, blockIndex, order, requirements.size, userData, allocation))
+                throw std::runtime_error("Failed to sub-allocate from new memory block!");
+            return allocation;
+        }
+
+        // Returns an allocation to its block, merging buddies back together. Empty
+        // blocks are released unless they are the last block left in their pool.
+        void free(Allocation& allocation) {
+            if (allocation.memory == VK_NULL_HANDLE)
+                return;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (allocation.pool < 0) {
+                dedicatedAllocations.erase(allocation.memory);
+                vkFreeMemory(logicalDevice, allocation.memory, nullptr);
+            } else {
+                MemoryPool& pool = pools[allocation.pool];
+                releaseFromBlock(pool, pool.blocks[allocation.block], allocation.offset);
+                if (pool.blocks[allocation.block].allocations.empty() && liveBlockCount(pool) > 1)
+                    releaseBlock(pool.blocks[allocation.block]);
+            }
+            allocation = Allocation{};
+        }
+
+        // Creates a buffer and binds it to a freshly sub-allocated range of memory.
+        void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, Allocation& allocation) {
+            VkBufferCreateInfo bufferInfo{};
+            bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+            bufferInfo.size = size;
+            bufferInfo.usage = usage;
+            bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            if (vkCreateBuffer(logicalDevice, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
+                throw std::runtime_error("Failed to create buffer!");
+            VkMemoryRequirements memRequirements;
+            vkGetBufferMemoryRequirements(logicalDevice, buffer, &memRequirements);
+            allocation = allocate(memRequirements, properties, true);
+            if (vkBindBufferMemory(logicalDevice, buffer, allocation.memory, allocation.offset) != VK_SUCCESS)
+                throw std::runtime_error("Failed to bind buffer memory!");
+        }
+
+        // Creates an image from the given creation info and binds it to a freshly
+        // sub-allocated range of memory.
+        void createImage(const VkImageCreateInfo& imageInfo, VkMemoryPropertyFlags properties, VkImage& image, Allocation& allocation) {
+            if (vkCreateImage(logicalDevice, &imageInfo, nullptr, &image) != VK_SUCCESS)
+                throw std::runtime_error("Failed to create image!");
+            VkMemoryRequirements memRequirements;
+            vkGetImageMemoryRequirements(logicalDevice, image, &memRequirements);
+            allocation = allocate(memRequirements, properties, imageInfo.tiling == VK_IMAGE_TILING_LINEAR);
+            if (vkBindImageMemory(logicalDevice, image, allocation.memory, allocation.offset) != VK_SUCCESS)
+                throw std::runtime_error("Failed to bind image memory!");
+        }
+
+        void destroyBuffer(VkBuffer buffer, Allocation& allocation) {
+            vkDestroyBuffer(logicalDevice, buffer, nullptr);
+            free(allocation);
+        }
+
+        void destroyImage(VkImage image, Allocation& allocation) {
+            vkDestroyImage(logicalDevice, image, nullptr);
+            free(allocation);
+        }
+
+        // Releases every block that currently holds no allocations.
+        void trim() {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (MemoryPool& pool : pools)
+                for (MemoryBlock& block : pool.blocks)
+                    if (block.memory != VK_NULL_HANDLE && block.allocations.empty())
+                        releaseBlock(block);
+        }
+
+        // Tries to empty the least used blocks of each pool by moving their
+        // allocations into the other blocks of the same pool, releasing every block
+        // that ends up empty. The device must not be using any of the memory while
+        // this runs. Returns the number of allocations moved.
+        uint32_t defragment(const DefragmentCallback& move) {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint32_t moved = 0;
+            for (size_t p = 0; p < pools.size(); p++) {
+                MemoryPool& pool = pools[p];
+                if (liveBlockCount(pool) < 2)
+                    continue;
+                // Visit blocks from least to most used, never moving into a block
+                // that has already been visited as a source
+                std::vector<int32_t> order;
+                for (size_t i = 0; i < pool.blocks.size(); i++)
+                    if (pool.blocks[i].memory != VK_NULL_HANDLE)
+                        order.push_back((int32_t)i);
+                std::sort(order.begin(), order.end(), [&](int32_t a, int32_t b) { return pool.blocks[a].used < pool.blocks[b].used; });
+                for (size_t s = 0; s + 1 < order.size(); s++) {
+                    MemoryBlock& src = pool.blocks[order[s]];
+                    std::map<VkDeviceSize, SubAllocation> live = src.allocations;
+                    for (auto& entry : live) {
+                        Allocation from = makeAllocation(pool, (int32_t)p, order[s], entry.first, entry.second);
+                        Allocation to;
+                        bool placed = false;
+                        for (size_t d = s + 1; d < order.size() && !placed; d++)
+                            placed = allocateFromBlock(pool, (int32_t)p, order[d], entry.second.order, entry.second.size, entry.second.userData, to);
+                        if (!placed)
+                            break;
+                        if (move(from, to)) {
+                            releaseFromBlock(pool, src, entry.first);
+                            moved++;
+                        } else
+                            releaseFromBlock(pool, pool.blocks[to.block], to.offset);
+                    }
+                    if (src.allocations.empty())
+                        releaseBlock(src);
+                }
+            }
+            return moved;
+        }
+
+        HeapStats getHeapStats(uint32_t heapIndex) {
+            std::lock_guard<std::mutex> lock(mutex);
+            HeapStats stats;
+            stats.heapSize = memProperties.memoryHeaps[heapIndex].size;
+            for (MemoryPool& pool : pools) {
+                if (memProperties.memoryTypes[pool.memoryType].heapIndex != heapIndex)
+                    continue;
+                for (MemoryBlock& block : pool.blocks) {
+                    if (block.memory == VK_NULL_HANDLE)
+                        continue;
+                    stats.blockCount++;
+                    stats.reservedBytes += block.size;
+                    stats.usedBytes += block.used;
+                    stats.allocationCount += (uint32_t)block.allocations.size();
+                    for (auto& entry : block.allocations)
+                        stats.requestedBytes += entry.second.size;
+                }
+            }
+            for (auto& dedicated : dedicatedAllocations) {
+                if (memProperties.memoryTypes[dedicated.second.memoryType].heapIndex != heapIndex)
+                    continue;
+                stats.dedicatedCount++;
+                stats.allocationCount++;
+                stats.reservedBytes += dedicated.second.size;
+                stats.usedBytes += dedicated.second.size;
+                stats.requestedBytes += dedicated.second.size;
+            }
+            return stats;
+        }
+
+        void printStats() {
+            printf("Device memory usage:\n");
+            for (uint32_t i = 0; i < memProperties.memoryHeapCount; i++) {
+                HeapStats stats = getHeapStats(i);
+                if (stats.reservedBytes == 0)
+                    continue;
+                printf("\tHeap %u%s: %.2f / %.2f MiB reserved in %u blocks + %u dedicated, %u allocations, %.2f MiB used (%.2f MiB requested)\n",
+                    i, (memProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? " (device local)" : "",
+                    stats.reservedBytes / 1048576.0, stats.heapSize / 1048576.0, stats.blockCount, stats.dedicatedCount,
+                    stats.allocationCount, stats.usedBytes / 1048576.0, stats.requestedBytes / 1048576.0);
+            }
+        }
+
+    private:
+        struct SubAllocation {
+            uint32_t order;
+            VkDeviceSize size;
+            void* userData;
+        };
+
+        struct MemoryBlock {
+            VkDeviceMemory memory = VK_NULL_HANDLE;
+            void* mapped = nullptr;
+            VkDeviceSize size = 0;
+            VkDeviceSize used = 0;
+            std::vector<std::set<VkDeviceSize>> freeLists; // Free offsets, indexed by order
+            std::map<VkDeviceSize, SubAllocation> allocations; // Live offsets
+        };
+
+        struct MemoryPool {
+            uint32_t memoryType = 0;
+            uint32_t maxOrder = 0;
+            std::vector<MemoryBlock> blocks;
+        };
+
+        struct DedicatedAllocation {
+            uint32_t memoryType;
+            VkDeviceSize size;
+        };
+
+        VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+        VkDevice logicalDevice = VK_NULL_HANDLE;
+        VkPhysicalDeviceMemoryProperties memProperties{};
+        std::vector<MemoryPool> pools;
+        std::map<VkDeviceMemory, DedicatedAllocation> dedicatedAllocations;
+        std::map<uint64_t, uint32_t> memoryTypeCache;
+        std::mutex mutex;
+
+        // Finds a memory type matching the filter and properties, results are cached
+        // since the same few combinations are requested over and over. The cache is
+        // shared with other threads, so callers must hold mutex.
+        uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+            uint64_t key = ((uint64_t)typeFilter << 32) | properties;
+            auto cached = memoryTypeCache.find(key);
+            if (cached != memoryTypeCache.end())
+                return cached->second;
+            for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
+                if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+                    memoryTypeCache[key] = i;
+                    return i;
+                }
+            throw std::runtime_error("Failed to find suitable memory type!");
+        }
+
+        // Buddy order of a request, order 0 being MIN_ALLOCATION bytes
+        static uint32_t getOrder(VkDeviceSize size) {
+            uint32_t order = 0;
+            while ((MIN_ALLOCATION << order) < size)
+                order++;
+            return order;
+        }
+
+        static uint32_t liveBlockCount(const MemoryPool& pool) {
+            uint32_t count = 0;
+            for (const MemoryBlock& block : pool.blocks)
+                if (block.memory != VK_NULL_HANDLE)
+                    count++;
+            return count;
+        }
+
+        void* mapMemory(VkDeviceMemory memory, uint32_t memoryType) {
+            if (!(memProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+                return nullptr;
+            void* data;
+            if (vkMapMemory(logicalDevice, memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS)
+                throw std::runtime_error("Failed to map device memory!");
+            return data;
+        }
+
+        Allocation allocateDedicated(VkDeviceSize size, uint32_t memoryType, void* userData) {
+            VkMemoryAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            allocInfo.allocationSize = size;
+            allocInfo.memoryTypeIndex = memoryType;
+            Allocation allocation;
+            if (vkAllocateMemory(logicalDevice, &allocInfo, nullptr, &allocation.memory) != VK_SUCCESS)
+                throw std::runtime_error("Failed to allocate dedicated device memory!");
+            allocation.size = size;
+            allocation.memoryType = memoryType;
+            allocation.mapped = mapMemory(allocation.memory, memoryType);
+            allocation.userData = userData;
+            dedicatedAllocations[allocation.memory] = { memoryType, size };
+            return allocation;
+        }
+
+        // Allocates a new block for the pool, reusing a released slot if there is one
+        int32_t createBlock(MemoryPool& pool, VkDeviceSize blockSize) {
+            int32_t index = -1;
+            for (size_t i = 0; i < pool.blocks.size() && index < 0; i++)
+                if (pool.blocks[i].memory == VK_NULL_HANDLE)
+                    index = (int32_t)i;
+            if (index < 0) {
+                pool.blocks.emplace_back();
+                index = (int32_t)pool.blocks.size() - 1;
+            }
+            MemoryBlock& block = pool.blocks[index];
+            VkMemoryAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            allocInfo.allocationSize = blockSize;
+            allocInfo.memoryTypeIndex = pool.memoryType;
+            if (vkAllocateMemory(logicalDevice, &allocInfo, nullptr, &block.memory) != VK_SUCCESS)
+                throw std::runtime_error("Failed to allocate device memory block!");
+            block.mapped = mapMemory(block.memory, pool.memoryType);
+            block.size = blockSize;
+            block.used = 0;
+            block.freeLists.assign(pool.maxOrder + 1, std::set<VkDeviceSize>());
+            block.freeLists[pool.maxOrder].insert(0);
+            #ifdef TALOS_ENABLE_DEBUG
+            printf("Allocated %.2f MiB block for memory type %u.\n", blockSize / 1048576.0, pool.memoryType);
+            #endif
+            return index;
+        }
+
+        void releaseBlock(MemoryBlock& block) {
+            vkFreeMemory(logicalDevice, block.memory, nullptr);
+            block = MemoryBlock{};
+        }
+
+        Allocation makeAllocation(const MemoryPool& pool, int32_t poolIndex, int32_t blockIndex, VkDeviceSize offset, const SubAllocation& sub) {
+            const MemoryBlock& block = pool.blocks[blockIndex];
+            Allocation allocation;
+            allocation.memory = block.memory;
+            allocation.offset = offset;
+            allocation.size = sub.size;
+            allocation.mapped = block.mapped ? (char*)block.mapped + offset : nullptr;
+            allocation.memoryType = pool.memoryType;
+            allocation.pool = poolIndex;
+            allocation.block = blockIndex;
+            allocation.userData = sub.userData;
+            return allocation;
+        }
+
+        // Takes the smallest free range of at least the given order, splitting it
+        // down and putting the upper halves back on the free lists.
+        bool allocateFromBlock(MemoryPool& pool, int32_t poolIndex, int32_t blockIndex, uint32_t order, VkDeviceSize size, void* userData, Allocation& allocation) {
+            MemoryBlock& block = pool.blocks[blockIndex];
+            if (block.memory == VK_NULL_HANDLE)
+                return false;
+            uint32_t current = order;
+            while (current <= pool.maxOrder && block.freeLists[current].empty())
+                current++;
+            if (current > pool.maxOrder)
+                return false;
+            VkDeviceSize offset = *block.freeLists[current].begin();
+            block.freeLists[current].erase(block.freeLists[current].begin());
+            while (current > order) {
+                current--;
+                block.freeLists[current].insert(offset + (MIN_ALLOCATION << current));
+            }
+            SubAllocation sub{ order, size, userData };
+            block.allocations[offset] = sub;
+            block.used += MIN_ALLOCATION << order;
+            allocation = makeAllocation(pool, poolIndex, blockIndex, offset, sub);
+            return true;
+        }
+
+        // Frees the range at offset, merging it with its buddy for as long as the
+        // buddy is free as well.
+        void releaseFromBlock(MemoryPool& pool, MemoryBlock& block, VkDeviceSize offset) {
+            auto it = block.allocations.find(offset);
+            if (it == block.allocations.end())
+                throw std::runtime_error("Freeing memory that was not allocated from this block!");
+            uint32_t order = it->second.order;
+            block.allocations.erase(it);
+            block.used -= MIN_ALLOCATION << order;
+            while (order < pool.maxOrder) {
+                VkDeviceSize buddy = offset ^ (MIN_ALLOCATION << order);
+                if (block.freeLists[order].erase(buddy) == 0)
+                    break;
+                offset = std::min(offset, buddy);
+                order++;
+            }
+            block.freeLists[order].insert(offset);
+        }
+    };
+
+    // ---- STAGING UPLOADS ----
+
+    // Space in the staging ring handed out by StagingRing::allocate, mapped points
+    // at offset within buffer and stays valid until the batch it belongs to completes.
+    struct StagingAllocation {
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        void* mapped = nullptr;
+    };
+
+    // Records a copy of tightly packed pixels at offset in buffer into mip level 0 of
+    // a color image, transitioning it from UNDEFINED to finalLayout around the copy.
+    // Only the layout changes after the copy, making it visible is up to the caller.
+    void recordImageUpload(VkCommandBuffer cmd, VkBuffer buffer, VkDeviceSize offset, VkImage image, VkExtent2D extent, VkImageLayout finalLayout) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = 1;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+        VkBufferImageCopy region{};
+        region.bufferOffset = offset;
+        region.bufferRowLength = 0;
+        region.bufferImageHeight = 0;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = { 0, 0, 0 };
+        region.imageExtent = { extent.width, extent.height, 1 };
+        vkCmdCopyBufferToImage(cmd, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = finalLayout;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+
+    // Whether images of the format can be blitted with a linear filter, as mip
+    // generation needs. Mandatory for the common 8-bit color formats.
+    bool supportsLinearBlit(VkPhysicalDevice physicalDevice, VkFormat format) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+        VkFormatFeatureFlags required = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+        return (properties.optimalTilingFeatures & required) == required;
+    }
+
+    // Number of levels in a full mip chain down to 1x1.
+    uint32_t mipLevelCount(VkExtent2D extent) {
+        uint32_t levels = 1;
+        for (uint32_t size = std::max(extent.width, extent.height); size > 1; size /= 2)
+            levels++;
+        return levels;
+    }
+
+    // Records the generation of mip levels 1 to levelCount - 1 of a color image, each
+    // blitted from the one above it at half the size with a linear filter. Level 0
+    // must hold the image in TRANSFER_SRC_OPTIMAL after a transfer write, the other
+    // levels may be undefined. Every level ends up in finalLayout, making the levels
+    // visible is up to the caller.
+    void recordMipmapGeneration(VkCommandBuffer cmd, VkImage image, VkExtent2D extent, uint32_t levelCount, VkImageLayout finalLayout) {
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        // Level 0's upload has to land before it's read
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+        int32_t width = (int32_t)extent.width, height = (int32_t)extent.height;
+        for (uint32_t level = 1; level < levelCount; level++) {
+            int32_t levelWidth = std::max(1, width / 2), levelHeight = std::max(1, height / 2);
+            barrier.subresourceRange.baseMipLevel = level;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+            VkImageBlit blit{};
+            blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, 1 };
+            blit.srcOffsets[1] = { width, height, 1 };
+            blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 };
+            blit.dstOffsets[1] = { levelWidth, levelHeight, 1 };
+            vkCmdBlitImage(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+            // The level is the source of the next one
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+            width = levelWidth;
+            height = levelHeight;
+        }
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = levelCount;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = finalLayout;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+
+    // Persistently mapped ring buffer for uploading buffer and image data to device
+    // local memory. Uploads are recorded into the current batch, and submit() sends
+    // the whole batch with a single fence, so loading many resources costs one
+    // submission instead of a queue stall per upload. Space is reclaimed as batches
+    // complete; allocating only waits when the ring has wrapped onto a batch that's
+    // still in flight. Every batch ends with a barrier making its writes visible to
+    // all later work on the same queue, so no waiting is needed before using the
+    // uploaded resources there. Not thread safe.
+    class StagingRing {
+    public:
+        static constexpr VkDeviceSize DEFAULT_CAPACITY = 16ull * 1024 * 1024;
+
+        void create(Allocator& _allocator, VkDevice _logicalDevice, uint32_t queueFamily, VkQueue _queue, VkDeviceSize _capacity = DEFAULT_CAPACITY, uint32_t batchCount = 3) {
+            allocator = &_allocator;
+            logicalDevice = _logicalDevice;
+            queue = _queue;
+            // Create command pool for the batches
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            poolInfo.queueFamilyIndex = queueFamily;
+            if (vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
+                throw std::runtime_error("Failed to create staging command pool!");
+            // Create batches, each with a command buffer and a fence
+            batches.resize(batchCount);
+            std::vector<VkCommandBuffer> commandBuffers(batchCount);
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = batchCount;
+            if (vkAllocateCommandBuffers(logicalDevice, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
+                throw std::runtime_error("Failed to allocate staging command buffers!");
+            VkFenceCreateInfo fenceInfo{};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            for (uint32_t i = 0; i < batchCount; i++) {
+                batches[i].commandBuffer = commandBuffers[i];
+                if (vkCreateFence(logicalDevice, &fenceInfo, nullptr, &batches[i].fence) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to create staging fence!");
+            }
+            createBuffer(_capacity);
+        }
+
+        // Takes size bytes of staging space in the current batch. The caller writes the
+        // data through mapped and records copies out of it with the copy functions or
+        // into commandBuffer(). Allocations stay valid until their batch retires, even
+        // if a later allocate grows the ring.
+        StagingAllocation allocate(VkDeviceSize size, VkDeviceSize alignment = 16) {
+            // Grow the ring if the request can never fit. Earlier allocations may not have
+            // been copied out yet, so the old buffer lives until the current batch retires.
+            if (size > capacity) {
+                retiredBuffers.push_back({ buffer, allocation, submittedBatches });
+                ringStartBatch = submittedBatches;
+                VkDeviceSize newCapacity = capacity;
+                while (newCapacity < size)
+                    newCapacity *= 2;
+                createBuffer(newCapacity);
+            }
+            // Align, skipping the rest of the ring if the request would straddle the end,
+            // then wait for the oldest batches until enough space has been released
+            uint64_t start = 0;
+            while (true) {
+                start = (head + alignment - 1) / alignment * alignment;
+                if (start % capacity + size > capacity)
+                    start += capacity - start % capacity;
+                if (start + size - tail <= capacity)
+                    break;
+                if (tail == head)
+                    head = tail = start; // Nothing in flight, restart the ring at start
+                else
+                    retireOldest();
+            }
+            head = start + size;
+            begin();
+            StagingAllocation staging;
+            staging.buffer = buffer;
+            staging.offset = start % capacity;
+            staging.size = size;
+            staging.mapped = (char*)allocation.mapped + staging.offset;
+            return staging;
+        }
+
+        // Records a copy from staging space into a buffer.
+        void copyToBuffer(const StagingAllocation& staging, VkBuffer dst, VkDeviceSize dstOffset = 0) {
+            VkBufferCopy region{};
+            region.srcOffset = staging.offset;
+            region.dstOffset = dstOffset;
+            region.size = staging.size;
+            vkCmdCopyBuffer(commandBuffer(), staging.buffer, dst, 1, &region);
+        }
+
+        // Records a copy from tightly packed staging space into mip level 0 of a color
+        // image, transitioning it from UNDEFINED and leaving it in finalLayout.
+        void copyToImage(const StagingAllocation& staging, VkImage image, VkExtent2D extent, VkImageLayout finalLayout) {
+            recordImageUpload(commandBuffer(), staging.buffer, staging.offset, image, extent, finalLayout);
+        }
+
+        // Copies data into staging space and records its upload into a buffer.
+        void uploadBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize size) {
+            StagingAllocation staging = allocate(size);
+            memcpy(staging.mapped, data, (size_t)size);
+            copyToBuffer(staging, dst, dstOffset);
+        }
+
+        // Copies tightly packed pixels into staging space and records their upload into
+        // a color image, see copyToImage.
+        void uploadImage(VkImage image, VkExtent2D extent, const void* data, VkDeviceSize size, VkImageLayout finalLayout) {
+            StagingAllocation staging = allocate(size);
+            memcpy(staging.mapped, data, (size_t)size);
+            copyToImage(staging, image, extent, finalLayout);
+        }
+
+        // Command buffer of the current batch, for recording custom copies.
+        VkCommandBuffer commandBuffer() {
+            begin();
+            return batches[current].commandBuffer;
+        }
+
+        // Submits the current batch, if anything was recorded into it.
+        void submit() {
+            Batch& batch = batches[current];
+            if (!batch.recording)
+                return;
+            TALOS_ZONE("staging submit");
+            // Make the uploads visible to everything submitted to the queue afterwards
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+            vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+            if (vkEndCommandBuffer(batch.commandBuffer) != VK_SUCCESS)
+                throw std::runtime_error("Failed to record staging command buffer!");
+            vkResetFences(logicalDevice, 1, &batch.fence);
+            VkSubmitInfo submitInfo{};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &batch.commandBuffer;
+            if (vkQueueSubmit(queue, 1, &submitInfo, batch.fence) != VK_SUCCESS)
+                throw std::runtime_error("Failed to submit staging command buffer!");
+            batch.recording = false;
+            batch.pending = true;
+            batch.end = head;
+            batch.number = submittedBatches;
+            current = (current + 1) % (uint32_t)batches.size();
+            submittedBatches++;
+        }
+
+        // Submits the current batch and waits for every batch in flight.
+        void flush() {
+            submit();
+            while (tail != head)
+                retireOldest();
+        }
+
+        void destroy() {
+            flush();
+            releaseRetiredBuffers(UINT64_MAX);
+            allocator->destroyBuffer(buffer, allocation);
+            for (Batch& batch : batches)
+                vkDestroyFence(logicalDevice, batch.fence, nullptr);
+            batches.clear();
+            vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
+            commandPool = VK_NULL_HANDLE;
+        }
+
+        VkDeviceSize getCapacity() const { return capacity; }
+        uint64_t getSubmittedBatches() const { return submittedBatches; }
+
+    private:
+        struct Batch {
+            VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+            VkFence fence = VK_NULL_HANDLE;
+            uint64_t end = 0; // Ring position just past the batch's last allocation
+            uint64_t number = 0; // Submission order
+            bool recording = false;
+            bool pending = false;
+        };
+
+        Allocator* allocator = nullptr;
+        VkDevice logicalDevice = VK_NULL_HANDLE;
+        VkQueue queue = VK_NULL_HANDLE;
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        VkBuffer buffer = VK_NULL_HANDLE;
+        Allocation allocation;
+        VkDeviceSize capacity = 0;
+        std::vector<Batch> batches;
+        uint32_t current = 0;
+        // Monotonic positions, the ring offset is position % capacity. Everything in
+        // [tail, head) may still be read by the device.
+        uint64_t head = 0;
+        uint64_t tail = 0;
+        uint64_t submittedBatches = 0;
+        // Buffers replaced by growing the ring, each destroyed once the batch that was
+        // being recorded when it was replaced has retired. Batches submitted before
+        // ringStartBatch hold space in those, not in the current ring.
+        struct RetiredBuffer {
+            VkBuffer buffer;
+            Allocation allocation;
+            uint64_t lastBatch;
+        };
+        std::vector<RetiredBuffer> retiredBuffers;
+        uint64_t ringStartBatch = 0;
+
+        void createBuffer(VkDeviceSize size) {
+            allocator->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer, allocation);
+            capacity = size;
+            head = tail = 0;
+        }
+
+        // Starts recording the current batch if it isn't already, first waiting for
+        // its previous use if the ring of batches has wrapped around onto it.
+        void begin() {
+            Batch& batch = batches[current];
+            if (batch.recording)
+                return;
+            if (batch.pending)
+                retireOldest();
+            vkResetCommandBuffer(batch.commandBuffer, 0);
+            VkCommandBufferBeginInfo beginInfo{};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            if (vkBeginCommandBuffer(batch.commandBuffer, &beginInfo) != VK_SUCCESS)
+                throw std::runtime_error("Failed to begin recording staging command buffer!");
+            batch.recording = true;
+        }
+
+        // Waits for the oldest batch in flight and releases its staging space. Batches
+        // are submitted in ring order, so the oldest is the first pending one starting
+        // from current. If the only batch holding space is the one being recorded, it's
+        // submitted first.
+        void retireOldest() {
+            uint32_t count = (uint32_t)batches.size();
+            for (uint32_t i = 0; i < count; i++) {
+                Batch& batch = batches[(current + i) % count];
+                if (!batch.pending)
+                    continue;
+                TALOS_ZONE("staging wait");
+                vkWaitForFences(logicalDevice, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+                batch.pending = false;
+                if (batch.number >= ringStartBatch)
+                    tail = batch.end;
+                releaseRetiredBuffers(batch.number + 1);
+                return;
+            }
+            if (batches[current].recording) {
+                submit();
+                retireOldest();
+                return;
+            }
+            tail = head;
+        }
+
+        // Destroys the retired buffers whose last batch is below retiredBefore, which
+        // every batch before it has retired.
+        void releaseRetiredBuffers(uint64_t retiredBefore) {
+            size_t kept = 0;
+            for (RetiredBuffer& retired : retiredBuffers) {
+                if (retired.lastBatch < retiredBefore)
+                    allocator->destroyBuffer(retired.buffer, retired.allocation);
+                else
+                    retiredBuffers[kept++] = retired;
+            }
+            retiredBuffers.resize(kept);
+        }
+    };
+
+    // ---- UNIFORM ARENA ----
+
+    // Persistently mapped uniform buffer split into one region per frame in flight,
+    // bound through a VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC descriptor. Each frame
+    // bump allocates its uniform blocks out of its own region and passes the returned
+    // offsets to vkCmdBindDescriptorSets, so writing per object uniforms is a plain
+    // pointer write with no mapping, flushing or descriptor updates. The caller must
+    // only call beginFrame once the frame's previous submission has completed.
+    class UniformArena {
+    public:
+        static constexpr VkDeviceSize DEFAULT_FRAME_SIZE = 1024ull * 1024;
+
+        void create(Allocator& _allocator, VkPhysicalDevice physicalDevice, uint32_t _frameCount, VkDeviceSize _frameSize = DEFAULT_FRAME_SIZE) {
+            allocator = &_allocator;
+            frameCount = _frameCount;
+            // Dynamic offsets must be multiples of minUniformBufferOffsetAlignment
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+            alignment = std::max<VkDeviceSize>(properties.limits.minUniformBufferOffsetAlignment, 1);
+            frameSize = (_frameSize + alignment - 1) / alignment * alignment;
+            if (frameSize * frameCount > UINT32_MAX)
+                throw std::runtime_error("Uniform arena too large for dynamic offsets!");
+            allocator->createBuffer(frameSize * frameCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer, allocation);
+            if (allocation.mapped == nullptr)
+                throw std::runtime_error("Failed to map uniform arena!");
+            beginFrame(0);
+        }
+
+        // Rewinds the region of the given frame, everything allocated in it the last
+        // time it was used is overwritten.
+        void beginFrame(uint32_t frame) {
+            frameStart = (VkDeviceSize)(frame % frameCount) * frameSize;
+            frameOffset = 0;
+        }
+
+        // Takes size bytes out of the current frame's region. Returns where to write
+        // them, and sets dynamicOffset to the offset to bind the descriptor with.
+        void* allocate(VkDeviceSize size, uint32_t* dynamicOffset) {
+            VkDeviceSize offset = frameOffset;
+            if (offset + size > frameSize)
+                throw std::runtime_error("Uniform arena frame region exhausted!");
+            frameOffset = (offset + size + alignment - 1) / alignment * alignment;
+            *dynamicOffset = (uint32_t)(frameStart + offset);
+            return (uint8_t*)allocation.mapped + frameStart + offset;
+        }
+
+        template <typename T>
+        T* allocate(uint32_t* dynamicOffset) {
+            return (T*)allocate(sizeof(T), dynamicOffset);
+        }
+
+        void destroy() {
+            if (buffer != VK_NULL_HANDLE)
+                allocator->destroyBuffer(buffer, allocation);
+            buffer = VK_NULL_HANDLE;
+        }
+
+        VkBuffer getBuffer() const { return buffer; }
+        VkDeviceSize getAlignment() const { return alignment; }
+        VkDeviceSize getFrameSize() const { return frameSize; }
+        VkDeviceSize getFrameUsage() const { return frameOffset; }
+
+    private:
+        Allocator* allocator = nullptr;
+        VkBuffer buffer = VK_NULL_HANDLE;
+        Allocation allocation;
+        uint32_t frameCount = 0;
+        VkDeviceSize frameSize = 0;
+        VkDeviceSize alignment = 1;
+        VkDeviceSize frameStart = 0;
+        VkDeviceSize frameOffset = 0;
+    };
+
+    // ---- PIPELINE CACHE ----
+
+    // 64-bit FNV-1a hash, used for checksumming data written to disk.
+    uint64_t hashFNV1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    // Header written in front of pipeline cache data on disk. The blob is only
+    // reused if it was written by the same device and driver version, since drivers
+    // may reject (or worse, misbehave on) data produced by a different build.
+    struct PipelineCacheFileHeader {
+        uint32_t magic;
+        uint32_t fileVersion;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint32_t reserved;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+        uint64_t dataSize;
+        uint64_t checksum;
+    };
+
+    // VkPipelineCache persisted to disk between runs. create() loads and validates
+    // the file if one exists, falling back to an empty cache if it's stale or
+    // corrupt; save() writes the current contents back through a temporary file so
+    // a crash mid-write never leaves a truncated cache behind.
+    class PipelineCache {
+    public:
+        static constexpr uint32_t FILE_MAGIC = 0x43505654; // 'TVPC'
+        static constexpr uint32_t FILE_VERSION = 1;
+
+        VkPipelineCache cache = VK_NULL_HANDLE;
+        bool warm = false; // Whether valid data was loaded from disk
+
+        void create(VkPhysicalDevice physicalDevice, VkDevice _logicalDevice, const std::string& _filename, bool ignoreExisting = false) {
+            logicalDevice = _logicalDevice;
+            filename = _filename;
+            vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+            // Load existing cache data from disk, if any
+            std::vector<char> data;
+            if (!ignoreExisting) {
+                std::ifstream file(filename, std::ios::ate | std::ios::binary);
+                if (file.is_open()) {
+                    std::vector<char> contents((size_t)file.tellg());
+                    file.seekg(0);
+                    file.read(contents.data(), contents.size());
+                    std::string reason;
+                    if (validate(contents, reason))
+                        data.assign(contents.begin() + sizeof(PipelineCacheFileHeader), contents.end());
+                    else
+                        printf("Discarding pipeline cache '%s': %s.\n", filename.c_str(), reason.c_str());
+                }
+            }
+            // Create pipeline cache, seeded with the loaded data
+            VkPipelineCacheCreateInfo createInfo{};
+            createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+            createInfo.initialDataSize = data.size();
+            createInfo.pInitialData = data.empty() ? nullptr : data.data();
+            VkResult res = vkCreatePipelineCache(logicalDevice, &createInfo, nullptr, &cache);
+            if (res != VK_SUCCESS && !data.empty()) {
+                // Driver refused the data despite the header matching, start empty
+                printf("Discarding pipeline cache '%s': rejected by driver.\n", filename.c_str());
+                data.clear();
+                createInfo.initialDataSize = 0;
+                createInfo.pInitialData = nullptr;
+                res = vkCreatePipelineCache(logicalDevice, &createInfo, nullptr, &cache);
+            }
+            if (res != VK_SUCCESS)
+                throw std::runtime_error("Failed to create pipeline cache!");
+            warm = !data.empty();
+            loadedChecksum = warm ? hashFNV1a(data.data(), data.size()) : 0;
+        }
+
+        // Writes the cache contents to disk, skipped if nothing changed since loading.
+        void save() {
+            size_t dataSize = 0;
+            if (vkGetPipelineCacheData(logicalDevice, cache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0)
+                return;
+            std::vector<char> data(dataSize);
+            if (vkGetPipelineCacheData(logicalDevice, cache, &dataSize, data.data()) != VK_SUCCESS)
+                return;
+            data.resize(dataSize);
+            uint64_t checksum = hashFNV1a(data.data(), data.size());
+            if (warm && checksum == loadedChecksum)
+                return;
+            PipelineCacheFileHeader header{};
+            header.magic = FILE_MAGIC;
+            header.fileVersion = FILE_VERSION;
+            header.vendorID = properties.vendorID;
+            header.deviceID = properties.deviceID;
+            header.driverVersion = properties.driverVersion;
+            memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+            header.dataSize = data.size();
+            header.checksum = checksum;
+            std::string tempFilename = filename + ".tmp";
+            std::ofstream file(tempFilename, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                printf("Failed to write pipeline cache '%s'!\n", tempFilename.c_str());
+                return;
+            }
+            file.write((const char*)&header, sizeof(header));
+            file.write(data.data(), data.size());
+            file.close();
+            if (file.fail()) {
+                printf("Failed to write pipeline cache '%s'!\n", tempFilename.c_str());
+                std::remove(tempFilename.c_str());
+                return;
+            }
+            std::remove(filename.c_str());
+            if (std::rename(tempFilename.c_str(), filename.c_str()) != 0)
+                printf("Failed to replace pipeline cache '%s'!\n", filename.c_str());
+            loadedChecksum = checksum;
+            warm = true;
+        }
+
+        void destroy() {
+            vkDestroyPipelineCache(logicalDevice, cache, nullptr);
+            cache = VK_NULL_HANDLE;
+        }
+
+    private:
+        VkDevice logicalDevice = VK_NULL_HANDLE;
+        VkPhysicalDeviceProperties properties{};
+        std::string filename;
+        uint64_t loadedChecksum = 0;
+
+        // Checks the file header against the current device and driver, then the
+        // checksum, then the header Vulkan itself puts at the start of the data.
+        bool validate(const std::vector<char>& contents, std::string& reason) {
+            if (contents.size() < sizeof(PipelineCacheFileHeader)) { reason = "file too small"; return false; }
+            PipelineCacheFileHeader header;
+            memcpy(&header, contents.data(), sizeof(header));
+            if (header.magic != FILE_MAGIC || header.fileVersion != FILE_VERSION) { reason = "unknown file format"; return false; }
+            if (header.vendorID != properties.vendorID || header.deviceID != properties.deviceID) { reason = "written by a different device"; return false; }
+            if (header.driverVersion != properties.driverVersion) { reason = "written by a different driver version"; return false; }
+            if (memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) { reason = "pipeline cache UUID mismatch"; return false; }
+            if (header.dataSize != contents.size() - sizeof(header)) { reason = "truncated data"; return false; }
+            const char* data = contents.data() + sizeof(header);
+            if (hashFNV1a(data, (size_t)header.dataSize) != header.checksum) { reason = "checksum mismatch"; return false; }
+            VkPipelineCacheHeaderVersionOne vkHeader;
+            if (header.dataSize < sizeof(vkHeader)) { reason = "missing Vulkan cache header"; return false; }
+            memcpy(&vkHeader, data, sizeof(vkHeader));
+            if (vkHeader.headerSize < sizeof(vkHeader) || vkHeader.headerSize > header.dataSize
+                || vkHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+                || vkHeader.vendorID != properties.vendorID || vkHeader.deviceID != properties.deviceID
+                || memcmp(vkHeader.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+                reason = "invalid Vulkan cache header";
+                return false;
+            }
+            return true;
+        }
+    };
+
+    // ---- TEXTURE CACHE ----
+
+    // Read only memory mapping of a whole file.
+    class MappedFile {
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile() { close(); }
+
+        // Maps the file, returning false if it can't be opened or mapped. Empty files
+        // open with no data.
+        bool open(const std::string& filename) {
+            close();
+#ifdef _WIN32
+            file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(file, &fileSize)) {
+                close();
+                return false;
+            }
+            mappedSize = (size_t)fileSize.QuadPart;
+            if (mappedSize > 0) {
+                mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+                mappedData = mapping ? (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+                if (!mappedData) {
+                    close();
+                    return false;
+                }
+            }
+#else
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                ::close(fd);
+                return false;
+            }
+            mappedSize = (size_t)info.st_size;
+            if (mappedSize > 0) {
+                // Files are read front to back right away, fault the pages in up front
+                int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+                flags |= MAP_POPULATE;
+#endif
+                void* mapped = mmap(nullptr, mappedSize, PROT_READ, flags, fd, 0);
+                if (mapped == MAP_FAILED) {
+                    ::close(fd);
+                    mappedSize = 0;
+                    return false;
+                }
+                mappedData = (const uint8_t*)mapped;
+            }
+            // The mapping keeps the file alive
+            ::close(fd);
+#endif
+            return true;
+        }
+
+        void close() {
+#ifdef _WIN32
+            if (mappedData)
+                UnmapViewOfFile(mappedData);
+            if (mapping)
+                CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+            mapping = nullptr;
+            file = INVALID_HANDLE_VALUE;
+#else
+            if (mappedData)
+                munmap((void*)mappedData, mappedSize);
+#endif
+            mappedData = nullptr;
+            mappedSize = 0;
+        }
+
+        const uint8_t* data() const { return mappedData; }
+        size_t size() const { return mappedSize; }
+
+    private:
+        const uint8_t* mappedData = nullptr;
+        size_t mappedSize = 0;
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#endif
+    };
+
+    // Header of a texture cache file. It's followed by a level index of levelCount
+    // TextureCacheLevels, as in KTX2, then the levels' data. Level i is
+    // max(1, width >> i) by max(1, height >> i) texels, tightly packed.
+    struct TextureCacheHeader {
+        uint32_t magic;
+        uint32_t fileVersion;
+        uint32_t format; // VkFormat of the level data
+        uint32_t bytesPerTexel;
+        uint32_t width;
+        uint32_t height;
+        uint32_t levelCount;
+        uint32_t reserved;
+        uint64_t sourceHash; // hashFNV1a of the source file
+    };
+
+    struct TextureCacheLevel {
+        uint64_t offset; // From the start of the file, a multiple of TextureCache::LEVEL_ALIGNMENT
+        uint64_t size;
+    };
+
+    // Entry mapped by TextureCache::open, valid until the file is closed.
+    struct TextureCacheEntry {
+        MappedFile file;
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        VkExtent2D extent{};
+        std::vector<TextureCacheLevel> levels;
+
+        const void* levelData(uint32_t level) const { return file.data() + levels[level].offset; }
+    };
+
+    // Directory of preprocessed textures, each stored under the hash of the source
+    // file it was made from, so an edited source misses instead of loading stale data.
+    // Levels are stored exactly as they're uploaded, aligned for copying them straight
+    // out of the mapped file, so a hit costs no decoding or conversion. Entries are
+    // written to a temporary file and renamed into place, so neither a crash nor two
+    // threads writing the same entry leave a partial one behind. Holds no state past
+    // the directory, any thread may use it.
+    class TextureCache {
+    public:
+        static constexpr uint32_t FILE_MAGIC = 0x58545654; // 'TVTX'
+        static constexpr uint32_t FILE_VERSION = 1;
+        static constexpr uint64_t LEVEL_ALIGNMENT = 256;
+        static constexpr uint32_t MAX_LEVELS = 32;
+
+        void create(const std::string& _directory) {
+            directory = _directory;
+            std::error_code error;
+            std::filesystem::create_directories(directory, error);
+        }
+
+        std::string entryFilename(uint64_t sourceHash) const {
+            char name[32];
+            snprintf(name, sizeof(name), "%016llx.tex", (unsigned long long)sourceHash);
+            return directory + "/" + name;
+        }
+
+        // Maps the entry of the source with the given hash, if there's a valid one in format.
+        bool open(uint64_t sourceHash, VkFormat format, TextureCacheEntry& entry) const {
+            std::string filename = entryFilename(sourceHash);
+            if (!entry.file.open(filename))
+                return false;
+            std::string reason;
+            if (!validate(entry, sourceHash, format, reason)) {
+                printf("Discarding texture cache entry '%s': %s.\n", filename.c_str(), reason.c_str());
+                entry.file.close();
+                return false;
+            }
+            return true;
+        }
+
+        // Writes the entry of the source with the given hash, levels pointing at the
+        // tightly packed texels of each level. Returns false if it couldn't be written.
+        bool write(uint64_t sourceHash, VkFormat format, uint32_t bytesPerTexel, VkExtent2D extent, const std::vector<const void*>& levels) const {
+            if (levels.empty() || levels.size() > MAX_LEVELS)
+                return false;
+            TextureCacheHeader header{};
+            header.magic = FILE_MAGIC;
+            header.fileVersion = FILE_VERSION;
+            header.format = format;
+            header.bytesPerTexel = bytesPerTexel;
+            header.width = extent.width;
+            header.height = extent.height;
+            header.levelCount = (uint32_t)levels.size();
+            header.sourceHash = sourceHash;
+            std::vector<TextureCacheLevel> index(levels.size());
+            uint64_t offset = sizeof(header) + index.size() * sizeof(TextureCacheLevel);
+            for (uint32_t i = 0; i < index.size(); i++) {
+                offset = (offset + LEVEL_ALIGNMENT - 1) / LEVEL_ALIGNMENT * LEVEL_ALIGNMENT;
+                index[i].offset = offset;
+                index[i].size = levelSize(header, i);
+                offset += index[i].size;
+            }
+            // Unique per thread, so concurrent writers of the same entry don't collide
+            std::string filename = entryFilename(sourceHash);
+            std::string tempFilename = filename + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+            std::ofstream file(tempFilename, std::ios::binary | std::ios::trunc);
+            if (!file.is_open())
+                return false;
+            file.write((const char*)&header, sizeof(header));
+            file.write((const char*)index.data(), index.size() * sizeof(TextureCacheLevel));
+            static const char padding[LEVEL_ALIGNMENT] = {};
+            for (uint32_t i = 0; i < index.size(); i++) {
+                file.write(padding, (std::streamsize)(index[i].offset - (uint64_t)file.tellp()));
+                file.write((const char*)levels[i], (std::streamsize)index[i].size);
+            }
+            file.close();
+            if (file.fail()) {
+                std::remove(tempFilename.c_str());
+                return false;
+            }
+            std::remove(filename.c_str());
+            if (std::rename(tempFilename.c_str(), filename.c_str()) != 0) {
+                std::remove(tempFilename.c_str());
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        std::string directory;
+
+        static uint64_t levelSize(const TextureCacheHeader& header, uint32_t level) {
+            return (uint64_t)std::max(1u, header.width >> level) * std::max(1u, header.height >> level) * header.bytesPerTexel;
+        }
+
+        // Checks the header against what was asked for, then that every level lies
+        // within the file. The data itself isn't checksummed, that would cost a pass
+        // over it on every load.
+        bool validate(TextureCacheEntry& entry, uint64_t sourceHash, VkFormat format, std::string& reason) const {
+            size_t fileSize = entry.file.size();
+            if (fileSize < sizeof(TextureCacheHeader)) { reason = "file too small"; return false; }
+            TextureCacheHeader header;
+            memcpy(&header, entry.file.data(), sizeof(header));
+            if (header.magic != FILE_MAGIC || header.fileVersion != FILE_VERSION) { reason = "unknown file format"; return false; }
+            if (header.sourceHash != sourceHash) { reason = "source hash mismatch"; return false; }
+            if (header.format != (uint32_t)format) { reason = "different format"; return false; }
+            if (header.width == 0 || header.height == 0 || header.bytesPerTexel == 0 || header.levelCount == 0 || header.levelCount > MAX_LEVELS) { reason = "invalid header"; return false; }
+            if (fileSize < sizeof(header) + header.levelCount * sizeof(TextureCacheLevel)) { reason = "truncated level index"; return false; }
+            entry.levels.resize(header.levelCount);
+            memcpy(entry.levels.data(), entry.file.data() + sizeof(header), header.levelCount * sizeof(TextureCacheLevel));
+            for (uint32_t i = 0; i < header.levelCount; i++) {
+                const TextureCacheLevel& level = entry.levels[i];
+                if (level.offset % LEVEL_ALIGNMENT != 0 || level.size != levelSize(header, i)) { reason = "invalid level index"; return false; }
+                if (level.offset > fileSize || level.size > fileSize - level.offset) { reason = "truncated level data"; return false; }
+            }
+            entry.format = format;
+            entry.extent = { header.width, header.height };
+            return true;
+        }
+    };
+
+    // ---- HEADLESS RENDERING ----
+
+    // Color image rendered to in place of a swapchain image when running without a
+    // surface, along with its view and a framebuffer for the given render pass.
+    struct OffscreenTarget {
+        VkImage image = VK_NULL_HANDLE;
+        Allocation allocation;
+        VkImageView imageView = VK_NULL_HANDLE;
+        VkFramebuffer framebuffer = VK_NULL_HANDLE;
+        VkFormat imageFormat{};
+        VkExtent2D extent{};
+    };
+
+    // Creates an offscreen color target usable as a render pass attachment and as a
+    // transfer source for reading it back. If the render pass has a depth attachment,
+    // its view is passed as depthImageView and stays owned by the caller. So does
+    // multisampleImageView, given when the render pass resolves a multisampled color
+    // attachment into the target; the attachments then go multisampled color, depth,
+    // target.
+    OffscreenTarget createOffscreenTarget(Allocator& allocator, VkDevice logicalDevice, VkRenderPass renderPass, VkFormat imageFormat, VkExtent2D extent, VkImageView depthImageView = VK_NULL_HANDLE, VkImageView multisampleImageView = VK_NULL_HANDLE) {
+        OffscreenTarget target;
+        target.imageFormat = imageFormat;
+        target.extent = extent;
+        // Create image in device local memory
+        VkImageCreateInfo imageInfo{};
+        imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageInfo.extent = { extent.width, extent.height, 1 };
+        imageInfo.mipLevels = 1;
+        imageInfo.arrayLayers = 1;
+        imageInfo.format = imageFormat;
+        imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        allocator.createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, target.image, target.allocation);
+        target.imageView = createImageView(logicalDevice, target.image, imageFormat);
+        // Create framebuffer
+        VkImageView attachments[] = { target.imageView, depthImageView, VK_NULL_HANDLE };
+        uint32_t attachmentCount = depthImageView != VK_NULL_HANDLE ? 2 : 1;
+        if (multisampleImageView != VK_NULL_HANDLE) {
+            attachments[0] = multisampleImageView;
+            attachments[attachmentCount++] = target.imageView;
+        }
+        VkFramebufferCreateInfo framebufferInfo{};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = renderPass;
+        framebufferInfo.attachmentCount = attachmentCount;
+        framebufferInfo.pAttachments = attachments;
+        framebufferInfo.width = extent.width;
+        framebufferInfo.height = extent.height;
+        framebufferInfo.layers = 1;
+        VkResult res = vkCreateFramebuffer(logicalDevice, &framebufferInfo, nullptr, &target.framebuffer);
+        if (res != VK_SUCCESS)
+            throw std::runtime_error("Failed to create offscreen framebuffer!");
+        return target;
+    }
+
+    void destroyOffscreenTarget(Allocator& allocator, VkDevice logicalDevice, OffscreenTarget& target) {
+        vkDestroyFramebuffer(logicalDevice, target.framebuffer, nullptr);
+        vkDestroyImageView(logicalDevice, target.imageView, nullptr);
+        allocator.destroyImage(target.image, target.allocation);
+        target = OffscreenTarget{};
+    }
+
+    // Called by ReadbackRing once a copy has landed in host memory. The pointer is
+    // only valid for the duration of the call.
+    typedef std::function<void(const void* data, VkDeviceSize size)> ReadbackCallback;
+
+    // Pool of persistently mapped host buffers for copying images / buffers back from
+    // the device without stalling the queue. Every readback records its own copy into
+    // the next slot of the ring and submits it with that slot's fence; callbacks fire
+    // in submission order from poll() / flush(), or when the ring wraps around onto a
+    // slot that is still pending. Slot buffers only ever grow, so steady state
+    // readbacks of the same size don't allocate.
+    class ReadbackRing {
+    public:
+        void create(Allocator& _allocator, VkDevice _logicalDevice, uint32_t queueFamily, VkQueue _queue, uint32_t slotCount = 3) {
+            allocator = &_allocator;
+            logicalDevice = _logicalDevice;
+            queue = _queue;
+            // Prefer cached memory, uncached reads from the CPU are very slow
+            memoryProperties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+            if (allocator->hasMemoryType(memoryProperties | VK_MEMORY_PROPERTY_HOST_CACHED_BIT))
+                memoryProperties |= VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+            // Create command pool for the copies
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            poolInfo.queueFamilyIndex = queueFamily;
+            if (vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
+                throw std::runtime_error("Failed to create readback command pool!");
+            // Create slots, each with a command buffer and a fence
+            slots.resize(slotCount);
+            std::vector<VkCommandBuffer> commandBuffers(slotCount);
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = slotCount;
+            if (vkAllocateCommandBuffers(logicalDevice, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
+                throw std::runtime_error("Failed to allocate readback command buffers!");
+            VkFenceCreateInfo fenceInfo{};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            for (uint32_t i = 0; i < slotCount; i++) {
+                slots[i].commandBuffer = commandBuffers[i];
+                if (vkCreateFence(logicalDevice, &fenceInfo, nullptr, &slots[i].fence) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to create readback fence!");
+            }
+            next = 0;
+        }
+
+        // Reads back a whole color image in the given layout (TRANSFER_SRC_OPTIMAL or
+        // GENERAL), tightly packed at bytesPerPixel. Waits for all prior work on the
+        // queue that wrote to the image.
+        void readImage(VkImage image, VkImageLayout layout, VkExtent2D extent, uint32_t bytesPerPixel, ReadbackCallback callback) {
+            VkDeviceSize size = (VkDeviceSize)extent.width * extent.height * bytesPerPixel;
+            Slot& slot = acquire(size);
+            VkBufferImageCopy region{};
+            region.bufferOffset = 0;
+            region.bufferRowLength = 0;
+            region.bufferImageHeight = 0;
+            region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.imageSubresource.mipLevel = 0;
+            region.imageSubresource.baseArrayLayer = 0;
+            region.imageSubresource.layerCount = 1;
+            region.imageOffset = { 0, 0, 0 };
+            region.imageExtent = { extent.width, extent.height, 1 };
+            vkCmdCopyImageToBuffer(slot.commandBuffer, image, layout, slot.buffer, 1, &region);
+            submit(slot, callback);
+        }
+
+        // Reads back a range of a buffer.
+        void readBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, ReadbackCallback callback) {
+            Slot& slot = acquire(size);
+            VkBufferCopy region{};
+            region.srcOffset = offset;
+            region.dstOffset = 0;
+            region.size = size;
+            vkCmdCopyBuffer(slot.commandBuffer, buffer, slot.buffer, 1, &region);
+            submit(slot, callback);
+        }
+
+        // Fires the callbacks of every readback that has completed without blocking,
+        // stopping at the first one still in flight. Returns the number completed.
+        uint32_t poll() {
+            uint32_t completed = 0;
+            for (uint32_t i = 0; i < slots.size(); i++) {
+                Slot& slot = slots[(next + i) % slots.size()];
+                if (!slot.pending)
+                    continue;
+                if (vkGetFenceStatus(logicalDevice, slot.fence) != VK_SUCCESS)
+                    break;
+                complete(slot);
+                completed++;
+            }
+            return completed;
+        }
+
+        // Waits for every pending readback and fires its callback.
+        void flush() {
+            for (uint32_t i = 0; i < slots.size(); i++) {
+                Slot& slot = slots[(next + i) % slots.size()];
+                if (slot.pending) {
+                    vkWaitForFences(logicalDevice, 1, &slot.fence, VK_TRUE, UINT64_MAX);
+                    complete(slot);
+                }
+            }
+        }
+
+        // Flushes outstanding readbacks and releases the slots.
+        void destroy() {
+            flush();
+            for (Slot& slot : slots) {
+                if (slot.buffer != VK_NULL_HANDLE)
+                    allocator->destroyBuffer(slot.buffer, slot.allocation);
+                vkDestroyFence(logicalDevice, slot.fence, nullptr);
+            }
+            slots.clear();
+            vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
+            commandPool = VK_NULL_HANDLE;
+        }
+
+    private:
+        struct Slot {
+            VkBuffer buffer = VK_NULL_HANDLE;
+            Allocation allocation;
+            VkDeviceSize capacity = 0;
+            VkDeviceSize size = 0;
+            VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+            VkFence fence = VK_NULL_HANDLE;
+            bool pending = false;
+            ReadbackCallback callback;
+        };
+
+        Allocator* allocator = nullptr;
+        VkDevice logicalDevice = VK_NULL_HANDLE;
+        VkQueue queue = VK_NULL_HANDLE;
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        VkMemoryPropertyFlags memoryProperties = 0;
+        std::vector<Slot> slots;
+        uint32_t next = 0;
+
+        // Takes the next slot in the ring, completing it first if it's still in
+        // flight, makes sure its buffer fits size bytes and begins recording.
+        Slot& acquire(VkDeviceSize size) {
+            Slot& slot = slots[next];
+            if (slot.pending) {
+                TALOS_ZONE("readback wait");
+                vkWaitForFences(logicalDevice, 1, &slot.fence, VK_TRUE, UINT64_MAX);
+                complete(slot);
+            }
+            if (slot.capacity < size) {
+                if (slot.buffer != VK_NULL_HANDLE)
+                    allocator->destroyBuffer(slot.buffer, slot.allocation);
+                allocator->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, memoryProperties, slot.buffer, slot.allocation);
+                slot.capacity = size;
+            }
+            slot.size = size;
+            vkResetCommandBuffer(slot.commandBuffer, 0);
+            VkCommandBufferBeginInfo beginInfo{};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            if (vkBeginCommandBuffer(slot.commandBuffer, &beginInfo) != VK_SUCCESS)
+                throw std::runtime_error("Failed to begin recording readback command buffer!");
+            // Make writes from earlier submissions visible to the copy
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+            return slot;
+        }
+
+        // Ends recording and submits the slot's copy, advancing the ring.
+        void submit(Slot& slot, ReadbackCallback& callback) {
+            // Make the copy visible to host reads once the fence signals
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+            vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+            if (vkEndCommandBuffer(slot.commandBuffer) != VK_SUCCESS)
+                throw std::runtime_error("Failed to record readback command buffer!");
+            vkResetFences(logicalDevice, 1, &slot.fence);
+            VkSubmitInfo submitInfo{};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &slot.commandBuffer;
+            if (vkQueueSubmit(queue, 1, &submitInfo, slot.fence) != VK_SUCCESS)
+                throw std::runtime_error("Failed to submit readback command buffer!");
+            slot.callback = std::move(callback);
+            slot.pending = true;
+            next = (next + 1) % (uint32_t)slots.size();
+        }
+
+        void complete(Slot& slot) {
+            slot.pending = false;
+            if (slot.callback)
+                slot.callback(slot.allocation.mapped, slot.size);
+            slot.callback = nullptr;
+        }
+    };
+
+    // Writes tightly packed RGBA8 pixels to a binary PPM file, dropping alpha.
+    // Returns false if the file couldn't be written.
+    bool writePPM(const std::string& filename, const void* rgba, uint32_t width, uint32_t height) {
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+            return false;
+        file << "P6\n" << width << " " << height << "\n255\n";
+        const uint8_t* pixels = (const uint8_t*)rgba;
+        std::vector<uint8_t> row(width * 3);
+        for (uint32_t y = 0; y < height; y++) {
+            for (uint32_t x = 0; x < width; x++)
+                memcpy(&row[x * 3], &pixels[((size_t)y * width + x) * 4], 3);
+            file.write((const char*)row.data(), row.size());
+        }
+        file.close();
+        return !file.fail();
+    }
+
+    // ---- THREAD POOL ----
+
+    // Fixed set of worker threads for running parallel loops with work stealing. Each
+    // parallelFor splits its range into chunks and deals contiguous runs of them out
+    // to per-worker queues. Workers take chunks in order from the front of their own
+    // queue and, once it's empty, steal from the back of the others', so uneven
+    // chunks still keep every thread busy. The calling thread works as worker 0 and
+    // parallelFor returns once every chunk has run. Functions must not throw, and
+    // calls to parallelFor must not overlap.
+    class ThreadPool {
+    public:
+        typedef std::function<void(size_t begin, size_t end, uint32_t worker)> RangeFunction;
+
+        // A threadCount of 0 uses one thread per hardware thread.
+        void create(uint32_t threadCount = 0) {
+            if (threadCount == 0)
+                threadCount = std::max(1u, std::thread::hardware_concurrency());
+            workerCount = threadCount;
+            queues.reset(new Queue[workerCount]);
+            running = true;
+            for (uint32_t i = 1; i < workerCount; i++)
+                threads.emplace_back([this, i]() { workerLoop(i); });
+        }
+
+        // Calls fn(begin, end, worker) over [0, count) in chunks of grain elements,
+        // worker being the index of the thread running it, below getThreadCount().
+        void parallelFor(size_t count, size_t grain, const RangeFunction& fn) {
+            if (count == 0)
+                return;
+            grain = std::max<size_t>(grain, 1);
+            size_t chunks = (count + grain - 1) / grain;
+            for (uint32_t w = 0; w < workerCount; w++) {
+                std::lock_guard<std::mutex> lock(queues[w].mutex);
+                size_t first = chunks * w / workerCount, last = chunks * (w + 1) / workerCount;
+                for (size_t c = first; c < last; c++)
+                    queues[w].ranges.push_back({ c * grain, std::min(count, (c + 1) * grain) });
+            }
+            // Wake the workers, then work alongside them until every chunk is taken
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job = &fn;
+                generation++;
+            }
+            wake.notify_all();
+            runChunks(0, fn);
+            // Wait for the chunks still running on other workers
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]() { return busyWorkers == 0; });
+            job = nullptr;
+        }
+
+        void destroy() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running = false;
+            }
+            wake.notify_all();
+            for (std::thread& thread : threads)
+                thread.join();
+            threads.clear();
+            queues.reset();
+            workerCount = 0;
+        }
+
+        uint32_t getThreadCount() const { return workerCount; }
+        uint64_t getStolenChunks() const { return stolenChunks; }
+
+    private:
+        struct Range {
+            size_t begin;
+            size_t end;
+        };
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Range> ranges;
+        };
+
+        uint32_t workerCount = 0;
+        std::unique_ptr<Queue[]> queues;
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const RangeFunction* job = nullptr;
+        uint64_t generation = 0;
+        uint32_t busyWorkers = 0;
+        bool running = false;
+        std::atomic<uint64_t> stolenChunks{ 0 };
+
+        // Takes the next chunk of the worker's own queue, or steals one from another
+        bool takeChunk(uint32_t worker, Range& range) {
+            for (uint32_t i = 0; i < workerCount; i++) {
+                Queue& queue = queues[(worker + i) % workerCount];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.ranges.empty())
+                    continue;
+                if (i == 0) {
+                    range = queue.ranges.front();
+                    queue.ranges.pop_front();
+                } else {
+                    range = queue.ranges.back();
+                    queue.ranges.pop_back();
+                    stolenChunks++;
+                }
+                return true;
+            }
+            return false;
+        }
+
+        void runChunks(uint32_t worker, const RangeFunction& fn) {
+            Range range;
+            while (takeChunk(worker, range))
+                fn(range.begin, range.end, worker);
+        }
+
+        // Workers only count as busy while running a job, so parallelFor can't return
+        // while one still holds a reference to its function
+        void workerLoop(uint32_t worker) {
+            TALOS_TRACE_THREAD("thread pool");
+            uint64_t seen = 0;
+            while (true) {
+                const RangeFunction* fn = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&]() { return !running || generation != seen; });
+                    if (!running)
+                        return;
+                    seen = generation;
+                    if (job == nullptr)
+                        continue; // Finished before this worker woke up
+                    fn = job;
+                    busyWorkers++;
+                }
+                runChunks(worker, *fn);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busyWorkers == 0)
+                    done.notify_all();
+            }
+        }
+    };
+
+    // ---- PARALLEL RECORDING ----
+
+    // Records secondary command buffers across a ThreadPool's workers. Each worker
+    // has its own command pool per frame slot, so recording takes no locks; a slot's
+    // pools are reset as a whole in beginFrame() instead of freeing buffers, and the
+    // buffers they already hold are reused in order. record() splits a range of work
+    // into chunks, records each into a secondary command buffer continuing the given
+    // render pass and returns them in chunk order, for the caller to stitch into its
+    // primary command buffer with vkCmdExecuteCommands. The result doesn't depend on
+    // which worker ran which chunk.
+    class CommandRecorder {
+    public:
+        // Records [begin, end) into cmd, which has been begun and is ended afterwards.
+        // Secondary command buffers inherit no state, so cmd has nothing bound.
+        typedef std::function<void(VkCommandBuffer cmd, size_t begin, size_t end, uint32_t worker)> RecordFunction;
+
+        void create(VkDevice _logicalDevice, uint32_t queueFamily, uint32_t _frameCount, ThreadPool& _threadPool) {
+            logicalDevice = _logicalDevice;
+            threadPool = &_threadPool;
+            frameCount = _frameCount;
+            workerCount = threadPool->getThreadCount();
+            pools.resize(frameCount * workerCount);
+            for (Pool& pool : pools) {
+                VkCommandPoolCreateInfo poolInfo{};
+                poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+                poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+                poolInfo.queueFamilyIndex = queueFamily;
+                if (vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &pool.commandPool) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to create recording command pool!");
+            }
+        }
+
+        void destroy() {
+            for (Pool& pool : pools)
+                vkDestroyCommandPool(logicalDevice, pool.commandPool, nullptr);
+            pools.clear();
+        }
+
+        // Starts recording into frame slot frame, resetting its pools. The slot's last
+        // submission must have completed.
+        void beginFrame(uint32_t frame) {
+            current = frame % frameCount;
+            for (uint32_t w = 0; w < workerCount; w++) {
+                Pool& pool = pools[current * workerCount + w];
+                vkResetCommandPool(logicalDevice, pool.commandPool, 0);
+                pool.used = 0;
+            }
+        }
+
+        // Calls fn over [0, count) in chunks of grain elements, each recorded into its
+        // own secondary command buffer inheriting inheritance's render pass. Returns the
+        // buffers in chunk order, valid until the slot's next beginFrame().
+        const std::vector<VkCommandBuffer>& record(size_t count, size_t grain, const VkCommandBufferInheritanceInfo& inheritance, const RecordFunction& fn) {
+            grain = std::max<size_t>(grain, 1);
+            recorded.assign((count + grain - 1) / grain, VK_NULL_HANDLE);
+            std::atomic<bool> failed{ false };
+            // Pool functions must not throw, failures are rethrown once every chunk has run
+            threadPool->parallelFor(count, grain, [&](size_t begin, size_t end, uint32_t worker) {
+                VkCommandBuffer cmd = nextCommandBuffer(pools[current * workerCount + worker]);
+                VkCommandBufferBeginInfo beginInfo{};
+                beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+                beginInfo.pInheritanceInfo = &inheritance;
+                if (cmd == VK_NULL_HANDLE || vkBeginCommandBuffer(cmd, &beginInfo) != VK_SUCCESS) {
+                    failed = true;
+                    return;
+                }
+                fn(cmd, begin, end, worker);
+                if (vkEndCommandBuffer(cmd) != VK_SUCCESS)
+                    failed = true;
+                recorded[begin / grain] = cmd;
+            });
+            if (failed)
+                throw std::runtime_error("Failed to record secondary command buffer!");
+            return recorded;
+        }
+
+        uint32_t getWorkerCount() const { return workerCount; }
+
+    private:
+        struct Pool {
+            VkCommandPool commandPool = VK_NULL_HANDLE;
+            std::vector<VkCommandBuffer> commandBuffers; // Allocated so far, kept across resets
+            size_t used = 0; // Handed out since the last reset
+        };
+
+        VkDevice logicalDevice = VK_NULL_HANDLE;
+        ThreadPool* threadPool = nullptr;
+        uint32_t frameCount = 0;
+        uint32_t workerCount = 0;
+        uint32_t current = 0;
+        std::vector<Pool> pools; // frameCount * workerCount, by frame then worker
+        std::vector<VkCommandBuffer> recorded;
+
+        // Takes the pool's next secondary command buffer, allocating one if it's run out
+        VkCommandBuffer nextCommandBuffer(Pool& pool) {
+            if (pool.used == pool.commandBuffers.size()) {
+                VkCommandBufferAllocateInfo allocInfo{};
+                allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                allocInfo.commandPool = pool.commandPool;
+                allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+                allocInfo.commandBufferCount = 1;
+                VkCommandBuffer commandBuffer;
+                if (vkAllocateCommandBuffers(logicalDevice, &allocInfo, &commandBuffer) != VK_SUCCESS)
+                    return VK_NULL_HANDLE;
+                pool.commandBuffers.push_back(commandBuffer);
+            }
+            return pool.commandBuffers[pool.used++];
+        }
+    };
+
+    // ---- ASYNC IMAGE LOADING ----
+
+    // Hands a decoder the memory to write an image's pixels to once it knows their
+    // extent: at least size bytes, of which the first width * height * 4 get uploaded.
+    typedef std::function<void*(VkExtent2D extent, VkDeviceSize size)> DecodeAllocator;
+
+    // Decodes a file into tightly packed RGBA8 pixels, written to memory obtained from
+    // allocate. Returns an error message, empty on success. Runs on loader threads.
+    typedef std::function<std::string(const std::string& filename, const DecodeAllocator& allocate)> ImageDecoder;
+
+    // Image loaded by ImageLoader. On success image is in SHADER_READ_ONLY_OPTIMAL
+    // layout and belongs to whoever received it, to be destroyed through the allocator.
+    struct LoadedImage {
+        std::string filename;
+        std::string error;
+        VkImage image = VK_NULL_HANDLE;
+        Allocation allocation;
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        VkExtent2D extent{};
+        uint32_t levelCount = 1;
+        double decodeMs = 0.0; // Spent decoding on a loader thread
+        double latencyMs = 0.0; // From load() until the callback
+    };
+
+    typedef std::function<void(const LoadedImage& image)> ImageLoadCallback;
+
+    // Decodes images on worker threads straight into persistently mapped slot buffers
+    // and uploads them into sampled images, without the thread driving the queue ever
+    // waiting on a decode. load() only queues a file; poll() records and submits the
+    // uploads of the images decoded since, firing their callbacks right away as any
+    // work submitted to the queue afterwards sees the upload. Slots are reused once
+    // their upload's fence signals, so slotCount bounds the staging memory in flight
+    // and workers wait for a free slot instead of decoding further ahead. Slot buffers
+    // only ever grow, and are created from the loader threads through the allocator's
+    // thread safe allocate / free. load() may be called from any thread, poll() and
+    // flush() only from the one submitting to the queue.
+    class ImageLoader {
+    public:
+        void create(Allocator& _allocator, VkDevice _logicalDevice, uint32_t queueFamily, VkQueue _queue, ImageDecoder _decoder, uint32_t threadCount = 1, uint32_t slotCount = 2) {
+            allocator = &_allocator;
+            logicalDevice = _logicalDevice;
+            queue = _queue;
+            decoder = std::move(_decoder);
+            // Create command pool for the uploads
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+            poolInfo.queueFamilyIndex = queueFamily;
+            if (vkCreateCommandPool(logicalDevice, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
+                throw std::runtime_error("Failed to create image loader command pool!");
+            // Create slots, each with a command buffer and a fence
+            slots = std::vector<Slot>(slotCount);
+            std::vector<VkCommandBuffer> commandBuffers(slotCount);
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = slotCount;
+            if (vkAllocateCommandBuffers(logicalDevice, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
+                throw std::runtime_error("Failed to allocate image loader command buffers!");
+            VkFenceCreateInfo fenceInfo{};
+            fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+            for (uint32_t i = 0; i < slotCount; i++) {
+                slots[i].commandBuffer = commandBuffers[i];
+                if (vkCreateFence(logicalDevice, &fenceInfo, nullptr, &slots[i].fence) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to create image loader fence!");
+            }
+            running = true;
+            for (uint32_t i = 0; i < std::max(1u, threadCount); i++)
+                threads.emplace_back([this]() { workerLoop(); });
+        }
+
+        // Queues a file to be decoded and uploaded into an image of the given format,
+        // returning at once. The callback fires from poll() or flush(), also on failure.
+        // With mipmaps the full mip chain is generated on the device after the upload,
+        // the format must then support linear blits (see supportsLinearBlit).
+        void load(const std::string& filename, VkFormat format, ImageLoadCallback callback, bool mipmaps = false) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                requests.push_back({ filename, format, mipmaps, std::move(callback), std::chrono::steady_clock::now() });
+                outstanding++;
+            }
+            wake.notify_all();
+        }
+
+        // Submits the uploads of the images decoded so far, firing their callbacks, and
+        // frees the slots whose uploads have completed. Never waits. Returns the number
+        // of callbacks fired.
+        uint32_t poll() {
+            uint32_t loaded = 0;
+            for (Slot& slot : slots) {
+                SlotState state;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    state = slot.state;
+                }
+                if (state == SLOT_DECODED) {
+                    upload(slot);
+                    loaded++;
+                } else if (state == SLOT_UPLOADING && vkGetFenceStatus(logicalDevice, slot.fence) == VK_SUCCESS)
+                    release(slot);
+            }
+            return loaded;
+        }
+
+        // Waits until every queued image has been loaded and its upload has completed.
+        void flush() {
+            while (true) {
+                poll();
+                std::unique_lock<std::mutex> lock(mutex);
+                if (outstanding == 0)
+                    return;
+                auto uploading = std::find_if(slots.begin(), slots.end(), [](const Slot& slot) { return slot.state == SLOT_UPLOADING; });
+                if (uploading != slots.end()) {
+                    lock.unlock();
+                    vkWaitForFences(logicalDevice, 1, &uploading->fence, VK_TRUE, UINT64_MAX);
+                    continue;
+                }
+                decoded.wait(lock, [this]() {
+                    return std::any_of(slots.begin(), slots.end(), [](const Slot& slot) { return slot.state == SLOT_DECODED; });
+                });
+            }
+        }
+
+        // Loads everything still queued, then stops the threads and releases the slots.
+        void destroy() {
+            flush();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running = false;
+            }
+            wake.notify_all();
+            for (std::thread& thread : threads)
+                thread.join();
+            threads.clear();
+            for (Slot& slot : slots) {
+                if (slot.buffer != VK_NULL_HANDLE)
+                    allocator->destroyBuffer(slot.buffer, slot.allocation);
+                vkDestroyFence(logicalDevice, slot.fence, nullptr);
+            }
+            slots.clear();
+            vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
+            commandPool = VK_NULL_HANDLE;
+        }
+
+    private:
+        enum SlotState {
+            SLOT_FREE,
+            SLOT_DECODING,
+            SLOT_DECODED,
+            SLOT_UPLOADING
+        };
+        struct Request {
+            std::string filename;
+            VkFormat format = VK_FORMAT_UNDEFINED;
+            bool mipmaps = false;
+            ImageLoadCallback callback;
+            std::chrono::steady_clock::time_point queued;
+        };
+        struct Slot {
+            VkBuffer buffer = VK_NULL_HANDLE;
+            Allocation allocation;
+            VkDeviceSize capacity = 0;
+            VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+            VkFence fence = VK_NULL_HANDLE;
+            SlotState state = SLOT_FREE;
+            Request request;
+            LoadedImage image;
+        };
+
+        Allocator* allocator = nullptr;
+        VkDevice logicalDevice = VK_NULL_HANDLE;
+        VkQueue queue = VK_NULL_HANDLE;
+        VkCommandPool commandPool = VK_NULL_HANDLE;
+        ImageDecoder decoder;
+        std::vector<Slot> slots;
+        std::vector<std::thread> threads;
+        // Guards requests, outstanding, running and the slots' states
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable decoded;
+        std::deque<Request> requests;
+        uint32_t outstanding = 0; // Requests whose slot hasn't been released yet
+        bool running = false;
+
+        // Makes sure the slot's buffer fits the image, called by the decoder once it
+        // knows the extent
+        void* reserve(Slot& slot, VkExtent2D extent, VkDeviceSize size) {
+            size = std::max(size, (VkDeviceSize)extent.width * extent.height * 4);
+            if (slot.capacity < size) {
+                if (slot.buffer != VK_NULL_HANDLE)
+                    allocator->destroyBuffer(slot.buffer, slot.allocation);
+                allocator->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, slot.buffer, slot.allocation);
+                slot.capacity = size;
+            }
+            slot.image.extent = extent;
+            return slot.allocation.mapped;
+        }
+
+        // Takes requests one at a time, once a slot is free to decode into
+        void workerLoop() {
+            TALOS_TRACE_THREAD("image loader");
+            while (true) {
+                Slot* slot = nullptr;
+                Request request;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&]() {
+                        if (!running)
+                            return true;
+                        if (requests.empty())
+                            return false;
+                        auto free = std::find_if(slots.begin(), slots.end(), [](const Slot& slot) { return slot.state == SLOT_FREE; });
+                        slot = free != slots.end() ? &*free : nullptr;
+                        return slot != nullptr;
+                    });
+                    if (!running)
+                        return;
+                    request = std::move(requests.front());
+                    requests.pop_front();
+                    slot->state = SLOT_DECODING;
+                }
+                auto start = std::chrono::steady_clock::now();
+                LoadedImage& image = slot->image;
+                image = LoadedImage{};
+                image.filename = request.filename;
+                image.format = request.format;
+                try {
+                    TALOS_ZONE("decode image");
+                    image.error = decoder(request.filename, [this, slot](VkExtent2D extent, VkDeviceSize size) { return reserve(*slot, extent, size); });
+                } catch (const std::exception& e) {
+                    image.error = e.what();
+                }
+                if (image.error.empty() && (image.extent.width == 0 || image.extent.height == 0))
+                    image.error = "Image '" + request.filename + "' is empty!";
+                image.decodeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    slot->request = std::move(request);
+                    slot->state = SLOT_DECODED;
+                }
+                decoded.notify_all();
+            }
+        }
+
+        // Creates the image and submits the copy of the decoded pixels into it, then
+        // hands the image over. Failed decodes release their slot right away.
+        void upload(Slot& slot) {
+            TALOS_ZONE("upload image");
+            LoadedImage& image = slot.image;
+            if (image.error.empty()) {
+                image.levelCount = slot.request.mipmaps ? mipLevelCount(image.extent) : 1;
+                VkImageCreateInfo imageInfo{};
+                imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+                imageInfo.imageType = VK_IMAGE_TYPE_2D;
+                imageInfo.extent = { image.extent.width, image.extent.height, 1 };
+                imageInfo.mipLevels = image.levelCount;
+                imageInfo.arrayLayers = 1;
+                imageInfo.format = image.format;
+                imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+                imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+                imageInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+                if (image.levelCount > 1)
+                    imageInfo.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+                imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+                imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+                allocator->createImage(imageInfo, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image.image, image.allocation);
+                vkResetCommandBuffer(slot.commandBuffer, 0);
+                VkCommandBufferBeginInfo beginInfo{};
+                beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+                if (vkBeginCommandBuffer(slot.commandBuffer, &beginInfo) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to begin recording image loader command buffer!");
+                if (image.levelCount > 1) {
+                    recordImageUpload(slot.commandBuffer, slot.buffer, 0, image.image, image.extent, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+                    recordMipmapGeneration(slot.commandBuffer, image.image, image.extent, image.levelCount, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+                } else
+                    recordImageUpload(slot.commandBuffer, slot.buffer, 0, image.image, image.extent, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+                // Make the upload visible to everything submitted to the queue afterwards
+                VkMemoryBarrier barrier{};
+                barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+                vkCmdPipelineBarrier(slot.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+                if (vkEndCommandBuffer(slot.commandBuffer) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to record image loader command buffer!");
+                vkResetFences(logicalDevice, 1, &slot.fence);
+                VkSubmitInfo submitInfo{};
+                submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                submitInfo.commandBufferCount = 1;
+                submitInfo.pCommandBuffers = &slot.commandBuffer;
+                if (vkQueueSubmit(queue, 1, &submitInfo, slot.fence) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to submit image loader command buffer!");
+            }
+            image.latencyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - slot.request.queued).count();
+            // The slot may be taken again as soon as it's released, keep what the callback needs
+            LoadedImage loaded = std::move(image);
+            ImageLoadCallback callback = std::move(slot.request.callback);
+            slot.request = Request{};
+            if (!loaded.error.empty()) {
+                release(slot);
+            } else {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.state = SLOT_UPLOADING;
+            }
+            if (callback)
+                callback(loaded);
+        }
+
+        void release(Slot& slot) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.state = SLOT_FREE;
+                outstanding--;
+            }
+            wake.notify_all();
+        }
+    };
+
+    // ---- GPU PROFILER ----
+
+    // Pipeline statistics gathered per scope when enabled, in the order of
+    // GPU_STATISTIC_FLAGS
+    enum GpuStatistic {
+        GPU_STATISTIC_VERTICES,
+        GPU_STATISTIC_PRIMITIVES,
+        GPU_STATISTIC_VERTEX_INVOCATIONS,
+        GPU_STATISTIC_CLIPPED_PRIMITIVES,
+        GPU_STATISTIC_FRAGMENT_INVOCATIONS,
+        GPU_STATISTIC_COMPUTE_INVOCATIONS,
+        GPU_STATISTIC_COUNT
+    };
+
+    const VkQueryPipelineStatisticFlags GPU_STATISTIC_FLAGS =
+        VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_VERTICES_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT |
+        VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+
+    const char* GPU_STATISTIC_NAMES[GPU_STATISTIC_COUNT] = { "vertices", "primitives", "vs", "clipped", "fs", "cs" };
+
+    // A scope's GPU time in one frame, as read back by GpuProfiler. Times are in
+    // milliseconds, starts relative to the first frame read back.
+    struct GpuScopeSample {
+        uint32_t name = 0; // Index into GpuProfiler::getScopeNames()
+        uint32_t depth = 0;
+        uint64_t frame = 0;
+        double startMs = 0.0;
+        double durationMs = 0.0;
+        bool hasStatistics = false;
+        uint64_t statistics[GPU_STATISTIC_COUNT] = {};
+    };
+
+    // Times named scopes of command buffers with timestamp queries, one query pool
+    // per frame slot so a frame's queries are only reset once its slot comes around
+    // again. Results are read back when that happens, frameCount frames later, by
+    // which time the caller has waited for the frame's fence, so reading them never
+    // blocks; a frame whose results still aren't available is dropped. Scopes nest,
+    // and every frame also gets a "frame" scope from its first timestamp to its last.
+    // Pipeline statistics, if enabled, are gathered for outermost scopes only, as
+    // only one statistics query can be active at a time. They need the device's
+    // pipelineStatisticsQuery feature enabled by the caller. Keeps a rolling window
+    // of durations per scope name for printTable() and every sample up to a limit
+    // for writeChromeTrace(). A queue family without timestamp support disables the
+    // profiler, turning every call into a no-op. Not thread safe.
+    class GpuProfiler {
+    public:
+        static constexpr uint32_t DEFAULT_MAX_SCOPES = 64;
+        static constexpr size_t HISTORY_FRAMES = 240;
+        static constexpr size_t MAX_TRACE_SAMPLES = 1 << 20;
+
+        void create(VkPhysicalDevice physicalDevice, VkDevice _logicalDevice, uint32_t queueFamily, uint32_t frameCount, bool pipelineStatistics = false, uint32_t _maxScopes = DEFAULT_MAX_SCOPES) {
+            logicalDevice = _logicalDevice;
+            maxScopes = _maxScopes;
+            uint32_t familyCount = 0;
+            vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, nullptr);
+            std::vector<VkQueueFamilyProperties> families(familyCount);
+            vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familyCount, families.data());
+            uint32_t validBits = queueFamily < familyCount ? families[queueFamily].timestampValidBits : 0;
+            if (validBits == 0)
+                return;
+            timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+            timestampPeriod = properties.limits.timestampPeriod;
+            VkPhysicalDeviceFeatures features;
+            vkGetPhysicalDeviceFeatures(physicalDevice, &features);
+            statistics = pipelineStatistics && features.pipelineStatisticsQuery;
+            // Queues without graphics can only count compute invocations
+            graphicsStatistics = (families[queueFamily].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+            // Create each frame slot's query pools
+            slots.resize(frameCount);
+            for (Slot& slot : slots) {
+                VkQueryPoolCreateInfo poolInfo{};
+                poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+                poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+                poolInfo.queryCount = maxScopes * 2;
+                if (vkCreateQueryPool(logicalDevice, &poolInfo, nullptr, &slot.timestamps) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to create timestamp query pool!");
+                if (!statistics)
+                    continue;
+                poolInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+                poolInfo.queryCount = maxScopes;
+                poolInfo.pipelineStatistics = graphicsStatistics ? GPU_STATISTIC_FLAGS : (VkQueryPipelineStatisticFlags)VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+                if (vkCreateQueryPool(logicalDevice, &poolInfo, nullptr, &slot.statistics) != VK_SUCCESS)
+                    throw std::runtime_error("Failed to create pipeline statistics query pool!");
+            }
+            frameName = internName("frame");
+        }
+
+        void destroy() {
+            for (Slot& slot : slots) {
+                vkDestroyQueryPool(logicalDevice, slot.timestamps, nullptr);
+                if (slot.statistics != VK_NULL_HANDLE)
+                    vkDestroyQueryPool(logicalDevice, slot.statistics, nullptr);
+            }
+            slots.clear();
+        }
+
+        bool enabled() const { return !slots.empty(); }
+        bool statisticsEnabled() const { return statistics; }
+
+        // Starts a frame in the next slot, recording the reset of its queries into cmd
+        // outside of any render pass. Reads back the slot's last frame first, so the
+        // frame submitted frameCount frames ago must have completed.
+        void beginFrame(VkCommandBuffer cmd) {
+            if (!enabled())
+                return;
+            current = (uint32_t)(frameIndex % slots.size());
+            Slot& slot = slots[current];
+            collect(slot);
+            slot.frame = frameIndex++;
+            slot.scopes.clear();
+            slot.pending = true;
+            stack.clear();
+            vkCmdResetQueryPool(cmd, slot.timestamps, 0, maxScopes * 2);
+            if (statistics)
+                vkCmdResetQueryPool(cmd, slot.statistics, 0, maxScopes);
+        }
+
+        // Opens a scope in cmd, closed by the matching endScope. Scopes past
+        // maxScopes in a frame are skipped.
+        void beginScope(VkCommandBuffer cmd, const char* name) {
+            if (!enabled())
+                return;
+            Slot& slot = slots[current];
+            if (slot.scopes.size() >= maxScopes) {
+                stack.push_back(NO_SCOPE);
+                overflowedScopes++;
+                return;
+            }
+            uint32_t index = (uint32_t)slot.scopes.size();
+            Scope scope;
+            scope.name = internName(name);
+            scope.depth = (uint32_t)stack.size();
+            scope.hasStatistics = statistics && !statisticsActive;
+            slot.scopes.push_back(scope);
+            stack.push_back(index);
+            vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, slot.timestamps, index * 2);
+            if (scope.hasStatistics) {
+                vkCmdBeginQuery(cmd, slot.statistics, index, 0);
+                statisticsActive = true;
+            }
+        }
+
+        void endScope(VkCommandBuffer cmd) {
+            if (!enabled() || stack.empty())
+                return;
+            uint32_t index = stack.back();
+            stack.pop_back();
+            if (index == NO_SCOPE)
+                return;
+            Slot& slot = slots[current];
+            if (slot.scopes[index].hasStatistics) {
+                vkCmdEndQuery(cmd, slot.statistics, index);
+                statisticsActive = false;
+            }
+            vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, slot.timestamps, index * 2 + 1);
+        }
+
+        // Reads back every frame still pending without waiting, e.g. after waiting
+        // for the device before reporting.
+        void collect() {
+            for (Slot& slot : slots)
+                collect(slot);
+        }
+
+        // Prints the rolling window's average and p50 / p95 / p99 GPU times per scope
+        // name, indented by nesting, and the average statistics of scopes with any.
+        void printTable() const {
+            if (!enabled()) {
+                printf("GPU profiler: timestamps unsupported on this queue.\n");
+                return;
+            }
+            printf("GPU times over the last %zu frames (%llu dropped, %llu scopes over the limit):\n", HISTORY_FRAMES,
+                (unsigned long long)droppedFrames, (unsigned long long)overflowedScopes);
+            printf("\t%-24s %9s %9s %9s %9s\n", "scope", "avg", "p50", "p95", "p99");
+            for (uint32_t name : nameOrder) {
+                const History& history = histories[name];
+                if (history.durations.empty())
+                    continue;
+                std::vector<double> sorted(history.durations.begin(), history.durations.end());
+                std::sort(sorted.begin(), sorted.end());
+                double sum = 0.0;
+                for (double d : sorted)
+                    sum += d;
+                std::string label = std::string(history.depth * 2, ' ') + names[name];
+                printf("\t%-24s %6.3f ms %6.3f ms %6.3f ms %6.3f ms\n", label.c_str(), sum / sorted.size(),
+                    percentile(sorted, 50), percentile(sorted, 95), percentile(sorted, 99));
+            }
+            if (!statistics)
+                return;
+            printf("\t%-24s", "statistics (avg)");
+            for (uint32_t s = 0; s < GPU_STATISTIC_COUNT; s++)
+                printf(" %10s", GPU_STATISTIC_NAMES[s]);
+            printf("\n");
+            for (uint32_t name : nameOrder) {
+                const History& history = histories[name];
+                if (history.statisticsSamples == 0)
+                    continue;
+                printf("\t%-24s", names[name].c_str());
+                for (uint32_t s = 0; s < GPU_STATISTIC_COUNT; s++)
+                    printf(" %10.0f", (double)history.statisticsSums[s] / history.statisticsSamples);
+                printf("\n");
+            }
+        }
+
+        // Writes every sample kept as Chrome trace event JSON, for chrome://tracing or
+        // Perfetto. Returns false if the file couldn't be written.
+        bool writeChromeTrace(const std::string& filename, const char* processName = "GPU") const {
+            FILE* file = fopen(filename.c_str(), "w");
+            if (!file)
+                return false;
+            fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+            fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"%s\"}}", escapeJson(processName).c_str());
+            for (const GpuScopeSample& sample : samples) {
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu",
+                    escapeJson(names[sample.name]).c_str(), sample.startMs * 1000.0, sample.durationMs * 1000.0, (unsigned long long)sample.frame);
+                if (sample.hasStatistics)
+                    for (uint32_t s = 0; s < GPU_STATISTIC_COUNT; s++)
+                        fprintf(file, ",\"%s\":%llu", GPU_STATISTIC_NAMES[s], (unsigned long long)sample.statistics[s]);
+                fprintf(file, "}}");
+            }
+            fprintf(file, "\n]}\n");
+            return fclose(file) == 0;
+        }
+
+        const std::vector<std::string>& getScopeNames() const { return names; }
+        const std::vector<GpuScopeSample>& getSamples() const { return samples; }
+        uint64_t getDroppedFrames() const { return droppedFrames; }
+
+    private:
+        static constexpr uint32_t NO_SCOPE = UINT32_MAX;
+
+        struct Scope {
+            uint32_t name = 0;
+            uint32_t depth = 0;
+            bool hasStatistics = false;
+        };
+
+        struct Slot {
+            VkQueryPool timestamps = VK_NULL_HANDLE;
+            VkQueryPool statistics = VK_NULL_HANDLE;
+            std::vector<Scope> scopes;
+            uint64_t frame = 0;
+            bool pending = false;
+        };
+
+        struct History {
+            bool listed = false;
+            uint32_t depth = 0; // Of the first sample, for indenting the table
+            std::deque<double> durations;
+            uint64_t statisticsSums[GPU_STATISTIC_COUNT] = {};
+            uint64_t statisticsSamples = 0;
+        };
+
+        VkDevice logicalDevice = VK_NULL_HANDLE;
+        uint32_t maxScopes = 0;
+        uint64_t timestampMask = 0;
+        float timestampPeriod = 1.0f; // Nanoseconds per tick
+        bool statistics = false;
+        bool graphicsStatistics = false;
+        bool statisticsActive = false;
+        std::vector<Slot> slots;
+        uint32_t current = 0;
+        uint64_t frameIndex = 0;
+        std::vector<uint32_t> stack;
+        std::vector<std::string> names;
+        std::map<std::string, uint32_t> nameIndices;
+        std::vector<uint32_t> nameOrder; // Names in the order first read back, for the table
+        uint32_t frameName = 0;
+        std::vector<History> histories;
+        std::vector<GpuScopeSample> samples;
+        bool haveOrigin = false;
+        uint64_t origin = 0;
+        uint64_t droppedFrames = 0;
+        uint64_t overflowedScopes = 0;
+        // Scratch for query results
+        std::vector<uint64_t> timestampResults;
+        std::vector<uint64_t> statisticsResults;
+
+        uint32_t internName(const char* name) {
+            auto it = nameIndices.find(name);
+            if (it != nameIndices.end())
+                return it->second;
+            uint32_t index = (uint32_t)names.size();
+            names.push_back(name);
+            nameIndices[name] = index;
+            histories.emplace_back();
+            return index;
+        }
+
+        // Reads back the slot's frame if it's complete, dropping it otherwise
+        void collect(Slot& slot) {
+            if (!slot.pending)
+                return;
+            slot.pending = false;
+            uint32_t count = (uint32_t)slot.scopes.size();
+            if (count == 0)
+                return;
+            timestampResults.resize(count * 2);
+            if (vkGetQueryPoolResults(logicalDevice, slot.timestamps, 0, count * 2, timestampResults.size() * sizeof(uint64_t), timestampResults.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+                droppedFrames++;
+                return;
+            }
+            if (statistics) {
+                // Without graphics statistics the only one is compute invocations, moved in place below
+                uint32_t statisticCount = graphicsStatistics ? GPU_STATISTIC_COUNT : 1;
+                statisticsResults.assign(count * GPU_STATISTIC_COUNT, 0);
+                for (uint32_t i = 0; i < count; i++) {
+                    uint64_t* results = &statisticsResults[i * GPU_STATISTIC_COUNT];
+                    if (!slot.scopes[i].hasStatistics)
+                        continue;
+                    if (vkGetQueryPoolResults(logicalDevice, slot.statistics, i, 1, statisticCount * sizeof(uint64_t), results, statisticCount * sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+                        droppedFrames++;
+                        return;
+                    }
+                    if (!graphicsStatistics)
+                        std::swap(results[0], results[GPU_STATISTIC_COMPUTE_INVOCATIONS]);
+                }
+            }
+            uint64_t frameStart = UINT64_MAX, frameEnd = 0;
+            for (uint64_t& t : timestampResults) {
+                t &= timestampMask;
+                frameStart = std::min(frameStart, t);
+                frameEnd = std::max(frameEnd, t);
+            }
+            if (!haveOrigin) {
+                origin = frameStart;
+                haveOrigin = true;
+            }
+            GpuScopeSample frameSample;
+            frameSample.name = frameName;
+            frameSample.frame = slot.frame;
+            frameSample.startMs = ticksToMs(frameStart);
+            frameSample.durationMs = ticksToMs(frameEnd) - frameSample.startMs;
+            record(frameSample);
+            for (uint32_t i = 0; i < count; i++) {
+                GpuScopeSample sample;
+                sample.name = slot.scopes[i].name;
+                sample.depth = slot.scopes[i].depth + 1;
+                sample.frame = slot.frame;
+                sample.startMs = ticksToMs(timestampResults[i * 2]);
+                sample.durationMs = std::max(0.0, ticksToMs(timestampResults[i * 2 + 1]) - sample.startMs);
+                sample.hasStatistics = slot.scopes[i].hasStatistics;
+                if (sample.hasStatistics)
+                    memcpy(sample.statistics, &statisticsResults[i * GPU_STATISTIC_COUNT], sizeof(sample.statistics));
+                record(sample);
+            }
+        }
+
+        // Relative to the first frame read back, timestamps before it (from another
+        // queue, or wrapped around) come out negative
+        double ticksToMs(uint64_t ticks) const {
+            return (double)(int64_t)(ticks - origin) * timestampPeriod / 1e6;
+        }
+
+        void record(const GpuScopeSample& sample) {
+            History& history = histories[sample.name];
+            if (!history.listed) {
+                nameOrder.push_back(sample.name);
+                history.depth = sample.depth;
+                history.listed = true;
+            }
+            history.durations.push_back(sample.durationMs);
+            if (history.durations.size() > HISTORY_FRAMES)
+                history.durations.pop_front();
+            if (sample.hasStatistics) {
+                for (uint32_t s = 0; s < GPU_STATISTIC_COUNT; s++)
+                    history.statisticsSums[s] += sample.statistics[s];
+                history.statisticsSamples++;
+            }
+            if (samples.size() < MAX_TRACE_SAMPLES)
+                samples.push_back(sample);
+        }
+
+        // Nearest rank percentile of sorted values
+        static double percentile(const std::vector<double>& sorted, double p) {
+            size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+            return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+        }
+    };
 }
 
 #endif
\ No newline at end of file
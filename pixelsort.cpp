@@ -3,14 +3,21 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #include <VecMat.h>
+#include <talos.h>
 
 #include <vector>
+#include <set>
 #include <string>
 #include <cstdio>
 #include <stdexcept>
 #include <optional>
 #include <limits>
 #include <fstream>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <filesystem>
+#include <algorithm>
 
 #pragma warning(disable : 26812)
 
@@ -21,9 +28,15 @@ using std::nullopt;
 using std::make_optional;
 using std::string;
 
+typedef std::chrono::high_resolution_clock Clock;
+
 const uint32_t WIN_WIDTH = 800;
 const uint32_t WIN_HEIGHT = 800;
 const int MAX_CPU_PROCESSED_FRAMES = 2;
+// Destination images of windowed runs, one is displayed while the next sort runs
+const uint32_t DST_IMAGE_COUNT = 2;
+const uint32_t NO_DST_IMAGE = UINT32_MAX;
+const string PIPELINE_CACHE_FILENAME = "pixelsort.pipelinecache";
 const vector<const char*> deviceExtensions = {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
@@ -72,37 +85,479 @@ struct Vertex {
 };
 
 const vector<Vertex> vertices = {
-    {{-1, -1, 0}, {1, 1}},
-    {{1, -1, 0},  {0, 1}},
-    {{1, 1, 0},   {0, 0}},
-    {{1, 1, 0},   {0, 0}},
-    {{-1, 1, 0},  {1, 0}},
-    { {-1, -1, 0}, {1, 1}}
+    {{-1, -1, 0}, {0, 0}},
+    {{1, -1, 0},  {1, 0}},
+    {{1, 1, 0},   {1, 1}},
+    {{1, 1, 0},   {1, 1}},
+    {{-1, 1, 0},  {0, 1}},
+    {{-1, -1, 0}, {0, 0}}
+};
+
+// Work group size, shared memory block size and longest span sorted by a single
+// invocation of shaders/pixelsort.comp
+const uint32_t SORT_GROUP_SIZE = 128;
+const uint32_t SORT_BLOCK_SIZE = 2048;
+const uint32_t SORT_TINY_SPAN = 32;
+// Step of the runtime threshold controls
+const uint32_t SORT_THRESHOLD_STEP = 2048;
+// Byte size of the counts and indirect dispatches ahead of the span list
+const VkDeviceSize SPAN_HEADER_SIZE = 96;
+
+enum SortKey : uint32_t {
+    SORT_KEY_LUMINANCE,
+    SORT_KEY_HUE,
+    SORT_KEY_SATURATION,
+    SORT_KEY_COUNT
+};
+
+const char* SORT_KEY_NAMES[SORT_KEY_COUNT] = { "luminance", "hue", "saturation" };
+
+enum SortStage : uint32_t {
+    SORT_STAGE_KEYS,
+    SORT_STAGE_SEGMENT,
+    SORT_STAGE_SORT_TINY,
+    SORT_STAGE_SORT_SHORT,
+    SORT_STAGE_LOAD_LONG,
+    SORT_STAGE_SORT_BLOCK,
+    SORT_STAGE_MERGE_BLOCK,
+    SORT_STAGE_MERGE_GLOBAL,
+    SORT_STAGE_SCATTER_LONG
+};
+
+// How pixels get sorted, changing any of it queues a new sort. Only runs of pixels
+// with keys within the thresholds are sorted, the full range sorts whole lines.
+struct SortSettings {
+    SortKey key = SORT_KEY_LUMINANCE;
+    bool vertical = false;
+    bool descending = false;
+    uint32_t lowerThreshold = 0;
+    uint32_t upperThreshold = 65535;
+};
+
+string describeSort(const SortSettings& settings) {
+    string description = string(settings.vertical ? "columns" : "rows") + " by " + SORT_KEY_NAMES[settings.key];
+    if (settings.descending)
+        description += ", descending";
+    if (settings.lowerThreshold > 0 || settings.upperThreshold < 65535)
+        description += ", keys " + std::to_string(settings.lowerThreshold) + "-" + std::to_string(settings.upperThreshold);
+    return description;
+}
+
+// Push constants of shaders/pixelsort.comp
+struct SortParams {
+    uint32_t stage;
+    uint32_t sortKey;
+    uint32_t vertical;
+    uint32_t descending;
+    uint32_t width;
+    uint32_t height;
+    uint32_t lineSize;
+    uint32_t k;
+    uint32_t j;
+    uint32_t lowerThreshold;
+    uint32_t upperThreshold;
+    uint32_t spanCapacity;
+    uint32_t previousLower;
+    uint32_t previousUpper;
+    uint32_t resortAll;
+    uint32_t outputBuffer;
+};
+
+// How much of the last sort a new one can reuse, from most to least
+enum SortUpdate {
+    // Only the direction changed, re-sort the spans already listed
+    SORT_UPDATE_RESORT,
+    // Thresholds changed, list and sort the spans that differ from the last sort
+    SORT_UPDATE_SPANS,
+    // New image, key or orientation, recompute the keys and sort every span
+    SORT_UPDATE_FULL
+};
+
+uint32_t nextPowerOfTwo(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+// Line and span list sizes for sorting an image along one direction. Spans need at
+// least two pixels and are separated by at least one, which bounds how many a line
+// can hold. Long spans, over SORT_BLOCK_SIZE pixels, each get a whole padded line
+// of entries.
+struct SortLayout {
+    uint32_t lineLength;
+    uint32_t lineCount;
+    uint32_t lineSize;
+    uint32_t spanCapacity;
+    uint32_t longCapacity;
+    SortLayout(VkExtent2D extent, bool vertical) {
+        lineLength = vertical ? extent.height : extent.width;
+        lineCount = vertical ? extent.width : extent.height;
+        lineSize = nextPowerOfTwo(lineLength);
+        spanCapacity = lineCount * ((lineLength + 1) / 3);
+        longCapacity = lineCount * ((lineLength + 1) / (SORT_BLOCK_SIZE + 2));
+    }
+    VkDeviceSize spanBufferSize() const { return SPAN_HEADER_SIZE + ((VkDeviceSize)spanCapacity + longCapacity) * 2 * sizeof(uint32_t); }
+    VkDeviceSize keyBufferSize() const { return (VkDeviceSize)lineCount * ((lineLength + 1) / 2) * sizeof(uint32_t); }
+    VkDeviceSize pixelBufferSize() const { return (VkDeviceSize)lineLength * lineCount * sizeof(uint32_t); }
+    VkDeviceSize entryBufferSize() const { return std::max<VkDeviceSize>((VkDeviceSize)longCapacity * lineSize * sizeof(uint32_t), sizeof(uint32_t)); }
+};
+
+// Device memory sorting an image of the given extent takes, with buffers sized to
+// sort either rows or columns: the pixels, their output, keys, spans and entries
+VkDeviceSize sortWorkingSetSize(VkExtent2D extent) {
+    SortLayout rows(extent, false), columns(extent, true);
+    return rows.pixelBufferSize() * 2 + std::max(rows.keyBufferSize(), columns.keyBufferSize()) +
+        std::max(rows.spanBufferSize(), columns.spanBufferSize()) + std::max(rows.entryBufferSize(), columns.entryBufferSize());
+}
+
+// Largest storage buffer of the working set, bound whole by the compute shader
+VkDeviceSize largestSortBuffer(VkExtent2D extent) {
+    SortLayout rows(extent, false), columns(extent, true);
+    return std::max({ rows.pixelBufferSize(), rows.keyBufferSize(), columns.keyBufferSize(), rows.spanBufferSize(), columns.spanBufferSize(),
+        rows.entryBufferSize(), columns.entryBufferSize() });
+}
+
+// Decodes an image file to packed RGBA8 pixels
+vector<uint32_t> decodePixels(const string& filename, uint32_t& width, uint32_t& height) {
+    int srcWidth, srcHeight, srcChannels;
+    stbi_uc* pixels = stbi_load(filename.c_str(), &srcWidth, &srcHeight, &srcChannels, STBI_rgb_alpha);
+    if (!pixels)
+        throw runtime_error("Failed to load texture '" + filename + "'!");
+    width = (uint32_t)srcWidth;
+    height = (uint32_t)srcHeight;
+    vector<uint32_t> packed((size_t)width * height);
+    memcpy(packed.data(), pixels, packed.size() * sizeof(uint32_t));
+    stbi_image_free(pixels);
+    return packed;
+}
+
+// Image read in strips of whole rows or columns, packed RGBA8 and row major. A
+// strip of columns is an image count pixels wide and as tall as the source.
+struct ImageSource {
+    uint32_t width = 0, height = 0;
+    virtual ~ImageSource() {}
+    virtual void readStrip(bool vertical, uint32_t first, uint32_t count, uint32_t* strip) = 0;
+    vector<uint32_t> readAll() {
+        vector<uint32_t> pixels((size_t)width * height);
+        readStrip(false, 0, height, pixels.data());
+        return pixels;
+    }
+};
+
+// Image decoded whole by stb_image, for the compressed formats
+struct DecodedImageSource : ImageSource {
+    vector<uint32_t> pixels;
+    DecodedImageSource(const string& filename) { pixels = decodePixels(filename, width, height); }
+    void readStrip(bool vertical, uint32_t first, uint32_t count, uint32_t* strip) override {
+        if (!vertical) {
+            memcpy(strip, &pixels[(size_t)first * width], (size_t)count * width * sizeof(uint32_t));
+            return;
+        }
+        for (uint32_t y = 0; y < height; y++)
+            memcpy(&strip[(size_t)y * count], &pixels[(size_t)y * width + first], count * sizeof(uint32_t));
+    }
+};
+
+// Binary PPM read straight from the file a strip at a time, so images of any size
+// take memory for a strip only
+struct PpmImageSource : ImageSource {
+    std::ifstream file;
+    std::streamoff dataOffset = 0;
+    vector<uint8_t> rgb;
+    // Returns false if the file isn't an 8 bit binary PPM
+    bool open(const string& filename) {
+        file.open(filename, std::ios::binary);
+        string magic;
+        uint32_t maxValue = 0;
+        if (!(file >> magic) || magic != "P6" || !readHeaderValue(width) || !readHeaderValue(height) || !readHeaderValue(maxValue) || maxValue != 255)
+            return false;
+        file.get(); // Single whitespace before the pixels
+        dataOffset = file.tellg();
+        return width > 0 && height > 0;
+    }
+    bool readHeaderValue(uint32_t& value) {
+        file >> std::ws;
+        while (file.peek() == '#') {
+            file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            file >> std::ws;
+        }
+        return (bool)(file >> value);
+    }
+    // Reads count pixels at (x, y) into pixels
+    void readPixels(uint32_t x, uint32_t y, uint32_t count, uint32_t* pixels) {
+        rgb.resize((size_t)count * 3);
+        file.seekg(dataOffset + ((std::streamoff)y * width + x) * 3);
+        if (!file.read((char*)rgb.data(), rgb.size()))
+            throw runtime_error("Failed to read PPM pixels!");
+        for (uint32_t i = 0; i < count; i++)
+            pixels[i] = rgb[i * 3] | (rgb[i * 3 + 1] << 8) | (rgb[i * 3 + 2] << 16) | 0xFF000000u;
+    }
+    void readStrip(bool vertical, uint32_t first, uint32_t count, uint32_t* strip) override {
+        for (uint32_t y = 0; y < (vertical ? height : count); y++) {
+            if (vertical)
+                readPixels(first, y, count, &strip[(size_t)y * count]);
+            else
+                readPixels(0, first + y, width, &strip[(size_t)y * width]);
+        }
+    }
+};
+
+std::unique_ptr<ImageSource> openImageSource(const string& filename) {
+    TALOS_ZONE("open image");
+    std::unique_ptr<PpmImageSource> ppm(new PpmImageSource());
+    if (ppm->open(filename))
+        return ppm;
+    return std::unique_ptr<ImageSource>(new DecodedImageSource(filename));
+}
+
+// Binary PPM written a strip at a time, the counterpart of PpmImageSource
+struct PpmImageSink {
+    std::ofstream file;
+    std::streamoff dataOffset = 0;
+    uint32_t width, height;
+    vector<uint8_t> rgb;
+    PpmImageSink(const string& filename, uint32_t width, uint32_t height) : width(width), height(height) {
+        file.open(filename, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+            throw runtime_error("Failed to write '" + filename + "'!");
+        file << "P6\n" << width << " " << height << "\n255\n";
+        dataOffset = file.tellp();
+    }
+    void writePixels(uint32_t x, uint32_t y, uint32_t count, const uint32_t* pixels) {
+        rgb.resize((size_t)count * 3);
+        for (uint32_t i = 0; i < count; i++)
+            memcpy(&rgb[i * 3], &pixels[i], 3);
+        file.seekp(dataOffset + ((std::streamoff)y * width + x) * 3);
+        if (!file.write((const char*)rgb.data(), rgb.size()))
+            throw runtime_error("Failed to write PPM pixels!");
+    }
+    void writeStrip(bool vertical, uint32_t first, uint32_t count, const uint32_t* strip) {
+        for (uint32_t y = 0; y < (vertical ? height : count); y++) {
+            if (vertical)
+                writePixels(first, y, count, &strip[(size_t)y * count]);
+            else
+                writePixels(0, first + y, width, &strip[(size_t)y * width]);
+        }
+    }
+};
+
+// Computes the sort keys of count packed RGBA8 pixels exactly as pixelKey in
+// shaders/pixelsort.comp does, SIMD_LANES pixels at a time. The float math gives
+// the same results as the shader's integer math: every product fits in 24 bits,
+// and a quotient that isn't a whole number is at least 1/255 away from one, far
+// more than its rounding error.
+void computeSortKeys(const uint32_t* pixels, uint32_t count, SortKey key, bool descending, uint16_t* keys) {
+    const float SECTOR = 10922.0f;
+    SimdFloat zero = SimdSet(0.0f), sector = SimdSet(SECTOR);
+    auto computeLanes = [&](SimdFloat vr, SimdFloat vg, SimdFloat vb, uint32_t i, uint32_t n) {
+        SimdFloat vk;
+        if (key == SORT_KEY_LUMINANCE) {
+            vk = SimdAdd(SimdAdd(SimdMul(vr, SimdSet(77.0f)), SimdMul(vg, SimdSet(150.0f))), SimdMul(vb, SimdSet(29.0f)));
+        } else {
+            SimdFloat hi = SimdMax(vr, SimdMax(vg, vb)), lo = SimdMin(vr, SimdMin(vg, vb)), c = SimdSub(hi, lo);
+            if (key == SORT_KEY_SATURATION) {
+                vk = SimdSelect(SimdEqual(hi, zero), zero, SimdTrunc(SimdDiv(SimdMul(c, SimdSet(65535.0f)), hi)));
+            } else {
+                // Truncation is symmetric around zero, so the shader's subtraction from
+                // the sector start is an addition of a negative offset here
+                SimdFloat hr = SimdAdd(SimdTrunc(SimdDiv(SimdMul(SimdSub(vg, vb), sector), c)), SimdSelect(SimdLess(vg, vb), SimdSet(6 * SECTOR), zero));
+                SimdFloat hg = SimdAdd(SimdTrunc(SimdDiv(SimdMul(SimdSub(vb, vr), sector), c)), SimdSet(2 * SECTOR));
+                SimdFloat hb = SimdAdd(SimdTrunc(SimdDiv(SimdMul(SimdSub(vr, vg), sector), c)), SimdSet(4 * SECTOR));
+                vk = SimdSelect(SimdEqual(hi, vr), hr, SimdSelect(SimdEqual(hi, vg), hg, hb));
+                vk = SimdSelect(SimdEqual(c, zero), zero, vk);
+            }
+        }
+        float k[SIMD_LANES];
+        SimdStore(k, vk);
+        for (uint32_t l = 0; l < n; l++) {
+            uint32_t value = (uint32_t)k[l];
+            keys[i + l] = (uint16_t)(descending ? 65535 - value : value);
+        }
+    };
+    uint32_t i = 0;
+    for (; i + SIMD_LANES <= count; i += SIMD_LANES) {
+        SimdFloat vr, vg, vb;
+        SimdUnpackBytes(&pixels[i], vr, vg, vb);
+        computeLanes(vr, vg, vb, i, SIMD_LANES);
+    }
+    // The tail is padded with black, whose keys are discarded
+    if (i < count) {
+        float r[SIMD_LANES], g[SIMD_LANES], b[SIMD_LANES];
+        for (uint32_t l = 0; l < (uint32_t)SIMD_LANES; l++) {
+            uint32_t pixel = i + l < count ? pixels[i + l] : 0;
+            r[l] = (float)(pixel & 0xFF);
+            g[l] = (float)((pixel >> 8) & 0xFF);
+            b[l] = (float)((pixel >> 16) & 0xFF);
+        }
+        computeLanes(SimdLoad(r), SimdLoad(g), SimdLoad(b), i, count - i);
+    }
+}
+
+// Stable LSD radix sort of the positions 0..count-1 by their 16 bit keys, one byte
+// per pass, skipping passes where every key has the same digit. Stability gives
+// the same (key, position) order as the GPU sort.
+void radixSortLine(const uint16_t* keys, uint32_t count, uint16_t* order, uint16_t* scratch) {
+    uint32_t histograms[2][256] = {};
+    for (uint32_t i = 0; i < count; i++) {
+        histograms[0][keys[i] & 0xFF]++;
+        histograms[1][keys[i] >> 8]++;
+        order[i] = (uint16_t)i;
+    }
+    uint16_t* in = order;
+    uint16_t* out = scratch;
+    for (uint32_t pass = 0; pass < 2 && count > 0; pass++) {
+        uint32_t shift = pass * 8;
+        uint32_t* histogram = histograms[pass];
+        if (histogram[(keys[0] >> shift) & 0xFF] == count)
+            continue;
+        uint32_t offsets[256];
+        uint32_t sum = 0;
+        for (uint32_t d = 0; d < 256; d++) {
+            offsets[d] = sum;
+            sum += histogram[d];
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            uint16_t position = in[i];
+            out[offsets[(keys[position] >> shift) & 0xFF]++] = position;
+        }
+        std::swap(in, out);
+    }
+    if (in != order)
+        memcpy(order, in, count * sizeof(uint16_t));
+}
+
+// Insertion sort for spans too short to be worth the radix sort's histograms, the
+// same order as radixSortLine
+void insertionSortSpan(const uint16_t* keys, uint32_t count, uint16_t* order) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t j = i;
+        for (; j > 0 && keys[order[j - 1]] > keys[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = (uint16_t)i;
+    }
+}
+
+// Sorts images on the CPU with exactly the same result as the compute shader, as a
+// fallback without a usable GPU and to check the GPU path against. Lines are
+// independent, so they're spread over a work stealing thread pool in chunks of
+// CPU_SORT_GRAIN lines, each worker with its own scratch space. Spans are found with
+// a plain scan of each line rather than the shader's prefix scan.
+struct CpuSorter {
+    static constexpr size_t CPU_SORT_GRAIN = 8;
+    struct Scratch {
+        vector<uint32_t> line;
+        vector<uint16_t> keys;
+        vector<uint16_t> order;
+        vector<uint16_t> temp;
+    };
+    Talos::ThreadPool pool;
+    vector<Scratch> scratch;
+    void create(uint32_t threadCount) {
+        pool.create(threadCount);
+        scratch.resize(pool.getThreadCount());
+    }
+    void sort(const uint32_t* src, uint32_t* dst, uint32_t width, uint32_t height, const SortSettings& settings) {
+        uint32_t lineLength = settings.vertical ? height : width;
+        uint32_t lineCount = settings.vertical ? width : height;
+        if (lineLength > 65535)
+            throw runtime_error("Image is too large to sort!");
+        for (Scratch& s : scratch) {
+            s.line.resize(lineLength);
+            s.keys.resize(lineLength);
+            s.order.resize(lineLength);
+            s.temp.resize(lineLength);
+        }
+        pool.parallelFor(lineCount, CPU_SORT_GRAIN, [&](size_t begin, size_t end, uint32_t worker) {
+            Scratch& s = scratch[worker];
+            for (size_t line = begin; line < end; line++) {
+                // Rows are sorted in place, columns are gathered into scratch first
+                const uint32_t* pixels = src + line * width;
+                if (settings.vertical) {
+                    for (uint32_t y = 0; y < lineLength; y++)
+                        s.line[y] = src[(size_t)y * width + line];
+                    pixels = s.line.data();
+                }
+                computeSortKeys(pixels, lineLength, settings.key, settings.descending, s.keys.data());
+                sortSpans(s, lineLength, settings);
+                if (settings.vertical) {
+                    for (uint32_t y = 0; y < lineLength; y++)
+                        dst[(size_t)y * width + line] = pixels[s.order[y]];
+                } else {
+                    for (uint32_t x = 0; x < lineLength; x++)
+                        dst[line * width + x] = pixels[s.order[x]];
+                }
+            }
+        });
+    }
+    // Leaves s.order holding the position each pixel of the line is taken from. The
+    // thresholds apply to the keys before descending order flips them.
+    static void sortSpans(Scratch& s, uint32_t lineLength, const SortSettings& settings) {
+        uint32_t lower = settings.descending ? 65535 - settings.upperThreshold : settings.lowerThreshold;
+        uint32_t upper = settings.descending ? 65535 - settings.lowerThreshold : settings.upperThreshold;
+        const uint16_t* keys = s.keys.data();
+        uint16_t* order = s.order.data();
+        for (uint32_t x = 0; x < lineLength; x++)
+            order[x] = (uint16_t)x;
+        uint32_t start = 0;
+        for (uint32_t x = 0; x <= lineLength; x++) {
+            if (x < lineLength && keys[x] >= lower && keys[x] <= upper)
+                continue;
+            uint32_t count = x - start;
+            if (count >= 2) {
+                if (count <= SORT_TINY_SPAN)
+                    insertionSortSpan(keys + start, count, order + start);
+                else
+                    radixSortLine(keys + start, count, order + start, s.temp.data());
+                for (uint32_t i = start; i < x; i++)
+                    order[i] = (uint16_t)(order[i] + start);
+            }
+            start = x + 1;
+        }
+    }
+    void destroy() {
+        pool.destroy();
+        scratch.clear();
+    }
 };
 
 struct QueueFamilyIndices {
     optional<uint32_t> graphicsFamily = nullopt;
     optional<uint32_t> computeFamily = nullopt;
     optional<uint32_t> presentFamily = nullopt;
+    bool headless = false;
     QueueFamilyIndices(VkPhysicalDevice dev, VkSurfaceKHR surface) {
+        headless = surface == VK_NULL_HANDLE;
         uint32_t queueFamilyCount = 0;
         vkGetPhysicalDeviceQueueFamilyProperties(dev, &queueFamilyCount, nullptr);
         if (queueFamilyCount == 0)
             return;
         vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
         vkGetPhysicalDeviceQueueFamilyProperties(dev, &queueFamilyCount, queueFamilies.data());
+        // Keep the first match, preferring a graphics family that can also present
+        // and a compute family without graphics so compute can run alongside it
+        optional<uint32_t> dedicatedComputeFamily = nullopt;
         for (uint32_t i = 0; i < queueFamilyCount; i++) {
-            if (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
-                graphicsFamily = make_optional(i);
-            if (queueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT)
-                computeFamily = make_optional(i);
+            VkQueueFlags flags = queueFamilies[i].queueFlags;
             VkBool32 present = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(dev, i, surface, &present);
-            if (present)
+            if (!headless)
+                vkGetPhysicalDeviceSurfaceSupportKHR(dev, i, surface, &present);
+            if ((flags & VK_QUEUE_GRAPHICS_BIT) && (!graphicsFamily.has_value() || (present && graphicsFamily != presentFamily))) {
+                graphicsFamily = make_optional(i);
+                if (present)
+                    presentFamily = make_optional(i);
+            }
+            if (present && !presentFamily.has_value())
                 presentFamily = make_optional(i);
+            if ((flags & VK_QUEUE_COMPUTE_BIT) && !computeFamily.has_value())
+                computeFamily = make_optional(i);
+            if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT) && !dedicatedComputeFamily.has_value())
+                dedicatedComputeFamily = make_optional(i);
         }
+        if (dedicatedComputeFamily.has_value())
+            computeFamily = dedicatedComputeFamily;
     }
-    bool complete() { return graphicsFamily.has_value() && computeFamily.has_value() && presentFamily.has_value(); }
+    bool complete() { return graphicsFamily.has_value() && computeFamily.has_value() && (headless || presentFamily.has_value()); }
 };
 
 struct SwapchainSupportDetails {
@@ -135,9 +590,29 @@ struct Swapchain {
     vector<VkFramebuffer> framebuffers;
 };
 
+// An image sorts are written to. Windowed runs keep DST_IMAGE_COUNT of them so
+// the next sort can run on the compute queue while the last result is displayed.
+// They belong to the compute queue family except while displayed: the frame that
+// starts showing one acquires it from the handoff command buffer's release, the
+// frame that stops showing it releases it back and signals releasedSemaphore for
+// the next sort into it to wait on.
+struct DestinationImage {
+    VkImage image = VK_NULL_HANDLE;
+    Talos::Allocation allocation;
+    VkImageView view = VK_NULL_HANDLE;
+    VkDescriptorSet computeDescriptorSet = VK_NULL_HANDLE;
+    VkDescriptorSet graphicsDescriptorSet = VK_NULL_HANDLE;
+    VkCommandBuffer handoffCommandBuffer = VK_NULL_HANDLE;
+    VkSemaphore releasedSemaphore = VK_NULL_HANDLE;
+    bool released = false;
+    // The sort the image holds, if valid
+    SortSettings settings;
+    bool valid = false;
+};
+
 struct Application {
     VkInstance instance;
-    VkSurfaceKHR surface;
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
     VkDevice device;
     VkQueue graphicsQueue;
@@ -147,22 +622,64 @@ struct Application {
     VkRenderPass renderPass;
     VkDescriptorSetLayout graphicsDescriptorSetLayout;
     VkDescriptorPool graphicsDescriptorPool;
-    vector<VkDescriptorSet> graphicsDescriptorSets;
+    VkPipelineLayout graphicsPipelineLayout;
     VkPipeline graphicsPipeline;
     VkDescriptorSetLayout computeDescriptorSetLayout;
     VkDescriptorPool computeDescriptorPool;
-    vector<VkDescriptorSet> computeDescriptorSets;
+    VkPipelineLayout computePipelineLayout;
     VkPipeline computePipeline;
     VkCommandPool commandPool;
-    VkImage srcImage = VK_NULL_HANDLE;
-    VkDeviceMemory srcImageMemory;
-    VkImageView srcImageView;
-    VkImage dstImage;
-    VkDeviceMemory dstImageMemory;
-    VkImageView dstImageView;
+    vector<VkCommandBuffer> commandBuffers;
+    vector<VkSemaphore> imageAvailableSemaphores;
+    vector<VkSemaphore> renderFinishedSemaphores;
+    vector<VkFence> inFlightFences;
+    uint32_t currentFrame = 0;
+    VkCommandPool computeCommandPool;
+    VkCommandBuffer computeCommandBuffer;
+    VkFence computeFence;
+    VkSemaphore sortFinishedSemaphore;
+    uint32_t graphicsFamily;
+    uint32_t computeFamily;
+    bool imageLoaded = false;
+    vector<DestinationImage> dstImages;
+    // Image holding the latest sort and image being displayed, which differ
+    // until a frame shows the latest sort
+    uint32_t currentDst = 0;
+    uint32_t displayedDst = NO_DST_IMAGE;
+    VkExtent2D imageExtent{};
     VkSampler dstSampler;
+    VkBuffer pixelBuffer;
+    Talos::Allocation pixelBufferAllocation;
+    VkBuffer entryBuffer;
+    Talos::Allocation entryBufferAllocation;
+    VkBuffer spanBuffer;
+    Talos::Allocation spanBufferAllocation;
+    VkBuffer keyBuffer;
+    Talos::Allocation keyBufferAllocation;
+    VkBuffer outputBuffer;
+    Talos::Allocation outputBufferAllocation;
+    bool stripOutput = false;
+    VkPhysicalDeviceLimits deviceLimits{};
+    SortSettings sortSettings;
+    bool sortDirty = true;
+    // What the key buffer and span lists currently hold, from the last sort into
+    // any of the destination images
+    SortSettings sortedSettings;
+    bool sortValid = false;
+    bool spanListsComplete = false;
     VkBuffer vertexBuffer;
-    VkDeviceMemory vertexBufferMemory;
+    Talos::Allocation vertexBufferAllocation;
+    Talos::Allocator allocator;
+    Talos::PipelineCache pipelineCache;
+    Talos::StagingRing stagingRing;
+    Talos::ReadbackRing readbackRing;
+    bool coldPipelineCache = false;
+    Talos::GpuProfiler gpuProfiler;
+    bool gpuProfiling = false;
+    bool pipelineStatistics = false;
+    string gpuTraceFilename;
+    string cpuTraceFilename;
+    bool headless = false;
     void createInstance() {
         VkApplicationInfo appInfo{};
         appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
@@ -172,8 +689,9 @@ struct Application {
         appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
         appInfo.apiVersion = VK_API_VERSION_1_0;
         uint32_t glfwExtensionCount = 0;
-        const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        const char** glfwExtensions = headless ? nullptr : glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
         VkInstanceCreateInfo createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
         createInfo.pApplicationInfo = &appInfo;
         createInfo.enabledExtensionCount = glfwExtensionCount;
         createInfo.ppEnabledExtensionNames = glfwExtensions;
@@ -185,6 +703,10 @@ struct Application {
         if (glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS)
             throw runtime_error("Failed to create surface!");
     }
+    // Headless runs have no swapchain, so don't need the swapchain extension
+    vector<const char*> requiredDeviceExtensions() {
+        return headless ? vector<const char*>{} : deviceExtensions;
+    }
     bool deviceSuitable(VkPhysicalDevice _device) {
         QueueFamilyIndices queueFamilyIndices(_device, surface);
         uint32_t availableExtensionCount;
@@ -192,7 +714,7 @@ struct Application {
         vector<VkExtensionProperties> availableExtensions(availableExtensionCount);
         vkEnumerateDeviceExtensionProperties(_device, nullptr, &availableExtensionCount, availableExtensions.data());
         bool extensionsMatched = true;
-        for (const char* devExtName : deviceExtensions) {
+        for (const char* devExtName : requiredDeviceExtensions()) {
             bool matched = false;
             for (const VkExtensionProperties& avlExt : availableExtensions) {
                 if (strcmp(devExtName, avlExt.extensionName) == 0)
@@ -201,60 +723,64 @@ struct Application {
             if (!matched)
                 extensionsMatched = false;
         }
-        bool adequateSwapchain = false;
-        SwapchainSupportDetails swapchainSupport(_device, surface);
-        adequateSwapchain = !swapchainSupport.formats.empty() && !swapchainSupport.presentModes.empty();
+        bool adequateSwapchain = headless;
+        if (!headless) {
+            SwapchainSupportDetails swapchainSupport(_device, surface);
+            adequateSwapchain = !swapchainSupport.formats.empty() && !swapchainSupport.presentModes.empty();
+        }
         return queueFamilyIndices.complete() && extensionsMatched && adequateSwapchain;
     }
+    // Devices are tried best scored first, TALOS_DEVICE overrides the ranking
     void selectPhysicalDevice() {
-        uint32_t dev_ct = 0;
-        vkEnumeratePhysicalDevices(instance, &dev_ct, nullptr);
-        if (dev_ct == 0)
-            throw runtime_error("No devices with Vulkan support!");
-        vector<VkPhysicalDevice> devs(dev_ct);
-        vkEnumeratePhysicalDevices(instance, &dev_ct, devs.data());
-        for (const VkPhysicalDevice _device : devs)
+        for (const VkPhysicalDevice _device : Talos::rankPhysicalDevices(instance))
             if (deviceSuitable(_device))
                 { physicalDevice = _device; break; }
         if (physicalDevice == VK_NULL_HANDLE)
             throw runtime_error("Failed to find suitable device!");
         VkPhysicalDeviceProperties dev_props;
         vkGetPhysicalDeviceProperties(physicalDevice, &dev_props);
-        printf("Selected device '%s'.\n", dev_props.deviceName);
+        deviceLimits = dev_props.limits;
+        QueueFamilyIndices indices(physicalDevice, surface);
+        printf("Selected device '%s' (%s), %s compute queue.\n", dev_props.deviceName, Talos::deviceTypeName(dev_props.deviceType),
+            indices.computeFamily != indices.graphicsFamily ? "dedicated" : "shared");
     }
     void createDeviceInterface() {
         QueueFamilyIndices queueFamilyIndices(physicalDevice, surface);
         float queuePriority = 1.0f;
-        VkDeviceQueueCreateInfo gfxQueueCreateInfo{};
-        gfxQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        gfxQueueCreateInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-        gfxQueueCreateInfo.queueCount = 1;
-        gfxQueueCreateInfo.pQueuePriorities = &queuePriority;
-        VkDeviceQueueCreateInfo cmpQueueCreateInfo{};
-        cmpQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        cmpQueueCreateInfo.queueFamilyIndex = queueFamilyIndices.computeFamily.value();
-        cmpQueueCreateInfo.queueCount = 1;
-        cmpQueueCreateInfo.pQueuePriorities = &queuePriority;
-        VkDeviceQueueCreateInfo prsQueueCreateInfo{};
-        prsQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        prsQueueCreateInfo.queueFamilyIndex = queueFamilyIndices.presentFamily.value();
-        prsQueueCreateInfo.queueCount = 1;
-        prsQueueCreateInfo.pQueuePriorities = &queuePriority;
+        // One queue create info per distinct family, the families usually overlap
+        std::set<uint32_t> uniqueFamilies{ queueFamilyIndices.graphicsFamily.value(), queueFamilyIndices.computeFamily.value() };
+        if (queueFamilyIndices.presentFamily.has_value())
+            uniqueFamilies.insert(queueFamilyIndices.presentFamily.value());
+        vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+        for (uint32_t family : uniqueFamilies) {
+            VkDeviceQueueCreateInfo queueCreateInfo{};
+            queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+            queueCreateInfo.queueFamilyIndex = family;
+            queueCreateInfo.queueCount = 1;
+            queueCreateInfo.pQueuePriorities = &queuePriority;
+            queueCreateInfos.push_back(queueCreateInfo);
+        }
+        VkPhysicalDeviceFeatures supportedFeatures;
+        vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
         VkPhysicalDeviceFeatures deviceFeatures{};
-        vector<VkDeviceQueueCreateInfo> queueCreateInfos{ gfxQueueCreateInfo, cmpQueueCreateInfo, prsQueueCreateInfo };
+        deviceFeatures.pipelineStatisticsQuery = pipelineStatistics ? supportedFeatures.pipelineStatisticsQuery : VK_FALSE;
+        vector<const char*> enabledExtensions = requiredDeviceExtensions();
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.queueCreateInfoCount = (uint32_t)queueCreateInfos.size();
         createInfo.pEnabledFeatures = &deviceFeatures;
-        createInfo.enabledExtensionCount = (uint32_t)deviceExtensions.size();
-        createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+        createInfo.enabledExtensionCount = (uint32_t)enabledExtensions.size();
+        createInfo.ppEnabledExtensionNames = enabledExtensions.data();
         createInfo.enabledLayerCount = 0;
         if (vkCreateDevice(physicalDevice, &createInfo, nullptr, &device) != VK_SUCCESS)
             throw runtime_error("Failed to create device interface!");
-        vkGetDeviceQueue(device, queueFamilyIndices.graphicsFamily.value(), 0, &graphicsQueue);
-        vkGetDeviceQueue(device, queueFamilyIndices.computeFamily.value(), 0, &computeQueue);
-        vkGetDeviceQueue(device, queueFamilyIndices.presentFamily.value(), 0, &presentQueue);
+        graphicsFamily = queueFamilyIndices.graphicsFamily.value();
+        computeFamily = queueFamilyIndices.computeFamily.value();
+        vkGetDeviceQueue(device, graphicsFamily, 0, &graphicsQueue);
+        vkGetDeviceQueue(device, computeFamily, 0, &computeQueue);
+        if (!headless)
+            vkGetDeviceQueue(device, queueFamilyIndices.presentFamily.value(), 0, &presentQueue);
     }
     VkImageView createImageView(VkImage image, VkFormat format) {
         VkImageViewCreateInfo viewInfo{};
@@ -288,10 +814,10 @@ struct Application {
             int width, height;
             glfwGetWindowSize(window, &width, &height);
             extent.width = clamp((uint32_t)width, swapchainSupport.capabilities.minImageExtent.width, swapchainSupport.capabilities.maxImageExtent.width);
-            extent.width = clamp((uint32_t)height, swapchainSupport.capabilities.minImageExtent.height, swapchainSupport.capabilities.maxImageExtent.height);
+            extent.height = clamp((uint32_t)height, swapchainSupport.capabilities.minImageExtent.height, swapchainSupport.capabilities.maxImageExtent.height);
         }
         uint32_t imageCount = swapchainSupport.capabilities.minImageCount + 1;
-        if (swapchainSupport.capabilities.maxImageCount > 0 && imageCount < swapchainSupport.capabilities.maxImageCount)
+        if (swapchainSupport.capabilities.maxImageCount > 0 && imageCount > swapchainSupport.capabilities.maxImageCount)
             imageCount = swapchainSupport.capabilities.maxImageCount;
         VkSwapchainCreateInfoKHR createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -307,13 +833,13 @@ struct Application {
         createInfo.presentMode = presentMode;
         createInfo.clipped = VK_TRUE;
         createInfo.oldSwapchain = VK_NULL_HANDLE;
+        // Only the graphics and present queues touch swapchain images, the compute
+        // pass writes its own images
         QueueFamilyIndices indices(physicalDevice, surface);
-        if (indices.graphicsFamily != indices.computeFamily || 
-            indices.computeFamily != indices.presentFamily || 
-            indices.graphicsFamily != indices.presentFamily) {
+        if (indices.graphicsFamily != indices.presentFamily) {
             printf("Setting swapchain to concurrent mode:\n");
-            printf("\tgfx: %d\n\tcmp: %d\n\tprs: %d\n", indices.graphicsFamily.value(), indices.computeFamily.value(), indices.presentFamily.value());
-            vector<uint32_t> queueFamilyIndices { indices.graphicsFamily.value(), indices.computeFamily.value(), indices.presentFamily.value() };
+            printf("\tgfx: %d\n\tprs: %d\n", indices.graphicsFamily.value(), indices.presentFamily.value());
+            vector<uint32_t> queueFamilyIndices { indices.graphicsFamily.value(), indices.presentFamily.value() };
             createInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
             createInfo.queueFamilyIndexCount = (uint32_t)queueFamilyIndices.size();
             createInfo.pQueueFamilyIndices = queueFamilyIndices.data();
@@ -381,7 +907,79 @@ struct Application {
             throw runtime_error("Failed to create shader module!");
         return shaderModule;
     }
-    void createGraphicsPipeline() {
+    void createDescriptorSetLayouts() {
+        // Compute reads the source pixels, sorts long spans through the entry buffer
+        // and writes the destination image (or the output buffer for strips), the
+        // span and key buffers hold the spans found and the keys they were found with
+        vector<VkDescriptorSetLayoutBinding> computeBindings(6);
+        computeBindings[0].binding = 0;
+        computeBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        computeBindings[0].descriptorCount = 1;
+        computeBindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        computeBindings[1].binding = 1;
+        computeBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        computeBindings[1].descriptorCount = 1;
+        computeBindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        computeBindings[2].binding = 2;
+        computeBindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        computeBindings[2].descriptorCount = 1;
+        computeBindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        computeBindings[3].binding = 3;
+        computeBindings[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        computeBindings[3].descriptorCount = 1;
+        computeBindings[3].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        computeBindings[4].binding = 4;
+        computeBindings[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        computeBindings[4].descriptorCount = 1;
+        computeBindings[4].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        computeBindings[5].binding = 5;
+        computeBindings[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        computeBindings[5].descriptorCount = 1;
+        computeBindings[5].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        VkDescriptorSetLayoutCreateInfo computeLayoutInfo{};
+        computeLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        computeLayoutInfo.bindingCount = (uint32_t)computeBindings.size();
+        computeLayoutInfo.pBindings = computeBindings.data();
+        if (vkCreateDescriptorSetLayout(device, &computeLayoutInfo, nullptr, &computeDescriptorSetLayout) != VK_SUCCESS)
+            throw runtime_error("Failed to create compute descriptor set layout!");
+        if (headless)
+            return;
+        vector<VkDescriptorSetLayoutBinding> bindings(1);
+        bindings[0].binding = 0;
+        bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        bindings[0].descriptorCount = 1;
+        bindings[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+        VkDescriptorSetLayoutCreateInfo descriptorLayoutInfo{};
+        descriptorLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        descriptorLayoutInfo.bindingCount = (uint32_t)bindings.size();
+        descriptorLayoutInfo.pBindings = bindings.data();
+        if (vkCreateDescriptorSetLayout(device, &descriptorLayoutInfo, nullptr, &graphicsDescriptorSetLayout) != VK_SUCCESS)
+            throw runtime_error("Failed to create graphics descriptor set layout!");
+    }
+    // Layouts outlive the pipelines, which get recreated by benchmarkPipelineCache
+    void createPipelineLayouts() {
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(SortParams);
+        VkPipelineLayoutCreateInfo computeLayoutInfo{};
+        computeLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        computeLayoutInfo.setLayoutCount = 1;
+        computeLayoutInfo.pSetLayouts = &computeDescriptorSetLayout;
+        computeLayoutInfo.pushConstantRangeCount = 1;
+        computeLayoutInfo.pPushConstantRanges = &pushConstantRange;
+        if (vkCreatePipelineLayout(device, &computeLayoutInfo, nullptr, &computePipelineLayout) != VK_SUCCESS)
+            throw runtime_error("Failed to create compute pipeline layout!");
+        if (headless)
+            return;
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &graphicsDescriptorSetLayout;
+        if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &graphicsPipelineLayout) != VK_SUCCESS)
+            throw runtime_error("Failed to create graphics pipeline layout!");
+    }
+    void createGraphicsPipeline(VkPipelineCache cache) {
         vector<char> vertShaderCode = readBinaryFile("shaders/spv/pixelsort-vert.spv");
         vector<char> fragShaderCode = readBinaryFile("shaders/spv/pixelsort-frag.spv");
         VkShaderModule vertShaderModule = createShaderModule(vertShaderCode);
@@ -431,7 +1029,7 @@ struct Application {
         rasterizer.rasterizerDiscardEnable = VK_FALSE;
         rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
         rasterizer.lineWidth = 1.0f;
-        rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+        rasterizer.cullMode = VK_CULL_MODE_NONE;
         rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
         rasterizer.depthBiasEnable = VK_FALSE;
         VkPipelineMultisampleStateCreateInfo multisampler{};
@@ -446,24 +1044,6 @@ struct Application {
         colorBlending.logicOpEnable = VK_FALSE;
         colorBlending.attachmentCount = 1;
         colorBlending.pAttachments = &colorBlendAttachment;
-        vector<VkDescriptorSetLayoutBinding> bindings(1);
-        bindings[0].binding = 0;
-        bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        bindings[0].descriptorCount = 1;
-        bindings[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-        VkDescriptorSetLayoutCreateInfo descriptorLayoutInfo{};
-        descriptorLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-        descriptorLayoutInfo.bindingCount = (uint32_t)bindings.size();
-        descriptorLayoutInfo.pBindings = bindings.data();
-        if (vkCreateDescriptorSetLayout(device, &descriptorLayoutInfo, nullptr, &graphicsDescriptorSetLayout) != VK_SUCCESS)
-            throw runtime_error("Failed to create graphics descriptor set layout!");
-        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-        pipelineLayoutInfo.setLayoutCount = 0; // descriptor set layout count
-        pipelineLayoutInfo.pSetLayouts = nullptr; // descriptor set layout reference
-        VkPipelineLayout pipelineLayout;
-        if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
-            throw runtime_error("Failed to create graphics pipeline layout!");
         VkGraphicsPipelineCreateInfo pipelineInfo{};
         pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
         pipelineInfo.stageCount = 2;
@@ -476,36 +1056,27 @@ struct Application {
         pipelineInfo.pDepthStencilState = nullptr;
         pipelineInfo.pColorBlendState = &colorBlending;
         pipelineInfo.pDynamicState = nullptr;
-        pipelineInfo.layout = pipelineLayout;
+        pipelineInfo.layout = graphicsPipelineLayout;
         pipelineInfo.renderPass = renderPass;
         pipelineInfo.subpass = 0;
         pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
         pipelineInfo.basePipelineIndex = -1;
-        if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS)
+        if (vkCreateGraphicsPipelines(device, cache, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS)
             throw runtime_error("Failed to create graphics pipeline!");
-        vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
         vkDestroyShaderModule(device, vertShaderModule, nullptr);
         vkDestroyShaderModule(device, fragShaderModule, nullptr);
     }
-    void createComputePipeline() {
+    void createComputePipeline(VkPipelineCache cache) {
         vector<char> compShaderCode = readBinaryFile("shaders/spv/pixelsort-comp.spv");
         VkShaderModule compShaderModule = createShaderModule(compShaderCode);
-        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-        pipelineLayoutInfo.setLayoutCount = 0; // descriptor set layout count
-        pipelineLayoutInfo.pSetLayouts = nullptr; // descriptor set layout reference
-        VkPipelineLayout pipelineLayout;
-        if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
-            throw runtime_error("Failed to create compute pipeline layout!");
         VkComputePipelineCreateInfo pipelineInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
         pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
         pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
         pipelineInfo.stage.module = compShaderModule;
         pipelineInfo.stage.pName = "main";
-        pipelineInfo.layout = pipelineLayout;
-        if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &computePipeline) != VK_SUCCESS)
+        pipelineInfo.layout = computePipelineLayout;
+        if (vkCreateComputePipelines(device, cache, 1, &pipelineInfo, nullptr, &computePipeline) != VK_SUCCESS)
             throw runtime_error("Failed to create compute pipeline!");
-        vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
         vkDestroyShaderModule(device, compShaderModule, nullptr);
     }
     void createFramebuffers() {
@@ -524,140 +1095,83 @@ struct Application {
         }
     }
     void createCommandPool() {
-        QueueFamilyIndices queueFamilyIndices(physicalDevice, surface);
         VkCommandPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
         poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-        poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+        poolInfo.queueFamilyIndex = graphicsFamily;
         if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
             throw runtime_error("Failed to create command pool!");
+        poolInfo.queueFamilyIndex = computeFamily;
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &computeCommandPool) != VK_SUCCESS)
+            throw runtime_error("Failed to create compute command pool!");
     }
-    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-        VkPhysicalDeviceMemoryProperties memProperties;
-        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-        for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++)
-            if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties)
-                return i;
-        throw std::runtime_error("Failed to find suitable memory type!");
-    }
-    void beginOneTimeCommands(VkCommandBuffer& commandBuffer) {
-        // Allocate new command buffer
+    void createCommandBuffers() {
         VkCommandBufferAllocateInfo allocInfo{};
         allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = computeCommandPool;
         allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandPool = commandPool;
         allocInfo.commandBufferCount = 1;
-        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
-        // Begin recording to command buffer
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+        if (vkAllocateCommandBuffers(device, &allocInfo, &computeCommandBuffer) != VK_SUCCESS)
+            throw runtime_error("Failed to allocate compute command buffer!");
+        if (headless)
+            return;
+        // Handoffs are recorded by uploadImage, once the images exist
+        for (DestinationImage& dst : dstImages)
+            if (vkAllocateCommandBuffers(device, &allocInfo, &dst.handoffCommandBuffer) != VK_SUCCESS)
+                throw runtime_error("Failed to allocate handoff command buffer!");
+        allocInfo.commandPool = commandPool;
+        commandBuffers.resize(MAX_CPU_PROCESSED_FRAMES);
+        allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+        if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS)
+            throw runtime_error("Failed to allocate command buffers!");
     }
-    void endOneTimeCommands(VkCommandBuffer& commandBuffer) {
-        // End recording to command buffer
-        vkEndCommandBuffer(commandBuffer);
-        // Submit command buffer, wait until device idle
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer;
-        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(graphicsQueue);
-        // Free command buffer
-        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
-    }
-    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
-        VkResult res;
-        // Create buffer
-        VkBufferCreateInfo bufferInfo{};
-        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-        bufferInfo.size = size;
-        bufferInfo.usage = usage;
-        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-        res = vkCreateBuffer(device, &bufferInfo, nullptr, &buffer);
-        if (res != VK_SUCCESS)
-            throw std::runtime_error("Failed to create buffer!");
-        // Get memory requirements of buffer
-        VkMemoryRequirements memRequirements;
-        vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
-        // Allocate buffer memory
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-        res = vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory);
-        if (res != VK_SUCCESS)
-            throw std::runtime_error("Failed to allocate buffer memory!");
-        // Bind memory to buffer
-        vkBindBufferMemory(device, buffer, bufferMemory, 0);
-    }
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-        // Allocate and start recording to one time use command buffer
-        VkCommandBuffer commandBuffer;
-        beginOneTimeCommands(commandBuffer);
-        // Copy source buffer to destination buffer
-        VkBufferCopy copyRegion{};
-        copyRegion.size = size;
-        vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-        // End recording and free command buffer
-        endOneTimeCommands(commandBuffer);
-    }
-    void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-        // Allocate and start recording to one time use command buffer
-        VkCommandBuffer commandBuffer;
-        beginOneTimeCommands(commandBuffer);
-        // Set up buffer to image copy
-        VkBufferImageCopy region{};
-        region.bufferOffset = 0;
-        region.bufferRowLength = 0;
-        region.bufferImageHeight = 0;
-        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        region.imageSubresource.mipLevel = 0;
-        region.imageSubresource.baseArrayLayer = 0;
-        region.imageSubresource.layerCount = 1;
-        region.imageOffset = { 0, 0, 0 };
-        region.imageExtent = { width, height, 1 };
-        // Copy buffer to image
-        vkCmdCopyBufferToImage(commandBuffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-        // End recording and free command buffer
-        endOneTimeCommands(commandBuffer);
-    }
-    void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout) {
-        // Allocate and start recording to one time use command buffer
-        VkCommandBuffer commandBuffer;
-        beginOneTimeCommands(commandBuffer);
-        VkImageMemoryBarrier barrier{};
-        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        barrier.oldLayout = oldLayout;
-        barrier.newLayout = newLayout;
-        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrier.image = image;
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        barrier.subresourceRange.baseMipLevel = 0;
-        barrier.subresourceRange.levelCount = 1;
-        barrier.subresourceRange.baseArrayLayer = 0;
-        barrier.subresourceRange.layerCount = 1;
-        VkPipelineStageFlags sourceStage;
-        VkPipelineStageFlags destinationStage;
-        if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-            barrier.srcAccessMask = 0;
-            barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-            destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-            sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-            destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-        } else throw std::invalid_argument("Unsupported image layout transition!");
-        vkCmdPipelineBarrier(commandBuffer, sourceStage, destinationStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-        // End recording and free command buffer
-        endOneTimeCommands(commandBuffer);
-    }
-    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
-        VkResult res;
+    void createSyncObjects() {
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        if (vkCreateFence(device, &fenceInfo, nullptr, &computeFence) != VK_SUCCESS)
+            throw runtime_error("Failed to create compute fence!");
+        if (headless)
+            return;
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &sortFinishedSemaphore) != VK_SUCCESS)
+            throw runtime_error("Failed to create sort semaphore!");
+        for (DestinationImage& dst : dstImages)
+            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &dst.releasedSemaphore) != VK_SUCCESS)
+                throw runtime_error("Failed to create release semaphore!");
+        imageAvailableSemaphores.resize(MAX_CPU_PROCESSED_FRAMES);
+        renderFinishedSemaphores.resize(MAX_CPU_PROCESSED_FRAMES);
+        inFlightFences.resize(MAX_CPU_PROCESSED_FRAMES);
+        for (size_t i = 0; i < MAX_CPU_PROCESSED_FRAMES; i++) {
+            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS
+                || vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS
+                || vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS)
+                throw runtime_error("Failed to create sync objects!");
+        }
+    }
+    void createSampler() {
+        VkSamplerCreateInfo samplerInfo{};
+        samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        samplerInfo.magFilter = VK_FILTER_LINEAR;
+        samplerInfo.minFilter = VK_FILTER_LINEAR;
+        samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.anisotropyEnable = VK_FALSE;
+        samplerInfo.maxAnisotropy = 1.0f;
+        samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+        samplerInfo.unnormalizedCoordinates = VK_FALSE;
+        samplerInfo.compareEnable = VK_FALSE;
+        samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+        if (vkCreateSampler(device, &samplerInfo, nullptr, &dstSampler) != VK_SUCCESS)
+            throw runtime_error("Failed to create sampler!");
+    }
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, Talos::Allocation& bufferAllocation) {
+        // Create buffer and bind it to memory sub-allocated from the allocator
+        allocator.createBuffer(size, usage, properties, buffer, bufferAllocation);
+    }
+    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, Talos::Allocation& imageAllocation) {
         VkImageCreateInfo imageInfo{};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
         imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -672,159 +1186,833 @@ struct Application {
         imageInfo.usage = usage;
         imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
         imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-        res = vkCreateImage(device, &imageInfo, nullptr, &image);
-        if (res != VK_SUCCESS)
-            throw std::runtime_error("failed to create image!");
-        VkMemoryRequirements memRequirements;
-        vkGetImageMemoryRequirements(device, image, &memRequirements);
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-        res = vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory);
-        if (res != VK_SUCCESS)
-            throw std::runtime_error("failed to allocate image memory!");
-        vkBindImageMemory(device, image, imageMemory, 0);
-    }
-    void loadImage(string filename) {
-        int srcWidth, srcHeight, srcChannels;
-        stbi_uc* pixels = stbi_load(filename.c_str(), &srcWidth, &srcHeight, &srcChannels, STBI_rgb_alpha);
-        VkDeviceSize imageSize = srcWidth * srcHeight * 4;
-        if (!pixels)
-            throw runtime_error("Failed to load texture '" + filename + "'!");
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, imageSize, 0, &data);
-        memcpy(data, pixels, (size_t)imageSize);
-        vkUnmapMemory(device, stagingBufferMemory);
-        stbi_image_free(pixels);
-        createImage(srcWidth, srcHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, srcImage, srcImageMemory);
-        transitionImageLayout(srcImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-        copyBufferToImage(stagingBuffer, srcImage, (uint32_t)srcWidth, (uint32_t)srcHeight);
-        transitionImageLayout(srcImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
-        srcImageView = createImageView(srcImage, VK_FORMAT_R8G8B8A8_SRGB);
-        createImage(srcWidth, srcHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, dstImage, dstImageMemory);
-        dstImageView = createImageView(dstImage, VK_FORMAT_R8G8B8A8_SRGB);
+        // Create image and bind it to memory sub-allocated from the allocator
+        allocator.createImage(imageInfo, properties, image, imageAllocation);
+    }
+    // Whether an image of the given extent can be sorted in one pass within
+    // workingSet bytes and the device limits, rather than in strips
+    bool fitsInOnePass(VkExtent2D extent, VkDeviceSize workingSet) const {
+        return extent.width <= deviceLimits.maxImageDimension2D && extent.height <= deviceLimits.maxImageDimension2D &&
+            largestSortBuffer(extent) <= deviceLimits.maxStorageBufferRange && sortWorkingSetSize(extent) <= workingSet;
     }
+    // Uploads packed RGBA8 pixels to sort, reusing the images and buffers of the
+    // last image if it had the same extent. Strips are sorted into the output
+    // buffer, leaving the destination image as a placeholder for its descriptor.
+    // Uploads go through the staging ring on the compute queue, where the sort
+    // resources stay.
+    void uploadImage(const uint32_t* pixels, VkExtent2D extent, bool strip = false) {
+        TALOS_ZONE("upload image");
+        // Sort entries store pixel positions in 16 bits
+        if (extent.width > 65535 || extent.height > 65535)
+            throw runtime_error("Image is too large to sort!");
+        if (!strip && (extent.width > deviceLimits.maxImageDimension2D || extent.height > deviceLimits.maxImageDimension2D))
+            throw runtime_error("Image is too large for the device, sort it with --headless!");
+        VkDeviceSize imageSize = (VkDeviceSize)extent.width * extent.height * 4;
+        if (imageLoaded && (extent.width != imageExtent.width || extent.height != imageExtent.height || strip != stripOutput))
+            destroyImageResources();
+        // Stage the pixels once, every copy is filled from the same staging space
+        Talos::StagingAllocation staging = stagingRing.allocate(imageSize);
+        memcpy(staging.mapped, pixels, (size_t)imageSize);
+        if (imageLoaded) {
+            // The last sort may still be reading the pixel buffer. Staging batches go to
+            // the compute queue too, so a barrier orders the copy after it without
+            // waiting on computeFence.
+            vkCmdPipelineBarrier(stagingRing.commandBuffer(), VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+            // The output is reset from the pixel buffer by the next sort
+            stagingRing.copyToBuffer(staging, pixelBuffer);
+            stagingRing.submit();
+            invalidateSort();
+            return;
+        }
+        // Destinations start out as a copy of the source, so they always hold a valid
+        // image for display / readback. Storage images generally can't use sRGB
+        // formats, so they hold the same sRGB encoded bytes in a UNORM image.
+        VkExtent2D dstExtent = strip ? VkExtent2D{ 1, 1 } : extent;
+        for (DestinationImage& dst : dstImages) {
+            createImage(dstExtent.width, dstExtent.height, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, dst.image, dst.allocation);
+            stagingRing.copyToImage(staging, dst.image, dstExtent, VK_IMAGE_LAYOUT_GENERAL);
+        }
+        // Compute sorts from a packed copy of the source pixels, which also resets the
+        // output before each sort. Span lists and long span entries are sized for
+        // sorting either rows or columns.
+        createBuffer(imageSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, pixelBuffer, pixelBufferAllocation);
+        stagingRing.copyToBuffer(staging, pixelBuffer);
+        stagingRing.submit();
+        SortLayout rows(extent, false), columns(extent, true);
+        createBuffer(std::max(rows.entryBufferSize(), columns.entryBufferSize()), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, entryBuffer, entryBufferAllocation);
+        createBuffer(std::max(rows.spanBufferSize(), columns.spanBufferSize()), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, spanBuffer, spanBufferAllocation);
+        createBuffer(std::max(rows.keyBufferSize(), columns.keyBufferSize()), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, keyBuffer, keyBufferAllocation);
+        createBuffer(strip ? imageSize : sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, outputBuffer, outputBufferAllocation);
+        for (DestinationImage& dst : dstImages) {
+            dst.view = createImageView(dst.image, VK_FORMAT_R8G8B8A8_UNORM);
+            if (!headless)
+                recordHandoff(dst);
+        }
+        imageExtent = extent;
+        stripOutput = strip;
+        imageLoaded = true;
+        updateDescriptorSets();
+        invalidateSort();
+    }
+    // Waits for everything using the image's resources, pending readbacks included,
+    // and destroys them
+    void destroyImageResources() {
+        readbackRing.flush();
+        vkDeviceWaitIdle(device);
+        for (DestinationImage& dst : dstImages) {
+            vkDestroyImageView(device, dst.view, nullptr);
+            allocator.destroyImage(dst.image, dst.allocation);
+            dst.valid = false;
+        }
+        currentDst = 0;
+        displayedDst = NO_DST_IMAGE;
+        allocator.destroyBuffer(pixelBuffer, pixelBufferAllocation);
+        allocator.destroyBuffer(entryBuffer, entryBufferAllocation);
+        allocator.destroyBuffer(spanBuffer, spanBufferAllocation);
+        allocator.destroyBuffer(keyBuffer, keyBufferAllocation);
+        allocator.destroyBuffer(outputBuffer, outputBufferAllocation);
+        imageLoaded = false;
+    }
+    // The quad is a few static vertices read once per frame, so it's written in
+    // place instead of uploaded by the staging ring on the compute queue, which
+    // would need an ownership transfer to the graphics queue family
     void createVertexBuffer() {
         VkDeviceSize bufferSize = sizeof(Vertex) * vertices.size();
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, vertices.data(), (size_t)bufferSize);
-        vkUnmapMemory(device, stagingBufferMemory);
-        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
-        copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
-    }
-    void createDescriptorPool() {
+        createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vertexBuffer, vertexBufferAllocation);
+        memcpy(vertexBufferAllocation.mapped, vertices.data(), (size_t)bufferSize);
+    }
+    void createDescriptorPools() {
+        vector<VkDescriptorPoolSize> computePoolSizes(2);
+        computePoolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        computePoolSizes[0].descriptorCount = 5 * (uint32_t)dstImages.size();
+        computePoolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        computePoolSizes[1].descriptorCount = (uint32_t)dstImages.size();
+        VkDescriptorPoolCreateInfo computePoolInfo{};
+        computePoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        computePoolInfo.poolSizeCount = (uint32_t)computePoolSizes.size();
+        computePoolInfo.pPoolSizes = computePoolSizes.data();
+        computePoolInfo.maxSets = (uint32_t)dstImages.size();
+        if (vkCreateDescriptorPool(device, &computePoolInfo, nullptr, &computeDescriptorPool) != VK_SUCCESS)
+            throw runtime_error("Failed to create compute descriptor pool!");
+        if (headless)
+            return;
         vector<VkDescriptorPoolSize> poolSizes(1);
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        poolSizes[0].descriptorCount = (uint32_t)MAX_CPU_PROCESSED_FRAMES;
+        poolSizes[0].descriptorCount = (uint32_t)dstImages.size();
         VkDescriptorPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
         poolInfo.poolSizeCount = (uint32_t)poolSizes.size();
         poolInfo.pPoolSizes = poolSizes.data();
-        poolInfo.maxSets = (uint32_t)MAX_CPU_PROCESSED_FRAMES;
+        poolInfo.maxSets = (uint32_t)dstImages.size();
         if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &graphicsDescriptorPool) != VK_SUCCESS)
             throw runtime_error("Failed to create graphics descriptor pool!");
     }
+    // One compute and graphics set per destination image, written by
+    // updateDescriptorSets once an image has been loaded
     void allocateDescriptorSets() {
-        vector<VkDescriptorSetLayout> layouts(MAX_CPU_PROCESSED_FRAMES, graphicsDescriptorSetLayout);
-        VkDescriptorSetAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-        allocInfo.descriptorPool = graphicsDescriptorPool;
-        allocInfo.descriptorSetCount = (uint32_t)MAX_CPU_PROCESSED_FRAMES;
-        allocInfo.pSetLayouts = layouts.data();
-        graphicsDescriptorSets.resize(MAX_CPU_PROCESSED_FRAMES);
-        if (vkAllocateDescriptorSets(device, &allocInfo, graphicsDescriptorSets.data()) != VK_SUCCESS)
-            throw runtime_error("Failed to allocate graphics descriptor sets!");
-        for (size_t i = 0; i < MAX_CPU_PROCESSED_FRAMES; i++) {
+        for (DestinationImage& dst : dstImages) {
+            VkDescriptorSetAllocateInfo computeAllocInfo{};
+            computeAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            computeAllocInfo.descriptorPool = computeDescriptorPool;
+            computeAllocInfo.descriptorSetCount = 1;
+            computeAllocInfo.pSetLayouts = &computeDescriptorSetLayout;
+            if (vkAllocateDescriptorSets(device, &computeAllocInfo, &dst.computeDescriptorSet) != VK_SUCCESS)
+                throw runtime_error("Failed to allocate compute descriptor sets!");
+            if (headless)
+                continue;
+            VkDescriptorSetAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            allocInfo.descriptorPool = graphicsDescriptorPool;
+            allocInfo.descriptorSetCount = 1;
+            allocInfo.pSetLayouts = &graphicsDescriptorSetLayout;
+            if (vkAllocateDescriptorSets(device, &allocInfo, &dst.graphicsDescriptorSet) != VK_SUCCESS)
+                throw runtime_error("Failed to allocate graphics descriptor sets!");
+        }
+    }
+    void updateDescriptorSets() {
+        VkDescriptorBufferInfo pixelBufferInfo{ pixelBuffer, 0, VK_WHOLE_SIZE };
+        VkDescriptorBufferInfo entryBufferInfo{ entryBuffer, 0, VK_WHOLE_SIZE };
+        VkDescriptorBufferInfo spanBufferInfo{ spanBuffer, 0, VK_WHOLE_SIZE };
+        VkDescriptorBufferInfo keyBufferInfo{ keyBuffer, 0, VK_WHOLE_SIZE };
+        VkDescriptorBufferInfo outputBufferInfo{ outputBuffer, 0, VK_WHOLE_SIZE };
+        for (DestinationImage& dst : dstImages) {
+            VkDescriptorImageInfo storageImageInfo{};
+            storageImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+            storageImageInfo.imageView = dst.view;
+            vector<VkWriteDescriptorSet> computeWrites(6);
+            for (uint32_t b = 0; b < 6; b++) {
+                computeWrites[b].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                computeWrites[b].dstSet = dst.computeDescriptorSet;
+                computeWrites[b].dstBinding = b;
+                computeWrites[b].dstArrayElement = 0;
+                computeWrites[b].descriptorCount = 1;
+            }
+            computeWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            computeWrites[0].pBufferInfo = &pixelBufferInfo;
+            computeWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            computeWrites[1].pBufferInfo = &entryBufferInfo;
+            computeWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            computeWrites[2].pImageInfo = &storageImageInfo;
+            computeWrites[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            computeWrites[3].pBufferInfo = &spanBufferInfo;
+            computeWrites[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            computeWrites[4].pBufferInfo = &keyBufferInfo;
+            computeWrites[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            computeWrites[5].pBufferInfo = &outputBufferInfo;
+            vkUpdateDescriptorSets(device, (uint32_t)computeWrites.size(), computeWrites.data(), 0, nullptr);
+            if (headless)
+                continue;
             VkDescriptorImageInfo imageInfo{};
-            imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-            imageInfo.imageView = dstImageView;
+            imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageInfo.imageView = dst.view;
             imageInfo.sampler = dstSampler;
             vector<VkWriteDescriptorSet> descriptorWrites(1);
             descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptorWrites[0].dstSet = graphicsDescriptorSets[i];
+            descriptorWrites[0].dstSet = dst.graphicsDescriptorSet;
             descriptorWrites[0].dstBinding = 0;
             descriptorWrites[0].dstArrayElement = 0;
-            descriptorWrites[0].dstArrayElement = 0;
             descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
             descriptorWrites[0].descriptorCount = 1;
             descriptorWrites[0].pImageInfo = &imageInfo;
             vkUpdateDescriptorSets(device, (uint32_t)descriptorWrites.size(), descriptorWrites.data(), 0, nullptr);
         }
     }
+    // Headless runs skip the surface, swapchain and everything used for display,
+    // only creating what's needed to sort an image and read it back.
     void initialize() {
         createInstance();
-        createSurface();
+        if (!headless)
+            createSurface();
         selectPhysicalDevice();
         createDeviceInterface();
-        createSwapchain();
-        createRenderPass();
-        createGraphicsPipeline();
-        createComputePipeline();
-        createFramebuffers();
+        allocator.create(physicalDevice, device);
+        pipelineCache.create(physicalDevice, device, PIPELINE_CACHE_FILENAME, coldPipelineCache);
+        if (!headless) {
+            createSwapchain();
+            createRenderPass();
+        }
+        createDescriptorSetLayouts();
+        createPipelineLayouts();
+        Clock::time_point pipelineStart = Clock::now();
+        if (!headless)
+            createGraphicsPipeline(pipelineCache.cache);
+        createComputePipeline(pipelineCache.cache);
+        printf("Pipelines created in %.2f ms (%s pipeline cache).\n",
+            std::chrono::duration<double, std::milli>(Clock::now() - pipelineStart).count(), pipelineCache.warm ? "warm" : "cold");
+        dstImages.resize(headless ? 1 : DST_IMAGE_COUNT);
         createCommandPool();
-        createVertexBuffer();
-        createDescriptorPool();
+        createCommandBuffers();
+        createSyncObjects();
+        // compute() waits for the last sort before recording the next, so one slot will do
+        if (gpuProfiling)
+            gpuProfiler.create(physicalDevice, device, computeFamily, 1, pipelineStatistics);
+        // Only the displayed image crosses over to the graphics queue, everything
+        // else the sort reads or writes stays on the compute queue
+        stagingRing.create(allocator, device, computeFamily, computeQueue);
+        readbackRing.create(allocator, device, computeFamily, computeQueue);
+        if (!headless) {
+            createFramebuffers();
+            createVertexBuffer();
+            createSampler();
+        }
+        createDescriptorPools();
         allocateDescriptorSets();
     }
+    // Recreates all pipelines repeatedly, once against a fresh empty cache per
+    // iteration (cold start) and once against the populated application cache
+    // (warm start), and reports the average creation times. Note that drivers may
+    // keep their own shader caches, which shrinks the measured difference.
+    void benchmarkPipelineCache(int iterations) {
+        double coldMs = 0.0, warmMs = 0.0;
+        for (int i = 0; i < iterations; i++) {
+            if (!headless)
+                vkDestroyPipeline(device, graphicsPipeline, nullptr);
+            vkDestroyPipeline(device, computePipeline, nullptr);
+            VkPipelineCacheCreateInfo cacheInfo{};
+            cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+            VkPipelineCache emptyCache;
+            if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &emptyCache) != VK_SUCCESS)
+                throw runtime_error("Failed to create pipeline cache!");
+            Clock::time_point start = Clock::now();
+            if (!headless)
+                createGraphicsPipeline(emptyCache);
+            createComputePipeline(emptyCache);
+            coldMs += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            vkDestroyPipelineCache(device, emptyCache, nullptr);
+            if (!headless)
+                vkDestroyPipeline(device, graphicsPipeline, nullptr);
+            vkDestroyPipeline(device, computePipeline, nullptr);
+            start = Clock::now();
+            if (!headless)
+                createGraphicsPipeline(pipelineCache.cache);
+            createComputePipeline(pipelineCache.cache);
+            warmMs += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        }
+        coldMs /= iterations;
+        warmMs /= iterations;
+        printf("Pipeline creation over %d iterations:\n", iterations);
+        printf("\tcold: %.3f ms\n\twarm: %.3f ms\n\tspeedup: %.2fx\n", coldMs, warmMs, warmMs > 0.0 ? coldMs / warmMs : 0.0);
+    }
+    // Barrier moving a destination image from srcFamily to dstFamily, recorded on
+    // both sides of an ownership transfer. A plain barrier if the compute queue
+    // shares the graphics queue family, the semaphores order the two anyway.
+    VkImageMemoryBarrier dstImageBarrier(VkImage image, uint32_t srcFamily, uint32_t dstFamily, VkAccessFlags srcAccess, VkAccessFlags dstAccess) const {
+        bool transfer = graphicsFamily != computeFamily;
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        barrier.srcQueueFamilyIndex = transfer ? srcFamily : VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = transfer ? dstFamily : VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = image;
+        barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        barrier.srcAccessMask = srcAccess;
+        barrier.dstAccessMask = dstAccess;
+        return barrier;
+    }
+    // Records the release of a destination image to the graphics queue family,
+    // submitted to the compute queue by the frame that starts displaying it. Can be
+    // pending more than once, it's resubmitted as soon as the image is sorted again.
+    void recordHandoff(DestinationImage& dst) {
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+        if (vkBeginCommandBuffer(dst.handoffCommandBuffer, &beginInfo) != VK_SUCCESS)
+            throw runtime_error("Failed to begin recording handoff command buffer!");
+        VkImageMemoryBarrier release = dstImageBarrier(dst.image, computeFamily, graphicsFamily, VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT, 0);
+        vkCmdPipelineBarrier(dst.handoffCommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &release);
+        if (vkEndCommandBuffer(dst.handoffCommandBuffer) != VK_SUCCESS)
+            throw runtime_error("Failed to record handoff command buffer!");
+    }
+    // Records a sort into cmd, see shaders/pixelsort.comp. A full sort resets the
+    // destination to the source pixels, caches the keys and lists every span. A
+    // spans update lists only the spans changed by new thresholds, a resort reuses
+    // the lists as they are. Every sort dispatch is indirect, sized by the segment
+    // stage so only listed spans get work groups. Tiny and short spans are each
+    // sorted by a single dispatch over their lists. Long spans, only possible on
+    // lines over SORT_BLOCK_SIZE pixels, take one dispatch per global merge step
+    // on top of the block sorts and merges. The span lists are disjoint, so
+    // their sorts don't need barriers between them. Updates are relative to what
+    // dst held before.
+    void recordSort(VkCommandBuffer cmd, SortUpdate update, const DestinationImage& dst) {
+        SortLayout layout(imageExtent, sortSettings.vertical);
+        SortParams params{};
+        params.sortKey = sortSettings.key;
+        params.vertical = sortSettings.vertical;
+        params.descending = sortSettings.descending;
+        params.width = imageExtent.width;
+        params.height = imageExtent.height;
+        params.lineSize = layout.lineSize;
+        params.lowerThreshold = sortSettings.lowerThreshold;
+        params.upperThreshold = sortSettings.upperThreshold;
+        params.spanCapacity = layout.spanCapacity;
+        bool full = update == SORT_UPDATE_FULL;
+        params.previousLower = full ? sortSettings.lowerThreshold : dst.settings.lowerThreshold;
+        params.previousUpper = full ? sortSettings.upperThreshold : dst.settings.upperThreshold;
+        params.resortAll = full || sortSettings.descending != dst.settings.descending;
+        params.outputBuffer = stripOutput;
+        // The last sort's keys, span lists and entries are read and overwritten
+        gpuProfiler.beginScope(cmd, "reset");
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        if (full && stripOutput) {
+            // Pixels outside of spans keep their place
+            VkBufferCopy region{ 0, 0, (VkDeviceSize)imageExtent.width * imageExtent.height * 4 };
+            vkCmdCopyBuffer(cmd, pixelBuffer, outputBuffer, 1, &region);
+        } else if (full) {
+            VkBufferImageCopy region{};
+            region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            region.imageExtent = { imageExtent.width, imageExtent.height, 1 };
+            vkCmdCopyBufferToImage(cmd, pixelBuffer, dst.image, VK_IMAGE_LAYOUT_GENERAL, 1, &region);
+        }
+        if (update != SORT_UPDATE_RESORT) {
+            // Empty span lists, with the long dispatches' group counts along x
+            uint32_t header[SPAN_HEADER_SIZE / sizeof(uint32_t)] = {
+                0, 0, 0, 0,
+                0, 1, 1, 0,
+                0, 1, 1, 0,
+                layout.lineSize / SORT_GROUP_SIZE, 0, 1, 0,
+                layout.lineSize / 2 / SORT_GROUP_SIZE, 0, 1, 0,
+                layout.lineSize / SORT_BLOCK_SIZE, 0, 1, 0
+            };
+            vkCmdUpdateBuffer(cmd, spanBuffer, 0, SPAN_HEADER_SIZE, header);
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        }
+        gpuProfiler.endScope(cmd);
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, computePipelineLayout, 0, 1, &dst.computeDescriptorSet, 0, nullptr);
+        auto pushParams = [&](SortStage stage) {
+            params.stage = stage;
+            vkCmdPushConstants(cmd, computePipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(SortParams), &params);
+        };
+        if (full) {
+            gpuProfiler.beginScope(cmd, "keys");
+            pushParams(SORT_STAGE_KEYS);
+            vkCmdDispatch(cmd, ((layout.lineLength + 1) / 2 + SORT_GROUP_SIZE - 1) / SORT_GROUP_SIZE, layout.lineCount, 1);
+            gpuProfiler.endScope(cmd);
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        }
+        if (update != SORT_UPDATE_RESORT) {
+            gpuProfiler.beginScope(cmd, "segment");
+            pushParams(SORT_STAGE_SEGMENT);
+            vkCmdDispatch(cmd, 1, layout.lineCount, 1);
+            gpuProfiler.endScope(cmd);
+            // Span lists are read by the sorts and the long dispatches' group counts by the GPU
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        }
+        const VkDeviceSize tinyDispatch = 16, shortDispatch = 32, longDispatch = 48, longPairDispatch = 64, longBlockDispatch = 80;
+        gpuProfiler.beginScope(cmd, "short spans");
+        pushParams(SORT_STAGE_SORT_TINY);
+        vkCmdDispatchIndirect(cmd, spanBuffer, tinyDispatch);
+        pushParams(SORT_STAGE_SORT_SHORT);
+        vkCmdDispatchIndirect(cmd, spanBuffer, shortDispatch);
+        gpuProfiler.endScope(cmd);
+        if (layout.lineLength <= SORT_BLOCK_SIZE)
+            return;
+        gpuProfiler.beginScope(cmd, "long spans");
+        // Every long span stage reads what the previous one wrote to the entry buffer
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        auto dispatchLong = [&](SortStage stage, VkDeviceSize offset) {
+            pushParams(stage);
+            vkCmdDispatchIndirect(cmd, spanBuffer, offset);
+            if (stage != SORT_STAGE_SCATTER_LONG)
+                vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        };
+        dispatchLong(SORT_STAGE_LOAD_LONG, longDispatch);
+        dispatchLong(SORT_STAGE_SORT_BLOCK, longBlockDispatch);
+        for (uint32_t k = SORT_BLOCK_SIZE * 2; k <= layout.lineSize; k <<= 1) {
+            params.k = k;
+            for (uint32_t j = k / 2; j >= SORT_BLOCK_SIZE; j >>= 1) {
+                params.j = j;
+                dispatchLong(SORT_STAGE_MERGE_GLOBAL, longPairDispatch);
+            }
+            dispatchLong(SORT_STAGE_MERGE_BLOCK, longBlockDispatch);
+        }
+        dispatchLong(SORT_STAGE_SCATTER_LONG, longDispatch);
+        gpuProfiler.endScope(cmd);
+    }
+    // Forgets the last sort, so the next one starts from scratch
+    void invalidateSort() {
+        sortValid = false;
+        sortDirty = true;
+    }
+    // How little of a sort into dst brings it up to the current settings. The key
+    // buffer and span lists are shared by the destination images, so they have to
+    // match as well as what dst holds.
+    SortUpdate sortUpdate(const DestinationImage& dst) const {
+        auto sameKeys = [&](const SortSettings& settings) { return sortSettings.key == settings.key && sortSettings.vertical == settings.vertical; };
+        auto sameThresholds = [&](const SortSettings& settings) {
+            return sortSettings.lowerThreshold == settings.lowerThreshold && sortSettings.upperThreshold == settings.upperThreshold;
+        };
+        if (!sortValid || !dst.valid || !sameKeys(sortedSettings) || !sameKeys(dst.settings))
+            return SORT_UPDATE_FULL;
+        if (!sameThresholds(sortedSettings) || !sameThresholds(dst.settings) || !spanListsComplete)
+            return SORT_UPDATE_SPANS;
+        return SORT_UPDATE_RESORT;
+    }
+    // Sorts the source image into a destination image if the settings changed
+    // since the last sort, redoing as little of it as the change allows. Runs on
+    // the compute queue, into the destination image that isn't displayed, so it
+    // overlaps frames still showing the last result. Readbacks submitted afterwards
+    // see the result without waiting on computeFence, display picks it up in
+    // present().
     void compute() {
-        
+        if (!sortDirty || !imageLoaded)
+            return;
+        // Sort into the image not being displayed, or the latest one again if no
+        // frame has displayed it yet
+        uint32_t target = currentDst != displayedDst ? currentDst : (currentDst + 1) % (uint32_t)dstImages.size();
+        DestinationImage& dst = dstImages[target];
+        SortUpdate update = sortUpdate(dst);
+        bool upToDate = update == SORT_UPDATE_RESORT && sortSettings.descending == dst.settings.descending;
+        if (upToDate && !dst.released) {
+            currentDst = target;
+            sortDirty = false;
+            return;
+        }
+        TALOS_ZONE("sort");
+        {
+            TALOS_ZONE("wait for compute");
+            vkWaitForFences(device, 1, &computeFence, VK_TRUE, UINT64_MAX);
+        }
+        vkResetFences(device, 1, &computeFence);
+        vkResetCommandBuffer(computeCommandBuffer, 0);
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(computeCommandBuffer, &beginInfo) != VK_SUCCESS)
+            throw runtime_error("Failed to begin recording compute command buffer!");
+        gpuProfiler.beginFrame(computeCommandBuffer);
+        // Take the image back from the graphics queue once the frame that stopped
+        // displaying it is done, or wait for readbacks still copying the previous
+        // result before overwriting it
+        VkPipelineStageFlags writeStages = VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        VkImageMemoryBarrier imageBarrier = dst.released
+            ? dstImageBarrier(dst.image, graphicsFamily, computeFamily, 0, VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT)
+            : dstImageBarrier(dst.image, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, 0, VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+        vkCmdPipelineBarrier(computeCommandBuffer, writeStages, writeStages, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+        if (!upToDate) {
+            recordSort(computeCommandBuffer, update, dst);
+            // Make the result visible to readbacks, the output buffer's too
+            VkMemoryBarrier outputBarrier{};
+            outputBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            outputBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            outputBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            vkCmdPipelineBarrier(computeCommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &outputBarrier, 0, nullptr, 0, nullptr);
+        }
+        if (vkEndCommandBuffer(computeCommandBuffer) != VK_SUCCESS)
+            throw runtime_error("Failed to record compute command buffer!");
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        if (dst.released) {
+            submitInfo.waitSemaphoreCount = 1;
+            submitInfo.pWaitSemaphores = &dst.releasedSemaphore;
+            submitInfo.pWaitDstStageMask = &writeStages;
+        }
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &computeCommandBuffer;
+        if (vkQueueSubmit(computeQueue, 1, &submitInfo, computeFence) != VK_SUCCESS)
+            throw runtime_error("Failed to submit compute command buffer!");
+        dst.released = false;
+        if (!upToDate) {
+            // Spans updates only list what changed, unless the direction did too
+            spanListsComplete = update != SORT_UPDATE_SPANS || sortSettings.descending != dst.settings.descending;
+            sortedSettings = sortSettings;
+            sortValid = true;
+            dst.settings = sortSettings;
+            dst.valid = true;
+        }
+        currentDst = target;
+        sortDirty = false;
+    }
+    // Image holding the latest sort, for readbacks
+    VkImage resultImage() const {
+        return dstImages[currentDst].image;
+    }
+    void waitForCompute() {
+        vkWaitForFences(device, 1, &computeFence, VK_TRUE, UINT64_MAX);
+    }
+    size_t countMismatches(const vector<uint32_t>& pixels, CpuSorter& cpuSorter) {
+        vector<uint32_t> gpuResult(pixels.size()), cpuResult(pixels.size());
+        readbackRing.readImage(resultImage(), VK_IMAGE_LAYOUT_GENERAL, imageExtent, 4, [&](const void* data, VkDeviceSize size) {
+            memcpy(gpuResult.data(), data, (size_t)size);
+        });
+        readbackRing.flush();
+        cpuSorter.sort(pixels.data(), cpuResult.data(), imageExtent.width, imageExtent.height, sortSettings);
+        size_t mismatches = 0;
+        for (size_t i = 0; i < pixels.size(); i++)
+            if (gpuResult[i] != cpuResult[i])
+                mismatches++;
+        return mismatches;
+    }
+    // Sorts the loaded image repeatedly on the GPU and on the CPU, checks that both
+    // give the same pixels and reports their average times and throughput. Then
+    // times the incremental re-sorts of interactive tuning, nudging the upper
+    // threshold and flipping the direction, and checks their result too.
+    void benchmarkSort(int iterations, const vector<uint32_t>& pixels, CpuSorter& cpuSorter) {
+        double megapixels = (double)imageExtent.width * imageExtent.height / 1e6;
+        // The first sort warms up both paths and gives the results to compare
+        invalidateSort();
+        compute();
+        waitForCompute();
+        size_t mismatches = countMismatches(pixels, cpuSorter);
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < iterations; i++) {
+            invalidateSort();
+            compute();
+            waitForCompute();
+        }
+        double gpuMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / iterations;
+        vector<uint32_t> cpuResult(pixels.size());
+        start = Clock::now();
+        for (int i = 0; i < iterations; i++)
+            cpuSorter.sort(pixels.data(), cpuResult.data(), imageExtent.width, imageExtent.height, sortSettings);
+        double cpuMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / iterations;
+        SortSettings original = sortSettings;
+        auto timeUpdates = [&](const std::function<void(int)>& tweak) {
+            Clock::time_point start = Clock::now();
+            for (int i = 0; i < iterations; i++) {
+                tweak(i);
+                sortDirty = true;
+                compute();
+                waitForCompute();
+            }
+            return std::chrono::duration<double, std::milli>(Clock::now() - start).count() / iterations;
+        };
+        double thresholdMs = timeUpdates([&](int i) {
+            sortSettings.upperThreshold = i % 2 == 0 ? std::max(original.upperThreshold, original.lowerThreshold + SORT_THRESHOLD_STEP) - SORT_THRESHOLD_STEP : original.upperThreshold;
+        });
+        mismatches += countMismatches(pixels, cpuSorter);
+        double directionMs = timeUpdates([&](int) { sortSettings.descending = !sortSettings.descending; });
+        mismatches += countMismatches(pixels, cpuSorter);
+        sortSettings = original;
+        printf("Sorting %ux%u %s over %d iterations:\n", imageExtent.width, imageExtent.height, describeSort(sortSettings).c_str(), iterations);
+        printf("\tgpu: %.2f ms (%.1f MP/s)\n", gpuMs, megapixels * 1000.0 / gpuMs);
+        printf("\tcpu: %.2f ms (%.1f MP/s, %u threads, %s)\n", cpuMs, megapixels * 1000.0 / cpuMs, cpuSorter.pool.getThreadCount(), VECMAT_SIMD);
+        printf("\tgpu threshold update: %.2f ms\n\tgpu direction update: %.2f ms\n", thresholdMs, directionMs);
+        if (mismatches == 0)
+            printf("\tresults identical\n");
+        else
+            printf("\tresults differ in %zu pixels!\n", mismatches);
+        invalidateSort();
+    }
+    // Reads the destination image back through the staging ring and writes it to
+    // a PPM file.
+    void saveResult(const string& filename) {
+        TALOS_ZONE("save result");
+        bool written = false;
+        readbackRing.readImage(resultImage(), VK_IMAGE_LAYOUT_GENERAL, imageExtent, 4, [&](const void* data, VkDeviceSize size) {
+            written = Talos::writePPM(filename, data, imageExtent.width, imageExtent.height);
+        });
+        readbackRing.flush();
+        if (!written)
+            throw runtime_error("Failed to write '" + filename + "'!");
+    }
+    // Most whole lines a strip can hold for its sort to fit in workingSet bytes and
+    // the device limits
+    uint32_t stripLines(uint32_t lineLength, uint32_t lineCount, VkDeviceSize workingSet) const {
+        auto stripExtent = [&](uint32_t lines) { return sortSettings.vertical ? VkExtent2D{ lines, lineLength } : VkExtent2D{ lineLength, lines }; };
+        auto fits = [&](uint32_t lines) {
+            VkExtent2D extent = stripExtent(lines);
+            return largestSortBuffer(extent) <= deviceLimits.maxStorageBufferRange && sortWorkingSetSize(extent) <= workingSet;
+        };
+        // The working set grows about linearly with the lines, start from there
+        uint32_t lines = (uint32_t)std::min<VkDeviceSize>({ workingSet / sortWorkingSetSize(stripExtent(1)), lineCount, 65535 });
+        while (lines > 0 && !fits(lines))
+            lines--;
+        if (lines == 0)
+            throw runtime_error("A single line doesn't fit in the working set!");
+        return lines;
+    }
+    // Sorts an image of any size in strips of whole lines (rows or columns, as
+    // sorted), so spans never cross a strip and every strip is sorted exactly like
+    // the whole image would be. Each strip is uploaded, sorted into the output
+    // buffer and read back asynchronously, so reading the next strip from the
+    // source overlaps sorting the current one. Device memory stays within
+    // workingSet, host memory within a strip per readback slot. Returns the
+    // number of strips.
+    uint32_t sortStrips(ImageSource& source, PpmImageSink& sink, VkDeviceSize workingSet) {
+        bool vertical = sortSettings.vertical;
+        uint32_t lineLength = vertical ? source.height : source.width;
+        uint32_t lineCount = vertical ? source.width : source.height;
+        if (lineLength > 65535)
+            throw runtime_error("Image is too large to sort!");
+        uint32_t lines = stripLines(lineLength, lineCount, workingSet);
+        vector<uint32_t> strip((size_t)lineLength * lines);
+        uint32_t strips = 0;
+        for (uint32_t first = 0; first < lineCount; first += lines, strips++) {
+            uint32_t count = std::min(lines, lineCount - first);
+            VkExtent2D extent = vertical ? VkExtent2D{ count, lineLength } : VkExtent2D{ lineLength, count };
+            // Read the next strip while the last one sorts, its pixel buffer is reused after
+            source.readStrip(vertical, first, count, strip.data());
+            waitForCompute();
+            uploadImage(strip.data(), extent, true);
+            compute();
+            readbackRing.readBuffer(outputBuffer, 0, (VkDeviceSize)lineLength * count * 4, [&sink, vertical, first, count](const void* data, VkDeviceSize size) {
+                sink.writeStrip(vertical, first, count, (const uint32_t*)data);
+            });
+            readbackRing.poll();
+        }
+        readbackRing.flush();
+        return strips;
     }
+    // Records drawing the displayed destination image, acquiring it first if this
+    // frame is the first to display it, and releasing the one displayed before it
+    // back to the compute queue family after the render pass if releaseDst is set
+    void recordCommandBuffer(VkCommandBuffer cmd, VkFramebuffer framebuffer, bool acquire, uint32_t releaseDst) {
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        if (vkBeginCommandBuffer(cmd, &beginInfo) != VK_SUCCESS)
+            throw runtime_error("Failed to begin recording command buffer!");
+        const DestinationImage& dst = dstImages[displayedDst];
+        if (acquire) {
+            VkImageMemoryBarrier barrier = dstImageBarrier(dst.image, computeFamily, graphicsFamily, 0, VK_ACCESS_SHADER_READ_BIT);
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+        }
+        VkRenderPassBeginInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = renderPass;
+        renderPassInfo.framebuffer = framebuffer;
+        renderPassInfo.renderArea.offset = { 0, 0 };
+        renderPassInfo.renderArea.extent = swapchain.extent;
+        VkClearValue clearColor = { {{0.0f, 0.0f, 0.0f, 1.0f}} };
+        renderPassInfo.clearValueCount = 1;
+        renderPassInfo.pClearValues = &clearColor;
+        vkCmdBeginRenderPass(cmd, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+        VkDeviceSize offset = 0;
+        vkCmdBindVertexBuffers(cmd, 0, 1, &vertexBuffer, &offset);
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipelineLayout, 0, 1, &dst.graphicsDescriptorSet, 0, nullptr);
+        vkCmdDraw(cmd, (uint32_t)vertices.size(), 1, 0, 0);
+        vkCmdEndRenderPass(cmd);
+        if (releaseDst != NO_DST_IMAGE) {
+            // Earlier frames sampling it were submitted before, so are covered too
+            VkImageMemoryBarrier barrier = dstImageBarrier(dstImages[releaseDst].image, graphicsFamily, computeFamily, 0, 0);
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+        }
+        if (vkEndCommandBuffer(cmd) != VK_SUCCESS)
+            throw runtime_error("Failed to record command buffer!");
+    }
+    // Draws the latest sort over the whole window. A new sort is handed over from the
+    // compute queue first, the frame waiting for it on sortFinishedSemaphore, and
+    // the image displayed until then goes back to the compute queue for the next
+    // sort to write.
     void present() {
-        if (srcImage != VK_NULL_HANDLE) {
+        if (imageLoaded) {
+            TALOS_ZONE("frame");
+            {
+                TALOS_ZONE("wait for fence");
+                vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+            }
             uint32_t imageIndex;
-            if (vkAcquireNextImageKHR(device, swapchain.chain, UINT64_MAX, VK_NULL_HANDLE, VK_NULL_HANDLE, &imageIndex) != VK_SUCCESS)
+            VkResult res;
+            {
+                TALOS_ZONE("acquire");
+                res = vkAcquireNextImageKHR(device, swapchain.chain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+            }
+            if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR)
                 throw runtime_error("Failed to acquire next swapchain image!");
-            
-            
+            vkResetFences(device, 1, &inFlightFences[currentFrame]);
+            bool handoff = currentDst != displayedDst;
+            uint32_t releaseDst = handoff ? displayedDst : NO_DST_IMAGE;
+            vector<VkSemaphore> waitSemaphores{ imageAvailableSemaphores[currentFrame] };
+            vector<VkPipelineStageFlags> waitStages{ VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+            vector<VkSemaphore> signalSemaphores{ renderFinishedSemaphores[currentFrame] };
+            if (handoff) {
+                VkSubmitInfo handoffInfo{};
+                handoffInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                handoffInfo.commandBufferCount = 1;
+                handoffInfo.pCommandBuffers = &dstImages[currentDst].handoffCommandBuffer;
+                handoffInfo.signalSemaphoreCount = 1;
+                handoffInfo.pSignalSemaphores = &sortFinishedSemaphore;
+                if (vkQueueSubmit(computeQueue, 1, &handoffInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+                    throw runtime_error("Failed to submit handoff command buffer!");
+                waitSemaphores.push_back(sortFinishedSemaphore);
+                waitStages.push_back(VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+                if (releaseDst != NO_DST_IMAGE)
+                    signalSemaphores.push_back(dstImages[releaseDst].releasedSemaphore);
+                displayedDst = currentDst;
+            }
+            {
+                TALOS_ZONE("record");
+                vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+                recordCommandBuffer(commandBuffers[currentFrame], swapchain.framebuffers[imageIndex], handoff, releaseDst);
+            }
+            VkSubmitInfo submitInfo{};
+            submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            submitInfo.waitSemaphoreCount = (uint32_t)waitSemaphores.size();
+            submitInfo.pWaitSemaphores = waitSemaphores.data();
+            submitInfo.pWaitDstStageMask = waitStages.data();
+            submitInfo.commandBufferCount = 1;
+            submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+            submitInfo.signalSemaphoreCount = (uint32_t)signalSemaphores.size();
+            submitInfo.pSignalSemaphores = signalSemaphores.data();
+            {
+                TALOS_ZONE("submit");
+                if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS)
+                    throw runtime_error("Failed to submit draw command buffer!");
+            }
+            if (releaseDst != NO_DST_IMAGE)
+                dstImages[releaseDst].released = true;
             VkPresentInfoKHR presentInfo{};
             presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-            presentInfo.waitSemaphoreCount = 0;
-            presentInfo.pWaitSemaphores = VK_NULL_HANDLE;
+            presentInfo.waitSemaphoreCount = 1;
+            presentInfo.pWaitSemaphores = &renderFinishedSemaphores[currentFrame];
             presentInfo.swapchainCount = 1;
             presentInfo.pSwapchains = &swapchain.chain;
             presentInfo.pImageIndices = &imageIndex;
             presentInfo.pResults = nullptr;
-            vkQueuePresentKHR(presentQueue, &presentInfo);
+            {
+                TALOS_ZONE("present");
+                vkQueuePresentKHR(presentQueue, &presentInfo);
+            }
+            currentFrame = (currentFrame + 1) % MAX_CPU_PROCESSED_FRAMES;
         }
+        if (!cpuTraceFilename.empty())
+            Talos::collectTrace();
+    }
+    // Prints the GPU time table of the sorts so far and writes their trace if asked to
+    void reportGpuProfile() {
+        gpuProfiler.collect();
+        gpuProfiler.printTable();
+        if (gpuTraceFilename.empty() || !gpuProfiler.enabled())
+            return;
+        if (gpuProfiler.writeChromeTrace(gpuTraceFilename, "pixelsort"))
+            printf("Wrote GPU trace to '%s'.\n", gpuTraceFilename.c_str());
+        else
+            printf("Failed to write '%s'!\n", gpuTraceFilename.c_str());
+    }
+    // Prints the CPU zone table and writes the trace of every zone recorded
+    void reportCpuTrace() {
+        if (!Talos::traceEnabled()) {
+            printf("CPU tracing is compiled out, rebuild with -DTALOS_ENABLE_TRACING to write '%s'.\n", cpuTraceFilename.c_str());
+            return;
+        }
+        Talos::collectTrace();
+        Talos::printTraceSummary();
+        if (Talos::writeTrace(cpuTraceFilename, "pixelsort"))
+            printf("Wrote CPU trace to '%s' (%llu zones dropped).\n", cpuTraceFilename.c_str(), (unsigned long long)Talos::traceDroppedZones());
+        else
+            printf("Failed to write '%s'!\n", cpuTraceFilename.c_str());
     }
     void cleanup() {
         vkDeviceWaitIdle(device);
-        if (srcImage != VK_NULL_HANDLE) {
-            vkDestroyImage(device, srcImage, nullptr);
-            vkFreeMemory(device, srcImageMemory, nullptr);
-            vkDestroyImageView(device, srcImageView, nullptr);
-            vkDestroyImage(device, dstImage, nullptr);
-            vkFreeMemory(device, dstImageMemory, nullptr);
-            vkDestroyImageView(device, dstImageView, nullptr);
-        }
-        vkDestroyDescriptorPool(device, graphicsDescriptorPool, nullptr);
-        vkDestroyBuffer(device, vertexBuffer, nullptr);
-        vkFreeMemory(device, vertexBufferMemory, nullptr);
+        if (gpuProfiling)
+            reportGpuProfile();
+        if (!cpuTraceFilename.empty())
+            reportCpuTrace();
+        gpuProfiler.destroy();
+        if (imageLoaded)
+            destroyImageResources();
+        stagingRing.destroy();
+        readbackRing.destroy();
+        vkDestroyDescriptorPool(device, computeDescriptorPool, nullptr);
+        vkDestroyFence(device, computeFence, nullptr);
+        if (!headless) {
+            vkDestroySemaphore(device, sortFinishedSemaphore, nullptr);
+            for (DestinationImage& dst : dstImages)
+                vkDestroySemaphore(device, dst.releasedSemaphore, nullptr);
+            vkDestroyDescriptorPool(device, graphicsDescriptorPool, nullptr);
+            allocator.destroyBuffer(vertexBuffer, vertexBufferAllocation);
+            vkDestroySampler(device, dstSampler, nullptr);
+            for (size_t i = 0; i < MAX_CPU_PROCESSED_FRAMES; i++) {
+                vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+                vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+                vkDestroyFence(device, inFlightFences[i], nullptr);
+            }
+        }
         vkDestroyCommandPool(device, commandPool, nullptr);
+        vkDestroyCommandPool(device, computeCommandPool, nullptr);
         for (VkFramebuffer framebuffer : swapchain.framebuffers)
             vkDestroyFramebuffer(device, framebuffer, nullptr);
         vkDestroyPipeline(device, computePipeline, nullptr);
-        //vkDestroyDescriptorSetLayout(device, computeDescriptorSetLayout, nullptr);
-        vkDestroyPipeline(device, graphicsPipeline, nullptr);
-        vkDestroyDescriptorSetLayout(device, graphicsDescriptorSetLayout, nullptr);
-        vkDestroyRenderPass(device, renderPass, nullptr);
-        for (VkImageView imageView : swapchain.imageViews)
-            vkDestroyImageView(device, imageView, nullptr);
-        vkDestroySwapchainKHR(device, swapchain.chain, nullptr);
+        pipelineCache.save();
+        pipelineCache.destroy();
+        vkDestroyPipelineLayout(device, computePipelineLayout, nullptr);
+        vkDestroyDescriptorSetLayout(device, computeDescriptorSetLayout, nullptr);
+        if (!headless) {
+            vkDestroyPipeline(device, graphicsPipeline, nullptr);
+            vkDestroyPipelineLayout(device, graphicsPipelineLayout, nullptr);
+            vkDestroyDescriptorSetLayout(device, graphicsDescriptorSetLayout, nullptr);
+            vkDestroyRenderPass(device, renderPass, nullptr);
+            for (VkImageView imageView : swapchain.imageViews)
+                vkDestroyImageView(device, imageView, nullptr);
+            vkDestroySwapchainKHR(device, swapchain.chain, nullptr);
+        }
+        allocator.destroy();
         vkDestroyDevice(device, nullptr);
-        vkDestroySurfaceKHR(instance, surface, nullptr);
+        if (!headless)
+            vkDestroySurfaceKHR(instance, surface, nullptr);
         vkDestroyInstance(instance, nullptr);
     }
 };
@@ -834,30 +2022,478 @@ Application app;
 void kbdCallback(GLFWwindow* w, int key, int scancode, int action, int mods) {
     if (key == GLFW_KEY_Q || key == GLFW_KEY_ESCAPE)
         glfwSetWindowShouldClose(w, true);
+    if (action != GLFW_PRESS)
+        return;
+    // K cycles the sort key, V toggles rows / columns, D toggles descending order,
+    // [ and ] move the lower threshold, - and = the upper one
+    SortSettings& settings = app.sortSettings;
+    if (key == GLFW_KEY_K)
+        settings.key = (SortKey)((settings.key + 1) % SORT_KEY_COUNT);
+    else if (key == GLFW_KEY_V)
+        settings.vertical = !settings.vertical;
+    else if (key == GLFW_KEY_D)
+        settings.descending = !settings.descending;
+    else if (key == GLFW_KEY_LEFT_BRACKET)
+        settings.lowerThreshold -= std::min(settings.lowerThreshold, SORT_THRESHOLD_STEP);
+    else if (key == GLFW_KEY_RIGHT_BRACKET)
+        settings.lowerThreshold = std::min(settings.lowerThreshold + SORT_THRESHOLD_STEP, settings.upperThreshold);
+    else if (key == GLFW_KEY_MINUS)
+        settings.upperThreshold = std::max(settings.upperThreshold - std::min(settings.upperThreshold, SORT_THRESHOLD_STEP), settings.lowerThreshold);
+    else if (key == GLFW_KEY_EQUAL)
+        settings.upperThreshold = std::min(settings.upperThreshold + SORT_THRESHOLD_STEP, 65535u);
+    else
+        return;
+    app.sortDirty = true;
+    printf("Sorting %s.\n", describeSort(settings).c_str());
 }
 
 void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
     framebufferResized = true;
 }
 
-int main() {
-    if (!glfwInit())
-        throw runtime_error("Failed to initialize GLFW!");
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    window = glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, "Pixel Sorter", nullptr, nullptr);
-    if (!window)
-        throw runtime_error("Failed to create GLFW window!");
-    glfwSetKeyCallback(window, kbdCallback);
-    glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
-    app.initialize();
-    app.loadImage("textures/l'ete.jpg");
-    while (!glfwWindowShouldClose(window)) {
+// Sorts without touching Vulkan and writes the result out, for --cpu and as the
+// fallback for headless runs without a usable device
+int sortOnCpu(const string& inputFilename, const string& outputFilename, const SortSettings& settings, uint32_t threadCount) {
+    CpuSorter cpuSorter;
+    cpuSorter.create(threadCount);
+    Clock::time_point loadStart = Clock::now();
+    uint32_t width, height;
+    vector<uint32_t> pixels = decodePixels(inputFilename, width, height);
+    double loadMs = std::chrono::duration<double, std::milli>(Clock::now() - loadStart).count();
+    vector<uint32_t> sorted(pixels.size());
+    Clock::time_point sortStart = Clock::now();
+    cpuSorter.sort(pixels.data(), sorted.data(), width, height, settings);
+    double sortMs = std::chrono::duration<double, std::milli>(Clock::now() - sortStart).count();
+    cpuSorter.destroy();
+    if (!Talos::writePPM(outputFilename, sorted.data(), width, height))
+        throw runtime_error("Failed to write '" + outputFilename + "'!");
+    printf("Sorted '%s' (%ux%u) into '%s' on the CPU:\n", inputFilename.c_str(), width, height, outputFilename.c_str());
+    printf("\tload: %.2f ms\n\tsort: %.2f ms (%.1f MP/s, %s, %u threads)\n", loadMs, sortMs,
+        (double)width * height / (sortMs * 1000.0), describeSort(settings).c_str(), threadCount);
+    return 0;
+}
+
+// Bounded queue between the stages of a batch, pushing blocks while it's full
+template <typename T>
+class StageQueue {
+public:
+    explicit StageQueue(size_t capacity) : capacity(capacity) {}
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&]() { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+    // Waits up to timeout for an item, returning false if there was none
+    template <typename Duration>
+    bool pop(T& item, Duration timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!notEmpty.wait_for(lock, timeout, [&]() { return !items.empty() || closed; }) || items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    bool pop(T& item) {
+        while (!done())
+            if (pop(item, std::chrono::milliseconds(100)))
+                return true;
+        return false;
+    }
+    // No more items will be pushed, pop returns false once the rest are taken
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+    }
+    bool done() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return closed && items.empty();
+    }
+private:
+    size_t capacity;
+    std::mutex mutex;
+    std::condition_variable notEmpty, notFull;
+    std::deque<T> items;
+    bool closed = false;
+};
+
+bool matchWildcard(const char* pattern, const char* name) {
+    if (*pattern == '\0')
+        return *name == '\0';
+    if (*pattern == '*')
+        return matchWildcard(pattern + 1, name) || (*name != '\0' && matchWildcard(pattern, name + 1));
+    if (*name != '\0' && (*pattern == '?' || *pattern == *name))
+        return matchWildcard(pattern + 1, name + 1);
+    return false;
+}
+
+// Files to sort from a directory, taking the formats stb_image reads, or a glob
+// with * and ? in its last component, e.g. "archive/*.jpg"
+vector<string> listBatchInputs(const string& input) {
+    namespace fs = std::filesystem;
+    const std::set<string> IMAGE_EXTENSIONS = { ".jpg", ".jpeg", ".png", ".bmp", ".tga", ".psd", ".gif", ".hdr", ".pic", ".ppm", ".pgm" };
+    fs::path path(input);
+    bool directory = fs::is_directory(path);
+    fs::path dir = directory ? path : path.parent_path();
+    string pattern = directory ? "*" : path.filename().string();
+    if (dir.empty())
+        dir = ".";
+    vector<string> files;
+    std::error_code error;
+    for (const fs::directory_entry& entry : fs::directory_iterator(dir, error)) {
+        if (!entry.is_regular_file())
+            continue;
+        string name = entry.path().filename().string();
+        string extension = entry.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)tolower(c); });
+        if (matchWildcard(pattern.c_str(), name.c_str()) && (!directory || IMAGE_EXTENSIONS.count(extension)))
+            files.push_back(entry.path().string());
+    }
+    if (error)
+        throw runtime_error("Failed to list '" + dir.string() + "'!");
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// An image moving through the stages of a batch, with the time it spent in each
+struct BatchImage {
+    string filename;
+    uint32_t width = 0, height = 0;
+    vector<uint32_t> pixels;
+    string error;
+    Clock::time_point start;
+    double decodeMs = 0.0, uploadMs = 0.0, sortMs = 0.0, readbackMs = 0.0, encodeMs = 0.0, totalMs = 0.0;
+};
+
+double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Nearest rank percentile
+double percentile(vector<double> values, double p) {
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(p / 100.0 * values.size());
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+// Sorts every image of a directory or glob into outputDir as PPM files, with the
+// stages pipelined across images: decoder threads run ahead of the sort, so JPEG
+// decode of the next images overlaps the GPU sorting the current one, and the
+// results are copied out of the readback ring and encoded on their own thread.
+// Without a device (gpu false), images are sorted by the CPU sorter instead of
+// being uploaded and read back. Images that fail to load are skipped.
+int sortBatch(const string& input, const string& outputDir, uint32_t threadCount, bool gpu) {
+    namespace fs = std::filesystem;
+    vector<string> files = listBatchInputs(input);
+    if (files.empty()) {
+        printf("No images found at '%s'!\n", input.c_str());
+        return 1;
+    }
+    fs::create_directories(outputDir);
+    const SortSettings& settings = app.sortSettings;
+    CpuSorter cpuSorter;
+    if (!gpu)
+        cpuSorter.create(threadCount);
+    // Decoders only need to stay a couple of images ahead
+    uint32_t decoderCount = std::min<uint32_t>(std::max(1u, threadCount - 1), (uint32_t)files.size());
+    StageQueue<BatchImage> decoded(decoderCount + 1), sorted(4);
+    std::atomic<size_t> nextFile{ 0 };
+    vector<std::thread> decoders;
+    std::atomic<uint32_t> decodersLeft{ decoderCount };
+    for (uint32_t i = 0; i < decoderCount; i++) {
+        decoders.emplace_back([&]() {
+            TALOS_TRACE_THREAD("decoder");
+            for (size_t f = nextFile++; f < files.size(); f = nextFile++) {
+                BatchImage image;
+                image.filename = files[f];
+                image.start = Clock::now();
+                try {
+                    TALOS_ZONE("decode");
+                    image.pixels = decodePixels(image.filename, image.width, image.height);
+                    if (image.width > 65535 || image.height > 65535)
+                        image.error = "Image is too large to sort!";
+                } catch (const runtime_error& e) {
+                    image.error = e.what();
+                }
+                image.decodeMs = millisecondsSince(image.start);
+                decoded.push(std::move(image));
+            }
+            if (--decodersLeft == 0)
+                decoded.close();
+        });
+    }
+    // The encoder keeps the finished images' times for the report
+    vector<BatchImage> finished;
+    double megapixels = 0.0;
+    std::thread encoder([&]() {
+        TALOS_TRACE_THREAD("encoder");
+        BatchImage image;
+        while (sorted.pop(image)) {
+            TALOS_ZONE("encode");
+            Clock::time_point start = Clock::now();
+            string outputFilename = (fs::path(outputDir) / fs::path(image.filename).stem()).string() + ".ppm";
+            if (!Talos::writePPM(outputFilename, image.pixels.data(), image.width, image.height))
+                printf("Failed to write '%s'!\n", outputFilename.c_str());
+            image.encodeMs = millisecondsSince(start);
+            image.totalMs = millisecondsSince(image.start);
+            megapixels += (double)image.width * image.height / 1e6;
+            image.pixels = vector<uint32_t>();
+            finished.push_back(std::move(image));
+        }
+    });
+    Clock::time_point batchStart = Clock::now();
+    size_t skipped = 0;
+    BatchImage image;
+    while (true) {
+        // Hand finished readbacks to the encoder while waiting for the decoders
+        bool got = false;
+        while (!(got = decoded.pop(image, std::chrono::milliseconds(1))) && !decoded.done())
+            if (gpu)
+                app.readbackRing.poll();
+        if (!got)
+            break;
+        if (!image.error.empty()) {
+            printf("Skipping '%s': %s\n", image.filename.c_str(), image.error.c_str());
+            skipped++;
+            continue;
+        }
+        if (!gpu) {
+            Clock::time_point start = Clock::now();
+            vector<uint32_t> result(image.pixels.size());
+            cpuSorter.sort(image.pixels.data(), result.data(), image.width, image.height, settings);
+            image.pixels.swap(result);
+            image.sortMs = millisecondsSince(start);
+            sorted.push(std::move(image));
+            continue;
+        }
+        Clock::time_point start = Clock::now();
+        try {
+            app.uploadImage(image.pixels.data(), { image.width, image.height });
+        } catch (const runtime_error& e) {
+            // Batches sort whole images, larger ones need a strip run of their own
+            printf("Skipping '%s': %s\n", image.filename.c_str(), e.what());
+            skipped++;
+            continue;
+        }
+        image.uploadMs = millisecondsSince(start);
+        start = Clock::now();
+        app.compute();
+        // The sort's time runs until its readback has completed, the callback
+        // reuses the decoded pixels' storage for the result
+        auto pending = std::make_shared<BatchImage>(std::move(image));
+        app.readbackRing.readImage(app.resultImage(), VK_IMAGE_LAYOUT_GENERAL, app.imageExtent, 4, [&sorted, pending, start](const void* data, VkDeviceSize size) {
+            Clock::time_point ready = Clock::now();
+            pending->sortMs = std::chrono::duration<double, std::milli>(ready - start).count();
+            memcpy(pending->pixels.data(), data, (size_t)size);
+            pending->readbackMs = millisecondsSince(ready);
+            sorted.push(std::move(*pending));
+        });
+        app.readbackRing.poll();
+    }
+    if (gpu)
+        app.readbackRing.flush();
+    sorted.close();
+    for (std::thread& decoder : decoders)
+        decoder.join();
+    encoder.join();
+    double batchSeconds = millisecondsSince(batchStart) / 1000.0;
+    if (!gpu)
+        cpuSorter.destroy();
+    printf("Sorted %zu images (%zu skipped) from '%s' into '%s' on the %s, %s:\n", finished.size(), skipped, input.c_str(), outputDir.c_str(),
+        gpu ? "GPU" : "CPU", describeSort(settings).c_str());
+    printf("\t%.2f s, %.2f images/s, %.1f MP/s\n", batchSeconds, finished.size() / batchSeconds, megapixels / batchSeconds);
+    // Per image latency of each stage, the sort's including its readback copy on the GPU
+    const char* STAGE_NAMES[] = { "decode", "upload", "sort", "readback", "encode", "total" };
+    double BatchImage::* STAGE_TIMES[] = { &BatchImage::decodeMs, &BatchImage::uploadMs, &BatchImage::sortMs, &BatchImage::readbackMs, &BatchImage::encodeMs, &BatchImage::totalMs };
+    printf("\t%-10s %10s %10s %10s\n", "stage", "p50", "p95", "p99");
+    for (size_t stage = 0; stage < 6; stage++) {
+        if (!gpu && (STAGE_TIMES[stage] == &BatchImage::uploadMs || STAGE_TIMES[stage] == &BatchImage::readbackMs))
+            continue;
+        vector<double> times;
+        for (const BatchImage& done : finished)
+            times.push_back(done.*STAGE_TIMES[stage]);
+        printf("\t%-10s %7.2f ms %7.2f ms %7.2f ms\n", STAGE_NAMES[stage], percentile(times, 50), percentile(times, 95), percentile(times, 99));
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    TALOS_TRACE_THREAD("main");
+    int benchPipelineIterations = 0;
+    int benchSortIterations = 0;
+    bool cpuOnly = false;
+    uint32_t threadCount = 0;
+    string inputFilename = "textures/l'ete.jpg";
+    string outputFilename = "pixelsort.ppm";
+    string batchInput;
+    string outputDir = "sorted";
+    bool forceStrips = false;
+    VkDeviceSize workingSet = 256ull << 20;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cold-cache") == 0)
+            app.coldPipelineCache = true;
+        else if (strcmp(argv[i], "--bench-pipelines") == 0 && i + 1 < argc)
+            benchPipelineIterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--headless") == 0)
+            app.headless = true;
+        else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+            inputFilename = argv[++i];
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            outputFilename = argv[++i];
+        else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            uint32_t key = 0;
+            while (key < SORT_KEY_COUNT && strcmp(name, SORT_KEY_NAMES[key]) != 0)
+                key++;
+            if (key == SORT_KEY_COUNT) {
+                printf("Unknown sort key '%s'!\n", name);
+                return 1;
+            }
+            app.sortSettings.key = (SortKey)key;
+        }
+        else if (strcmp(argv[i], "--vertical") == 0)
+            app.sortSettings.vertical = true;
+        else if (strcmp(argv[i], "--descending") == 0)
+            app.sortSettings.descending = true;
+        else if (strcmp(argv[i], "--thresholds") == 0 && i + 2 < argc) {
+            // Fractions of the key range, only runs of pixels within them get sorted
+            double lower = atof(argv[++i]), upper = atof(argv[++i]);
+            if (!(lower >= 0.0 && lower <= upper && upper <= 1.0)) {
+                printf("Thresholds must satisfy 0 <= LOWER <= UPPER <= 1!\n");
+                return 1;
+            }
+            app.sortSettings.lowerThreshold = (uint32_t)(lower * 65535.0 + 0.5);
+            app.sortSettings.upperThreshold = (uint32_t)(upper * 65535.0 + 0.5);
+        }
+        else if (strcmp(argv[i], "--cpu") == 0)
+            cpuOnly = true;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threadCount = (uint32_t)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bench-sort") == 0 && i + 1 < argc)
+            benchSortIterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            batchInput = argv[++i];
+        else if (strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc)
+            outputDir = argv[++i];
+        else if (strcmp(argv[i], "--strips") == 0)
+            forceStrips = true;
+        else if (strcmp(argv[i], "--working-set") == 0 && i + 1 < argc)
+            workingSet = (VkDeviceSize)atoi(argv[++i]) << 20;
+        else if (strcmp(argv[i], "--profile-gpu") == 0)
+            app.gpuProfiling = true;
+        else if (strcmp(argv[i], "--pipeline-stats") == 0)
+            app.gpuProfiling = app.pipelineStatistics = true;
+        else if (strcmp(argv[i], "--gpu-trace") == 0 && i + 1 < argc) {
+            app.gpuProfiling = true;
+            app.gpuTraceFilename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cpu-trace") == 0 && i + 1 < argc)
+            app.cpuTraceFilename = argv[++i];
+        else {
+            printf("Usage: %s [--cold-cache] [--bench-pipelines N] [--headless] [--input FILE] [--output FILE.ppm]\n", argv[0]);
+            printf("\t[--key luminance|hue|saturation] [--vertical] [--descending] [--thresholds LOWER UPPER] [--cpu] [--threads N] [--bench-sort N]\n");
+            printf("\t[--batch DIR|GLOB] [--output-dir DIR] [--strips] [--working-set MB] [--profile-gpu] [--pipeline-stats] [--gpu-trace FILE.json]\n");
+            printf("\t[--cpu-trace FILE.json]\n");
+            return 1;
+        }
+    }
+    if (threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    if (!batchInput.empty()) {
+        // Batches never open a window and fall back to the CPU like headless runs
+        app.headless = true;
+        bool gpu = !cpuOnly;
+        if (gpu) {
+            try {
+                app.initialize();
+            } catch (const runtime_error& e) {
+                printf("%s Sorting on the CPU instead.\n", e.what());
+                gpu = false;
+            }
+        }
+        int result = sortBatch(batchInput, outputDir, threadCount, gpu);
+        if (gpu)
+            app.cleanup();
+        return result;
+    }
+    if (cpuOnly)
+        return sortOnCpu(inputFilename, outputFilename, app.sortSettings, threadCount);
+    // Decode while the window and device come up
+    std::future<std::unique_ptr<ImageSource>> pendingSource = std::async(std::launch::async, openImageSource, inputFilename);
+    if (!app.headless) {
+        if (!glfwInit())
+            throw runtime_error("Failed to initialize GLFW!");
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        window = glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, "Pixel Sorter", nullptr, nullptr);
+        if (!window)
+            throw runtime_error("Failed to create GLFW window!");
+        glfwSetKeyCallback(window, kbdCallback);
+        glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+    }
+    try {
+        app.initialize();
+    } catch (const runtime_error& e) {
+        if (!app.headless)
+            throw;
+        printf("%s Sorting on the CPU instead.\n", e.what());
+        return sortOnCpu(inputFilename, outputFilename, app.sortSettings, threadCount);
+    }
+    if (benchPipelineIterations > 0)
+        app.benchmarkPipelineCache(benchPipelineIterations);
+    Clock::time_point loadStart = Clock::now();
+    std::unique_ptr<ImageSource> source = pendingSource.get();
+    VkExtent2D extent{ source->width, source->height };
+    if (app.headless && (forceStrips || !app.fitsInOnePass(extent, workingSet))) {
+        // Too large for one pass, stream whole lines through the GPU a strip at a time
+        PpmImageSink sink(outputFilename, extent.width, extent.height);
+        double loadMs = std::chrono::duration<double, std::milli>(Clock::now() - loadStart).count();
+        Clock::time_point sortStart = Clock::now();
+        uint32_t strips = app.sortStrips(*source, sink, workingSet);
+        double sortMs = std::chrono::duration<double, std::milli>(Clock::now() - sortStart).count();
+        printf("Sorted '%s' (%ux%u) into '%s' in %u strips:\n", inputFilename.c_str(), extent.width, extent.height, outputFilename.c_str(), strips);
+        printf("\tload: %.2f ms\n\tsort: %.2f ms (%.1f MP/s, %s)\n", loadMs, sortMs,
+            (double)extent.width * extent.height / (sortMs * 1000.0), describeSort(app.sortSettings).c_str());
+        app.cleanup();
+        return 0;
+    }
+    vector<uint32_t> pixels = source->readAll();
+    source.reset();
+    app.uploadImage(pixels.data(), extent);
+    double loadMs = std::chrono::duration<double, std::milli>(Clock::now() - loadStart).count();
+    app.allocator.printStats();
+    if (benchSortIterations > 0) {
+        CpuSorter cpuSorter;
+        cpuSorter.create(threadCount);
+        app.benchmarkSort(benchSortIterations, pixels, cpuSorter);
+        cpuSorter.destroy();
+    }
+    if (app.headless) {
+        // Sort once and write the result out instead of displaying it
+        Clock::time_point computeStart = Clock::now();
         app.compute();
-        app.present();
-        glfwPollEvents();
+        app.waitForCompute();
+        double computeMs = std::chrono::duration<double, std::milli>(Clock::now() - computeStart).count();
+        Clock::time_point readbackStart = Clock::now();
+        app.saveResult(outputFilename);
+        double readbackMs = std::chrono::duration<double, std::milli>(Clock::now() - readbackStart).count();
+        printf("Sorted '%s' (%ux%u) into '%s':\n", inputFilename.c_str(), app.imageExtent.width, app.imageExtent.height, outputFilename.c_str());
+        printf("\tload: %.2f ms\n\tcompute: %.2f ms (%.1f MP/s, %s)\n\treadback: %.2f ms\n", loadMs, computeMs,
+            (double)app.imageExtent.width * app.imageExtent.height / (computeMs * 1000.0), describeSort(app.sortSettings).c_str(), readbackMs);
+    } else {
+        while (!glfwWindowShouldClose(window)) {
+            app.compute();
+            app.present();
+            glfwPollEvents();
+        }
     }
     app.cleanup();
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    if (!app.headless) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
     return 0;
 }
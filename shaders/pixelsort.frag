@@ -1,8 +1,17 @@
 #version 450
 
+layout(binding = 0) uniform sampler2D sortedImage;
+
 layout(location = 0) in vec2 inUv;
 layout(location = 0) out vec4 outColor;
 
+// The sorted image holds sRGB encoded bytes in a UNORM image, decode them so the
+// sRGB swapchain doesn't encode them twice
+vec3 srgbToLinear(vec3 c) {
+	return mix(c / 12.92, pow((c + 0.055) / 1.055, vec3(2.4)), greaterThan(c, vec3(0.04045)));
+}
+
 void main() {
-	outColor = vec4(1, 0, 0, 1);
+	vec4 color = texture(sortedImage, inUv);
+	outColor = vec4(srgbToLinear(color.rgb), color.a);
 }
\ No newline at end of file
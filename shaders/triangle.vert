@@ -6,6 +6,14 @@ layout(binding = 0) uniform UniformBufferObject {
     mat4 proj;
 } ubo;
 
+layout(std430, binding = 2) readonly buffer InstanceBuffer {
+    mat4 model[];
+} instances;
+
+layout(std430, binding = 3) readonly buffer VisibleBuffer {
+    uint index[];
+} visible;
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inNormal;
 layout(location = 2) in vec4 inColor;
@@ -16,8 +24,9 @@ layout(location = 2) out vec4 outColor;
 layout(location = 3) out vec2 outUv;
 
 void main() {
-    outPosition = (ubo.view * ubo.model * vec4(inPosition, 1)).xyz;
-    outNormal = (ubo.view * ubo.model * vec4(inNormal, 0)).xyz;
+    mat4 modelView = ubo.view * instances.model[visible.index[gl_InstanceIndex]] * ubo.model;
+    outPosition = (modelView * vec4(inPosition, 1)).xyz;
+    outNormal = (modelView * vec4(inNormal, 0)).xyz;
     outColor = inColor;
     outUv = inUv;
     gl_Position = ubo.proj * vec4(outPosition, 1);
@@ -1,8 +1,17 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
+#include <cstddef>
+// stb_image allocates through these so JPEG textures can decode straight into staging memory
+void* decodeMalloc(size_t size);
+void* decodeRealloc(void* memory, size_t size);
+void decodeFree(void* memory);
+#define STBI_MALLOC(size) decodeMalloc(size)
+#define STBI_REALLOC(memory, size) decodeRealloc(memory, size)
+#define STBI_FREE(memory) decodeFree(memory)
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #include <VecMat.h>
+#include <talos.h>
 
 #include <chrono>
 #include <vector>
@@ -13,6 +22,10 @@
 #include <optional>
 #include <limits>
 #include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <thread>
 
 #pragma warning(disable : 26812) // Disable enum class warning from Vulkan enums
 
@@ -23,13 +36,40 @@ const std::vector<const char*> deviceExtensions = {
 	VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
 const std::string TEX_FILENAME = "textures/l'ete.jpg";
+// Cycled through with T, each swap decoded in the background
+const std::vector<std::string> TEXTURE_FILENAMES = { "textures/l'ete.jpg", "textures/etretat.jpg", "textures/etude-de-tete.jpg" };
+const std::string PIPELINE_CACHE_FILENAME = "triangle.pipelinecache";
+const std::string TEXTURE_CACHE_DIRECTORY = "texturecache";
+const VkFormat OFFSCREEN_FORMAT = VK_FORMAT_R8G8B8A8_SRGB;
+const float INSTANCE_SPACING = 2.5f;
 
 typedef std::chrono::high_resolution_clock Clock;
 typedef std::chrono::seconds::period Period;
 
 uint32_t currentFrame = 0;
 bool framebufferResized = false;
+bool textureSwapRequested = false;
 float size = 0.5f;
+bool headless = false;
+bool samplerAnisotropy = false;
+float maxAnisotropy = 16.0f; // Requested, clamped to the device limit
+float lodBias = 0.0f;
+bool textureMipmaps = true;
+bool coldTextureCache = false; // Decode textures even if they're cached, rewriting their entries
+bool gpuProfiling = false;
+bool pipelineStatistics = false;
+std::string gpuTraceFilename;
+std::string cpuTraceFilename;
+uint32_t windowWidth = WIN_WIDTH;
+uint32_t windowHeight = WIN_HEIGHT;
+uint32_t requestedSamples = 1; // MSAA samples asked for, clamped to what the device supports
+VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+uint32_t instanceCount = 1;
+int instanceThreads = 1;
+Talos::ThreadPool instancePool; // Runs matrix generation chunks, only started for grids that get split
+uint32_t recordThreads = 0; // Threads recording a draw per instance, 0 draws the GPU culled instances indirectly
+float sceneScale = 1.0f;
+float meshRadius = 1.0f;
 
 GLFWwindow* window;
 VkInstance instance;
@@ -48,28 +88,53 @@ VkRenderPass renderPass;
 VkPipelineLayout pipelineLayout;
 VkDescriptorSetLayout descriptorSetLayout;
 VkPipeline graphicsPipeline;
+VkDescriptorSetLayout cullDescriptorSetLayout;
+VkPipelineLayout cullPipelineLayout;
+VkPipeline cullPipeline;
 VkCommandPool commandPool;
 VkDescriptorPool descriptorPool;
 std::vector<VkDescriptorSet> descriptorSets;
+std::vector<VkDescriptorSet> cullDescriptorSets;
 VkImage textureImage;
-VkDeviceMemory textureImageMemory;
+Talos::Allocation textureImageAllocation;
 VkImageView textureImageView;
+Talos::ImageLoader textureLoader;
+Talos::TextureCache textureCache;
+uint32_t textureGeneration = 0; // Bumped whenever a loaded texture replaces the current one
+std::vector<uint32_t> descriptorTextureGenerations; // Texture each frame's descriptor set points at
+size_t textureIndex = 0;
+VkFormat depthFormat;
+VkImage depthImage;
+Talos::Allocation depthImageAllocation;
+VkImageView depthImageView;
+VkImage colorImage; // Multisampled color resolved into the swapchain image, only with MSAA
+Talos::Allocation colorImageAllocation;
+VkImageView colorImageView = VK_NULL_HANDLE;
 VkSampler textureSampler;
 VkBuffer vertexBuffer;
-VkDeviceMemory vertexBufferMemory;
+Talos::Allocation vertexBufferAllocation;
 VkBuffer indexBuffer;
-VkDeviceMemory indexBufferMemory;
-std::vector<VkBuffer> uniformBuffers;
-std::vector<VkDeviceMemory> uniformBuffersMemory;
+Talos::Allocation indexBufferAllocation;
+Talos::UniformArena uniformArena;
+std::vector<VkBuffer> instanceBuffers;
+std::vector<Talos::Allocation> instanceBufferAllocations;
 std::vector<VkCommandBuffer> commandBuffers;
 std::vector<VkSemaphore> imageAvailableSemaphores;
 std::vector<VkSemaphore> renderFinishedSemaphores;
 std::vector<VkFence> inFlightFences;
+Talos::Allocator allocator;
+Talos::PipelineCache pipelineCache;
+Talos::OffscreenTarget offscreenTarget;
+Talos::StagingRing stagingRing;
+Talos::ReadbackRing readbackRing;
+Talos::GpuProfiler gpuProfiler;
+Talos::ThreadPool recordPool;
+Talos::CommandRecorder commandRecorder;
 
 struct QueueFamilyIndices {
 	std::optional<uint32_t> graphicsFamily = std::nullopt;
 	std::optional<uint32_t> presentFamily = std::nullopt;
-	bool isComplete() { return graphicsFamily.has_value() && presentFamily.has_value(); }
+	bool isComplete() { return graphicsFamily.has_value() && (headless || presentFamily.has_value()); }
 };
 
 struct SwapchainSupportDetails {
@@ -118,6 +183,98 @@ struct UniformBufferObject {
 	mat4 proj;
 };
 
+// Cubes of the instanced grid as structure of arrays streams, for VecMat's batch
+// operations: positions, spin rates (degrees per second) and the current angles
+struct InstanceStreams {
+	std::vector<float> x, y, z;
+	std::vector<float> spin;
+	std::vector<float> angle;
+};
+
+// Push constants of the culling pass, world space planes with normals pointing into the frustum
+struct CullParams {
+	vec4 planes[6];
+	uint32_t instanceCount;
+	float radius;
+};
+
+// Per frame output of the culling pass. The visible instance count is copied into
+// the host visible stats buffer, and read back once the frame's fence is waited on.
+struct CullBuffers {
+	VkBuffer visibleBuffer;
+	Talos::Allocation visibleAllocation;
+	VkBuffer indirectBuffer;
+	Talos::Allocation indirectAllocation;
+	VkBuffer statsBuffer;
+	Talos::Allocation statsAllocation;
+	bool pending = false;
+};
+
+// Texture replaced by a newly loaded one, destroyed once no frame in flight can still sample it
+struct RetiredTexture {
+	VkImage image;
+	Talos::Allocation allocation;
+	VkImageView imageView;
+	uint32_t frames; // Frame fences left to wait on
+};
+
+// Swapchain replaced on a resize along with everything sized to it, destroyed once
+// no frame in flight can still use them
+struct RetiredSwapchain {
+	VkSwapchainKHR swapchain;
+	std::vector<VkImageView> imageViews;
+	std::vector<VkFramebuffer> framebuffers;
+	VkImage depthImage;
+	Talos::Allocation depthImageAllocation;
+	VkImageView depthImageView;
+	VkImage colorImage;
+	Talos::Allocation colorImageAllocation;
+	VkImageView colorImageView; // VK_NULL_HANDLE without MSAA
+	uint32_t frames; // Frame fences left to wait on
+};
+
+// Frame timings accumulated over the current reporting interval
+struct FrameStats {
+	Clock::time_point intervalStart = Clock::now();
+	uint32_t frames = 0;
+	double cpuMs = 0.0; // Building and submitting frames, excluding waits
+	double instanceMs = 0.0; // Writing instance matrices, included in cpuMs
+	uint64_t visibleInstances = 0; // Summed over the frames whose cull stats were read
+	uint32_t cullSamples = 0;
+};
+
+// Deterministic run for comparing performance (--bench): a fixed number of frames
+// animated at a fixed timestep, after warmup frames that aren't measured
+struct Benchmark {
+	uint32_t frames = 0; // Measured frames, 0 when not benchmarking
+	uint32_t warmupFrames = 30;
+	float timestep = 1.0f / 60.0f; // Seconds of animation per frame, headless runs always use it
+	std::string jsonFilename; // "-" for stdout
+	uint32_t frame = 0; // Frames drawn so far, warmup included
+	Clock::time_point lastFrame;
+	std::vector<double> cpuMs; // Per measured frame
+	std::vector<double> frameMs;
+};
+
+// Distribution of a benchmark's per-frame times
+struct TimeStats {
+	size_t count = 0;
+	double min = 0.0;
+	double avg = 0.0;
+	double p50 = 0.0;
+	double p95 = 0.0;
+	double p99 = 0.0;
+	double max = 0.0;
+};
+
+InstanceStreams instances;
+std::vector<CullBuffers> cullBuffers;
+CullParams cullParams;
+FrameStats frameStats;
+Benchmark benchmark;
+std::vector<RetiredTexture> retiredTextures;
+std::vector<RetiredSwapchain> retiredSwapchains;
+
 const std::vector<Vertex> vertices = {
     //   POS         NORMAL       COLOR        UV
     {{-1, -1, 1},  {0, 0, 1},  {1, 0, 0, 1}, {1, 1}},
@@ -173,6 +330,7 @@ static std::vector<char> readBinaryFile(const std::string& filename) {
 
 void kbdCallback(GLFWwindow* w, int key, int scancode, int action, int mods) {
 	if (key == GLFW_KEY_Q || key == GLFW_KEY_ESCAPE) glfwSetWindowShouldClose(w, true);
+	if (key == GLFW_KEY_T && action == GLFW_PRESS) textureSwapRequested = true;
 }
 
 void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
@@ -192,13 +350,19 @@ QueueFamilyIndices getQueueFamilies(VkPhysicalDevice device) {
 		return queueFamilyIndices;
 	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
 	vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, queueFamilies.data());
-	// Check for queue families with graphics and presentation support
+	// Check for queue families with graphics and presentation support, keeping the
+	// first match and preferring a graphics family that can also present
 	for (uint32_t i = 0; i < queueFamilyCount; i++) {
-		if (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
-			queueFamilyIndices.graphicsFamily = std::make_optional(i);
 		VkBool32 present = false;
-		vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &present);
-		if (present)
+		if (!headless)
+			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &present);
+		bool graphics = queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT;
+		if (graphics && (!queueFamilyIndices.graphicsFamily.has_value() || (present && queueFamilyIndices.graphicsFamily != queueFamilyIndices.presentFamily))) {
+			queueFamilyIndices.graphicsFamily = std::make_optional(i);
+			if (present)
+				queueFamilyIndices.presentFamily = std::make_optional(i);
+		}
+		if (present && !queueFamilyIndices.presentFamily.has_value())
 			queueFamilyIndices.presentFamily = std::make_optional(i);
 	}
 	return queueFamilyIndices;
@@ -234,28 +398,18 @@ bool isDeviceSuitable(VkPhysicalDevice device) {
 	vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
 	std::vector<VkExtensionProperties> availableExtensions(extensionCount);
 	vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
-	std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+	std::set<std::string> requiredExtensions;
+	if (!headless)
+		requiredExtensions.insert(deviceExtensions.begin(), deviceExtensions.end());
 	for (const VkExtensionProperties& extension : availableExtensions)
 		requiredExtensions.erase(extension.extensionName);
-	// Check if swapchain adequate
-	bool adequateSwapChain = false;
-	if (requiredExtensions.empty()) {
+	// Check if swapchain adequate, nothing to present to when headless
+	bool adequateSwapChain = headless;
+	if (requiredExtensions.empty() && !headless) {
 		SwapchainSupportDetails swapchainSupport = querySwapchainSupport(device);
 		adequateSwapChain = !swapchainSupport.formats.empty() && !swapchainSupport.presentModes.empty();
 	}
-    // Get device features and check if anisotropy supported
-    VkPhysicalDeviceFeatures supportedFeatures;
-    vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
-	return queueFamilyIndices.isComplete() && requiredExtensions.empty() && adequateSwapChain && supportedFeatures.samplerAnisotropy;
-}
-
-uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-	VkPhysicalDeviceMemoryProperties memProperties;
-	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) 
-		if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) 
-			return i;
-	throw std::runtime_error("Failed to find suitable memory type!");
+	return queueFamilyIndices.isComplete() && requiredExtensions.empty() && adequateSwapChain;
 }
 
 VkShaderModule createShaderModule(const std::vector<char>& code) {
@@ -281,9 +435,9 @@ void createVkInstance() {
 	appInfo.pEngineName = "No engine";
 	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
 	appInfo.apiVersion = VK_API_VERSION_1_0;
-	// Get instance extensions required by GLFW
+	// Get instance extensions required by GLFW, headless runs need no surface extensions
 	uint32_t glfwExtensionCount = 0;
-	const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+	const char** glfwExtensions = headless ? nullptr : glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 	printf("GLFW Required Extensions:\n");
 	for (uint32_t i = 0; i < glfwExtensionCount; i++) printf("\t%s\n", glfwExtensions[i]);
 	// Get available extensions
@@ -307,59 +461,68 @@ void createVkInstance() {
 }
 
 void selectPhysicalDevice() {
-	// Get number of physical devices
-	uint32_t device_count = 0;
-	vkEnumeratePhysicalDevices(instance, &device_count, nullptr);
-	if (device_count == 0)
-		throw std::runtime_error("Couldn't find any GPUs with Vulkan support!");
-	// Enumerate all found physical devices
-	std::vector<VkPhysicalDevice> devices(device_count);
-	vkEnumeratePhysicalDevices(instance, &device_count, devices.data());
-	// Pick a suitable device
-	for (const VkPhysicalDevice device : devices)
+	// Pick the first suitable device, best scored first (TALOS_DEVICE overrides)
+	for (const VkPhysicalDevice device : Talos::rankPhysicalDevices(instance))
 		if (isDeviceSuitable(device)) { physicalDevice = device; break; }
 	if (physicalDevice == VK_NULL_HANDLE)
 		throw std::runtime_error("Failed to find a suitable GPU!");
 	// Retrieve device properties, report selected device
 	VkPhysicalDeviceProperties device_props;
 	vkGetPhysicalDeviceProperties(physicalDevice, &device_props);
-	printf("Selected GPU '%s'.\n", device_props.deviceName);
+	printf("Selected GPU '%s' (%s).\n", device_props.deviceName, Talos::deviceTypeName(device_props.deviceType));
+	// Use the most MSAA samples up to the requested count that color and depth both support
+	VkSampleCountFlags sampleCounts = device_props.limits.framebufferColorSampleCounts & device_props.limits.framebufferDepthSampleCounts;
+	msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+	for (uint32_t samples = 2; samples <= requestedSamples && samples <= VK_SAMPLE_COUNT_64_BIT; samples *= 2)
+		if (sampleCounts & samples)
+			msaaSamples = (VkSampleCountFlagBits)samples;
+	if ((uint32_t)msaaSamples != requestedSamples)
+		printf("%ux MSAA isn't supported, using %ux.\n", requestedSamples, (uint32_t)msaaSamples);
 }
 
 void createLogicalDevice() {
 	QueueFamilyIndices queueFamilyIndices = getQueueFamilies(physicalDevice);
 	float queuePriority = 1.0f;
-	// Create graphics queue creation info struct
-	VkDeviceQueueCreateInfo gfxQueueCreateInfo{};
-	gfxQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-	gfxQueueCreateInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-	gfxQueueCreateInfo.queueCount = 1;
-	gfxQueueCreateInfo.pQueuePriorities = &queuePriority;
-	// Create present queue creation info struct
-	VkDeviceQueueCreateInfo prsQueueCreateInfo{};
-	prsQueueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-	prsQueueCreateInfo.queueFamilyIndex = queueFamilyIndices.presentFamily.value();
-	prsQueueCreateInfo.queueCount = 1;
-	prsQueueCreateInfo.pQueuePriorities = &queuePriority;
-	// Create device features struct
+	// Create one queue creation info struct per distinct queue family
+	std::set<uint32_t> uniqueFamilies{ queueFamilyIndices.graphicsFamily.value() };
+	if (queueFamilyIndices.presentFamily.has_value())
+		uniqueFamilies.insert(queueFamilyIndices.presentFamily.value());
+	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
+	for (uint32_t family : uniqueFamilies) {
+		VkDeviceQueueCreateInfo queueCreateInfo{};
+		queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queueCreateInfo.queueFamilyIndex = family;
+		queueCreateInfo.queueCount = 1;
+		queueCreateInfo.pQueuePriorities = &queuePriority;
+		queueCreateInfos.push_back(queueCreateInfo);
+	}
+	// Create device features struct. Anisotropic filtering is used when available but
+	// not required, CPU implementations may not support it
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+	samplerAnisotropy = supportedFeatures.samplerAnisotropy == VK_TRUE;
 	VkPhysicalDeviceFeatures deviceFeatures{};
-    deviceFeatures.samplerAnisotropy = VK_TRUE;
+    deviceFeatures.samplerAnisotropy = samplerAnisotropy ? VK_TRUE : VK_FALSE;
+	deviceFeatures.pipelineStatisticsQuery = pipelineStatistics ? supportedFeatures.pipelineStatisticsQuery : VK_FALSE;
 	// Create logical device creation info struct
-	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos{ gfxQueueCreateInfo, prsQueueCreateInfo };
+	std::vector<const char*> enabledExtensions;
+	if (!headless)
+		enabledExtensions = deviceExtensions;
 	VkDeviceCreateInfo createInfo{};
 	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 	createInfo.pQueueCreateInfos = queueCreateInfos.data();
 	createInfo.queueCreateInfoCount = (uint32_t)queueCreateInfos.size();
 	createInfo.pEnabledFeatures = &deviceFeatures;
-	createInfo.enabledExtensionCount = (uint32_t)deviceExtensions.size();
-	createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+	createInfo.enabledExtensionCount = (uint32_t)enabledExtensions.size();
+	createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 	createInfo.enabledLayerCount = 0;
 	VkResult res = vkCreateDevice(physicalDevice, &createInfo, nullptr, &logicalDevice);
 	if (res != VK_SUCCESS)
 		throw std::runtime_error("Failed to create logical device!");
-	// Get graphics queue
+	// Get graphics queue, and present queue when there is a surface
 	vkGetDeviceQueue(logicalDevice, queueFamilyIndices.graphicsFamily.value(), 0, &graphicsQueue);
-	vkGetDeviceQueue(logicalDevice, queueFamilyIndices.presentFamily.value(), 0, &presentQueue);
+	if (!headless)
+		vkGetDeviceQueue(logicalDevice, queueFamilyIndices.presentFamily.value(), 0, &presentQueue);
 }
 
 void createSurface() {
@@ -408,7 +571,8 @@ void createSwapchain() {
 	createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 	createInfo.presentMode = presentMode;
 	createInfo.clipped = VK_TRUE;
-	createInfo.oldSwapchain = VK_NULL_HANDLE;
+	// Hand the current swapchain over when recreating, it's retired by the caller
+	createInfo.oldSwapchain = swapchain;
 	// Check queue indices for sharing mode
 	QueueFamilyIndices indices = getQueueFamilies(physicalDevice);
 	if (indices.graphicsFamily != indices.presentFamily) {
@@ -435,15 +599,15 @@ void createSwapchain() {
 	swapchainExtent = extent;
 }
 
-VkImageView createImageView(VkImage image, VkFormat format) {
+VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, uint32_t levelCount = 1) {
     VkImageViewCreateInfo viewInfo{};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     viewInfo.image = image;
     viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
     viewInfo.format = format;
-    viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    viewInfo.subresourceRange.aspectMask = aspectMask;
     viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.levelCount = levelCount;
     viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
     VkImageView imageView;
@@ -465,34 +629,65 @@ void createRenderPass() {
 	// Create render pass color attachment description
 	VkAttachmentDescription colorAttachment{};
 	colorAttachment.format = swapchainImageFormat;
-	colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	colorAttachment.samples = msaaSamples;
 	colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
 	colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 	colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 	colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-	// Create render pass color attachment reference
+	colorAttachment.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	// With MSAA, the color is resolved into a single sampled attachment taking its place
+	VkAttachmentDescription resolveAttachment = colorAttachment;
+	resolveAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	resolveAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+		colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	}
+	// Create render pass depth attachment description, contents aren't needed after the pass
+	VkAttachmentDescription depthAttachment{};
+	depthAttachment.format = depthFormat;
+	depthAttachment.samples = msaaSamples;
+	depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	// Create render pass attachment references
 	VkAttachmentReference colorAttachmentRef{};
 	colorAttachmentRef.attachment = 0;
 	colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	VkAttachmentReference depthAttachmentRef{};
+	depthAttachmentRef.attachment = 1;
+	depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	VkAttachmentReference resolveAttachmentRef{};
+	resolveAttachmentRef.attachment = 2;
+	resolveAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 	VkSubpassDescription subpass{};
 	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
 	subpass.colorAttachmentCount = 1;
 	subpass.pColorAttachments = &colorAttachmentRef;
-	// Create subpass dependencies
+	subpass.pDepthStencilAttachment = &depthAttachmentRef;
+	if (msaaSamples != VK_SAMPLE_COUNT_1_BIT)
+		subpass.pResolveAttachments = &resolveAttachmentRef;
+	// Create subpass dependencies, the depth buffer is shared between frames in flight
 	VkSubpassDependency dependency{};
 	dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
 	dependency.dstSubpass = 0;
-	dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependency.srcAccessMask = 0;
-	dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+	dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	// Offscreen target is reused right after being read back, wait for the copy
+	if (headless)
+		dependency.srcStageMask |= VK_PIPELINE_STAGE_TRANSFER_BIT;
 	// Create render pass info struct
 	VkRenderPassCreateInfo renderPassInfo{};
 	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	renderPassInfo.attachmentCount = 1;
-	renderPassInfo.pAttachments = &colorAttachment;
+	VkAttachmentDescription attachments[] = { colorAttachment, depthAttachment, resolveAttachment };
+	renderPassInfo.attachmentCount = msaaSamples != VK_SAMPLE_COUNT_1_BIT ? 3 : 2;
+	renderPassInfo.pAttachments = attachments;
 	renderPassInfo.subpassCount = 1;
 	renderPassInfo.pSubpasses = &subpass;
 	renderPassInfo.dependencyCount = 1;
@@ -506,7 +701,7 @@ void createDescriptorSetLayout() {
 	// Set up UBO descriptor set layout binding
 	VkDescriptorSetLayoutBinding uboLayoutBinding{};
 	uboLayoutBinding.binding = 0;
-	uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	uboLayoutBinding.descriptorCount = 1;
 	uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
     // Set up sample descriptor set layout binding
@@ -516,8 +711,16 @@ void createDescriptorSetLayout() {
     samplerLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     samplerLayoutBinding.pImmutableSamplers = nullptr;
     samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	// Set up instance storage buffer descriptor set layout binding
+	VkDescriptorSetLayoutBinding instanceLayoutBinding{};
+	instanceLayoutBinding.binding = 2;
+	instanceLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	instanceLayoutBinding.descriptorCount = 1;
+	instanceLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
     // Collect all bindings
-    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = { uboLayoutBinding, samplerLayoutBinding };
+	VkDescriptorSetLayoutBinding visibleLayoutBinding = instanceLayoutBinding;
+	visibleLayoutBinding.binding = 3;
+    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = { uboLayoutBinding, samplerLayoutBinding, instanceLayoutBinding, visibleLayoutBinding };
 	// Create descriptor set layout
 	VkDescriptorSetLayoutCreateInfo layoutInfo{};
 	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -562,25 +765,17 @@ void createGraphicsPipeline() {
 	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
 	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
 	inputAssembly.primitiveRestartEnable = VK_FALSE;
-	// Create viewport info
-	VkViewport viewport{};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = (float) swapchainExtent.width;
-	viewport.height = (float) swapchainExtent.height;
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
-	// Create scissor rectangle
-	VkRect2D scissor{};
-	scissor.offset = { 0, 0 };
-	scissor.extent = swapchainExtent;
-	// Create viewport state from viewport and scissor rectangle
+	// Create viewport state, viewport and scissor are set when recording so the
+	// pipeline outlives swapchain resizes
 	VkPipelineViewportStateCreateInfo viewportState{};
 	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportState.viewportCount = 1;
-	viewportState.pViewports = &viewport;
 	viewportState.scissorCount = 1;
-	viewportState.pScissors = &scissor;
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicState{};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount = 2;
+	dynamicState.pDynamicStates = dynamicStates;
 	// Create rasterizer state info struct
 	VkPipelineRasterizationStateCreateInfo rasterizer{};
 	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -595,7 +790,15 @@ void createGraphicsPipeline() {
 	VkPipelineMultisampleStateCreateInfo multisampler{};
 	multisampler.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
 	multisampler.sampleShadingEnable = VK_FALSE;
-	multisampler.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	multisampler.rasterizationSamples = msaaSamples;
+	// Create depth stencil state info struct
+	VkPipelineDepthStencilStateCreateInfo depthStencil{};
+	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	depthStencil.depthTestEnable = VK_TRUE;
+	depthStencil.depthWriteEnable = VK_TRUE;
+	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+	depthStencil.depthBoundsTestEnable = VK_FALSE;
+	depthStencil.stencilTestEnable = VK_FALSE;
 	// Create color blend attachment state info struct
 	VkPipelineColorBlendAttachmentState colorBlendAttachment{};
 	colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
@@ -624,16 +827,16 @@ void createGraphicsPipeline() {
 	pipelineInfo.pViewportState = &viewportState;
 	pipelineInfo.pRasterizationState = &rasterizer;
 	pipelineInfo.pMultisampleState = &multisampler;
-	pipelineInfo.pDepthStencilState = nullptr;
+	pipelineInfo.pDepthStencilState = &depthStencil;
 	pipelineInfo.pColorBlendState = &colorBlending;
-	pipelineInfo.pDynamicState = nullptr;
+	pipelineInfo.pDynamicState = &dynamicState;
 	pipelineInfo.layout = pipelineLayout;
 	pipelineInfo.renderPass = renderPass;
 	pipelineInfo.subpass = 0;
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
 	pipelineInfo.basePipelineIndex = -1;
 	// Create graphics pipeline
-	res = vkCreateGraphicsPipelines(logicalDevice, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline);
+	res = vkCreateGraphicsPipelines(logicalDevice, pipelineCache.cache, 1, &pipelineInfo, nullptr, &graphicsPipeline);
 	if (res != VK_SUCCESS)
 		throw std::runtime_error("Failed to create graphics pipeline!");
 	// Clean up shader modules after graphics pipeline created
@@ -641,14 +844,66 @@ void createGraphicsPipeline() {
 	vkDestroyShaderModule(logicalDevice, fragShaderModule, nullptr);
 }
 
+void createCullPipeline() {
+	VkResult res;
+	// Set up instance, visible list and indirect draw bindings
+	std::vector<VkDescriptorSetLayoutBinding> layoutBindings(3);
+	for (uint32_t i = 0; i < 3; i++) {
+		layoutBindings[i].binding = i;
+		layoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		layoutBindings[i].descriptorCount = 1;
+		layoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	}
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = (uint32_t)layoutBindings.size();
+	layoutInfo.pBindings = layoutBindings.data();
+	res = vkCreateDescriptorSetLayout(logicalDevice, &layoutInfo, nullptr, &cullDescriptorSetLayout);
+	if (res != VK_SUCCESS)
+		throw std::runtime_error("Failed to create cull descriptor set layout!");
+	// Create pipeline layout, frustum is passed as push constants
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(CullParams);
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &cullDescriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+	res = vkCreatePipelineLayout(logicalDevice, &pipelineLayoutInfo, nullptr, &cullPipelineLayout);
+	if (res != VK_SUCCESS)
+		throw std::runtime_error("Failed to create cull pipeline layout!");
+	// Create compute pipeline
+	std::vector<char> compShaderCode = readBinaryFile("shaders/spv/cull-comp.spv");
+	VkShaderModule compShaderModule = createShaderModule(compShaderCode);
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = compShaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = cullPipelineLayout;
+	res = vkCreateComputePipelines(logicalDevice, pipelineCache.cache, 1, &pipelineInfo, nullptr, &cullPipeline);
+	if (res != VK_SUCCESS)
+		throw std::runtime_error("Failed to create cull pipeline!");
+	vkDestroyShaderModule(logicalDevice, compShaderModule, nullptr);
+}
+
 void createFramebuffers() {
 	swapchainFramebuffers.resize(swapchainImageViews.size());
 	for (size_t i = 0; i < swapchainImageViews.size(); i++) {
-		VkImageView attachments[] = { swapchainImageViews[i] };
+		// With MSAA the swapchain image is the resolve attachment, after the multisampled ones
+		VkImageView attachments[] = { swapchainImageViews[i], depthImageView, VK_NULL_HANDLE };
+		if (msaaSamples != VK_SAMPLE_COUNT_1_BIT) {
+			attachments[0] = colorImageView;
+			attachments[2] = swapchainImageViews[i];
+		}
 		VkFramebufferCreateInfo framebufferInfo{};
 		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
 		framebufferInfo.renderPass = renderPass;
-		framebufferInfo.attachmentCount = 1;
+		framebufferInfo.attachmentCount = msaaSamples != VK_SAMPLE_COUNT_1_BIT ? 3 : 2;
 		framebufferInfo.pAttachments = attachments;
 		framebufferInfo.width = swapchainExtent.width;
 		framebufferInfo.height = swapchainExtent.height;
@@ -670,130 +925,12 @@ void createCommandPool() {
 		throw std::runtime_error("Failed to create command pool!");
 }
 
-void beginOneTimeCommands(VkCommandBuffer& commandBuffer) {
-    // Allocate new command buffer
-    VkCommandBufferAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = commandPool;
-    allocInfo.commandBufferCount = 1;
-    vkAllocateCommandBuffers(logicalDevice, &allocInfo, &commandBuffer);
-    // Begin recording to command buffer
-    VkCommandBufferBeginInfo beginInfo{};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
-}
-
-void endOneTimeCommands(VkCommandBuffer& commandBuffer) {
-    // End recording to command buffer
-    vkEndCommandBuffer(commandBuffer);
-    // Submit command buffer, wait until device idle
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-    vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphicsQueue);
-    // Free command buffer
-    vkFreeCommandBuffers(logicalDevice, commandPool, 1, &commandBuffer);
-}
-
-void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
-	VkResult res;
-	// Create buffer
-	VkBufferCreateInfo bufferInfo{};
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = size;
-	bufferInfo.usage = usage;
-	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	res = vkCreateBuffer(logicalDevice, &bufferInfo, nullptr, &buffer);
-	if (res != VK_SUCCESS) 
-		throw std::runtime_error("Failed to create buffer!");
-	// Get memory requirements of buffer
-	VkMemoryRequirements memRequirements;
-	vkGetBufferMemoryRequirements(logicalDevice, buffer, &memRequirements);
-	// Allocate buffer memory
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-	res = vkAllocateMemory(logicalDevice, &allocInfo, nullptr, &bufferMemory);
-	if (res != VK_SUCCESS)
-		throw std::runtime_error("Failed to allocate buffer memory!");
-	// Bind memory to buffer
-	vkBindBufferMemory(logicalDevice, buffer, bufferMemory, 0);
-}
-
-void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-    // Allocate and start recording to one time use command buffer
-    VkCommandBuffer commandBuffer;
-    beginOneTimeCommands(commandBuffer);
-    // Copy source buffer to destination buffer
-    VkBufferCopy copyRegion{};
-    copyRegion.size = size;
-    vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-    // End recording and free command buffer
-    endOneTimeCommands(commandBuffer);
-}
-
-void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-    // Allocate and start recording to one time use command buffer
-    VkCommandBuffer commandBuffer;
-    beginOneTimeCommands(commandBuffer);
-    // Set up buffer to image copy
-    VkBufferImageCopy region{};
-    region.bufferOffset = 0;
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
-    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
-    region.imageOffset = {0, 0, 0};
-    region.imageExtent = { width, height, 1 };
-    // Copy buffer to image
-    vkCmdCopyBufferToImage(commandBuffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-    // End recording and free command buffer
-    endOneTimeCommands(commandBuffer);
-}
-
-void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout) {
-    // Allocate and start recording to one time use command buffer
-    VkCommandBuffer commandBuffer;
-    beginOneTimeCommands(commandBuffer);
-    VkImageMemoryBarrier barrier{};
-    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.oldLayout = oldLayout;
-    barrier.newLayout = newLayout;
-    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.image = image;
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
-    VkPipelineStageFlags sourceStage;
-    VkPipelineStageFlags destinationStage;
-    if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-        destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    } else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-        sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    } else throw std::invalid_argument("Unsupported image layout transition!");
-    vkCmdPipelineBarrier(commandBuffer, sourceStage, destinationStage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-    // End recording and free command buffer
-    endOneTimeCommands(commandBuffer);
-}
-
-void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
-    VkResult res;
+void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, Talos::Allocation& bufferAllocation) {
+	// Create buffer and bind it to memory sub-allocated from the allocator
+	allocator.createBuffer(size, usage, properties, buffer, bufferAllocation);
+}
+
+void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, Talos::Allocation& imageAllocation, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT) {
     VkImageCreateInfo imageInfo{};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -806,51 +943,227 @@ void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling
     imageInfo.tiling = tiling;
     imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     imageInfo.usage = usage;
-    imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageInfo.samples = samples;
     imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    res = vkCreateImage(logicalDevice, &imageInfo, nullptr, &image);
-    if (res != VK_SUCCESS)
-        throw std::runtime_error("failed to create image!");
-    VkMemoryRequirements memRequirements;
-    vkGetImageMemoryRequirements(logicalDevice, image, &memRequirements);
-    VkMemoryAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    allocInfo.allocationSize = memRequirements.size;
-    allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-    res = vkAllocateMemory(logicalDevice, &allocInfo, nullptr, &imageMemory);
-    if (res != VK_SUCCESS)
-        throw std::runtime_error("failed to allocate image memory!");
-    vkBindImageMemory(logicalDevice, image, imageMemory, 0);
+    // Create image and bind it to memory sub-allocated from the allocator
+    allocator.createImage(imageInfo, properties, image, imageAllocation);
+}
+
+VkFormat findDepthFormat() {
+	// Pick the first depth format usable as an optimally tiled attachment
+	const VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT };
+	for (VkFormat format : candidates) {
+		VkFormatProperties properties;
+		vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+		if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
+			return format;
+	}
+	throw std::runtime_error("Failed to find supported depth format!");
 }
 
+void createDepthResources() {
+	// Single depth buffer of the swapchain's size, no transition needed since the render pass clears it
+	createImage(swapchainExtent.width, swapchainExtent.height, depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthImage, depthImageAllocation, msaaSamples);
+	depthImageView = createImageView(depthImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
+}
+
+void destroyDepthResources() {
+	vkDestroyImageView(logicalDevice, depthImageView, nullptr);
+	allocator.destroyImage(depthImage, depthImageAllocation);
+}
+
+void createColorResources() {
+	// Multisampled color target of the swapchain's size, only lives within the render pass
+	if (msaaSamples == VK_SAMPLE_COUNT_1_BIT)
+		return;
+	createImage(swapchainExtent.width, swapchainExtent.height, swapchainImageFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, colorImage, colorImageAllocation, msaaSamples);
+	colorImageView = createImageView(colorImage, swapchainImageFormat);
+}
+
+void destroyColorResources() {
+	if (colorImageView == VK_NULL_HANDLE)
+		return;
+	vkDestroyImageView(logicalDevice, colorImageView, nullptr);
+	allocator.destroyImage(colorImage, colorImageAllocation);
+	colorImageView = VK_NULL_HANDLE;
+}
+
+// Decoding thread's staging memory for stb_image's output, only armed for JPEGs.
+// This relies on stb_image's JPEG loader: its output is the one allocation of
+// exactly width*height*4+1 bytes (its other allocations are the sizeof(stbi__jpeg)
+// context, line buffers of width+3 and component planes of a multiple of 64 plus
+// 15, none of which can equal it), and it's returned without further conversion.
+// Other formats decode into the heap and are copied over.
+struct DecodeTarget {
+	void* memory = nullptr;
+	size_t size = 0;
+	bool taken = false;
+};
+thread_local DecodeTarget decodeTarget;
+
+void* decodeMalloc(size_t size) {
+	DecodeTarget& target = decodeTarget;
+	if (target.memory && !target.taken && size == target.size) {
+		target.taken = true;
+		return target.memory;
+	}
+	return malloc(size);
+}
+
+void* decodeRealloc(void* memory, size_t size) {
+	DecodeTarget& target = decodeTarget;
+	if (memory == nullptr || memory != target.memory)
+		return realloc(memory, size);
+	// Staging memory can't grow, move it to the heap
+	void* moved = malloc(size);
+	if (moved)
+		memcpy(moved, memory, std::min(size, target.size));
+	return moved;
+}
+
+void decodeFree(void* memory) {
+	// The staging memory isn't the heap's, the upload releases it
+	if (memory != decodeTarget.memory)
+		free(memory);
+}
+
+// Loads a texture on a loader thread into the staging memory handed out by allocate,
+// copied from its texture cache entry if there is one, else decoded and cached
+std::string decodeTexture(const std::string& filename, const Talos::DecodeAllocator& allocate) {
+	TALOS_ZONE("load texture");
+	Talos::MappedFile source;
+	if (!source.open(filename))
+		return "Failed to open texture '" + filename + "'!";
+	uint64_t sourceHash = Talos::hashFNV1a(source.data(), source.size());
+	Talos::TextureCacheEntry entry;
+	if (!coldTextureCache && textureCache.open(sourceHash, VK_FORMAT_R8G8B8A8_SRGB, entry)) {
+		TALOS_ZONE("copy cached texture");
+		memcpy(allocate(entry.extent, entry.levels[0].size), entry.levelData(0), (size_t)entry.levels[0].size);
+		return "";
+	}
+	int width, height, channels;
+	if (!stbi_info_from_memory(source.data(), (int)source.size(), &width, &height, &channels))
+		return "Failed to load texture '" + filename + "'!";
+	// stb_image's JPEG output carries a byte of slack
+	size_t size = (size_t)width * height * 4;
+	bool jpeg = source.size() >= 2 && source.data()[0] == 0xFF && source.data()[1] == 0xD8;
+	void* staging = allocate({ (uint32_t)width, (uint32_t)height }, jpeg ? size + 1 : size);
+	DecodeTarget& target = decodeTarget;
+	if (jpeg)
+		target = { staging, size + 1, false };
+	stbi_uc* pixels = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, STBI_rgb_alpha);
+	bool taken = target.taken;
+	target = DecodeTarget{};
+	if (!pixels)
+		return "Failed to load texture '" + filename + "'!";
+	assert(!taken || pixels == staging);
+	if (pixels != staging) {
+		memcpy(staging, pixels, size);
+		stbi_image_free(pixels);
+	}
+	if (!textureCache.write(sourceHash, VK_FORMAT_R8G8B8A8_SRGB, 4, { (uint32_t)width, (uint32_t)height }, { staging }))
+		printf("Failed to write texture cache entry for '%s'!\n", filename.c_str());
+	return "";
+}
+
+// Times loading each bundled texture with the cache cold (decoding the source and
+// writing its entry) and warm (mapping the entry), the same way the loader does
+void benchmarkTextureCache(int iterations) {
+	textureCache.create(TEXTURE_CACHE_DIRECTORY);
+	std::vector<uint8_t> pixels;
+	Talos::DecodeAllocator allocate = [&pixels](VkExtent2D extent, VkDeviceSize size) {
+		pixels.resize((size_t)size);
+		return (void*)pixels.data();
+	};
+	printf("%-32s %12s %10s %10s %8s\n", "", "size", "cold", "warm", "speedup");
+	for (const std::string& filename : TEXTURE_FILENAMES) {
+		double ms[2] = {};
+		for (int cold = 1; cold >= 0; cold--) {
+			coldTextureCache = cold == 1;
+			for (int i = 0; i < iterations; i++) {
+				Clock::time_point start = Clock::now();
+				std::string error = decodeTexture(filename, allocate);
+				ms[cold] += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+				if (!error.empty()) {
+					printf("%s\n", error.c_str());
+					return;
+				}
+			}
+			ms[cold] /= iterations;
+		}
+		printf("%-32s %9.2f MB %7.2f ms %7.2f ms %7.2fx\n", filename.c_str(), pixels.size() / 1048576.0, ms[1], ms[0], ms[1] / ms[0]);
+	}
+	coldTextureCache = false;
+}
+
+// Replaces the current texture with a loaded one. Frames pick it up as their
+// descriptor sets come free, see updateTextureDescriptor.
+void swapTexture(const Talos::LoadedImage& image) {
+	if (!image.error.empty()) {
+		printf("%s\n", image.error.c_str());
+		return;
+	}
+	retiredTextures.push_back({ textureImage, textureImageAllocation, textureImageView, (uint32_t)MAX_FRAMES_IN_FLIGHT });
+	textureImage = image.image;
+	textureImageAllocation = image.allocation;
+	textureImageView = createImageView(textureImage, image.format, VK_IMAGE_ASPECT_COLOR_BIT, image.levelCount);
+	textureGeneration++;
+	printf("Loaded texture '%s' (%ux%u, %u levels): loaded in %.2f ms, ready %.2f ms after the request.\n",
+		image.filename.c_str(), image.extent.width, image.extent.height, image.levelCount, image.decodeMs, image.latencyMs);
+}
+
+// Starts with a 1x1 placeholder so rendering doesn't wait on the texture, which is
+// decoded in the background and swapped in once uploaded, its mip chain generated
+// on the device
 void createTextureImage() {
-    // Reading image from file
-    int tWidth, tHeight, tChannels;
-    stbi_uc* pixels = stbi_load(TEX_FILENAME.c_str(), &tWidth, &tHeight, &tChannels, STBI_rgb_alpha);
-    VkDeviceSize imageSize = tWidth * tHeight * 4;
-    if (!pixels)
-        throw std::runtime_error("Failed to load texture '" + TEX_FILENAME + "'!");
-    // Creating staging buffer
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingBufferMemory;
-    createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-    // Copy pixels to staging buffer
-    void* data;
-    vkMapMemory(logicalDevice, stagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, pixels, (size_t)imageSize);
-    vkUnmapMemory(logicalDevice, stagingBufferMemory);
-    stbi_image_free(pixels);
-    // Create image
-    createImage(tWidth, tHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageMemory);
-    // Transition image layout to transfer destination, copy staging buffer to image, transition to shader read only layout
-    transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    copyBufferToImage(stagingBuffer, textureImage, (uint32_t)tWidth, (uint32_t)tHeight);
-    transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-    // Clean up staging buffer
-    vkDestroyBuffer(logicalDevice, stagingBuffer, nullptr);
-    vkFreeMemory(logicalDevice, stagingBufferMemory, nullptr);
-    // Create image view
-    textureImageView = createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB);
+	if (textureMipmaps && !Talos::supportsLinearBlit(physicalDevice, VK_FORMAT_R8G8B8A8_SRGB)) {
+		printf("Texture format doesn't support linear blits, textures won't be mipmapped.\n");
+		textureMipmaps = false;
+	}
+	const uint32_t placeholder = 0xff808080;
+	createImage(1, 1, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage, textureImageAllocation);
+	stagingRing.uploadImage(textureImage, { 1, 1 }, &placeholder, sizeof(placeholder), VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+	textureImageView = createImageView(textureImage, VK_FORMAT_R8G8B8A8_SRGB);
+	textureCache.create(TEXTURE_CACHE_DIRECTORY);
+	textureLoader.create(allocator, logicalDevice, getQueueFamilies(physicalDevice).graphicsFamily.value(), graphicsQueue, decodeTexture);
+	textureLoader.load(TEX_FILENAME, VK_FORMAT_R8G8B8A8_SRGB, swapTexture, textureMipmaps);
+}
+
+// Called once the frame's fence has been waited on: points its descriptor set at the
+// current texture, and destroys retired textures no frame in flight can still use
+void updateTextureDescriptor() {
+	for (size_t i = 0; i < retiredTextures.size();) {
+		RetiredTexture& retired = retiredTextures[i];
+		if (--retired.frames > 0) {
+			i++;
+			continue;
+		}
+		vkDestroyImageView(logicalDevice, retired.imageView, nullptr);
+		allocator.destroyImage(retired.image, retired.allocation);
+		retiredTextures.erase(retiredTextures.begin() + i);
+	}
+	if (textureSwapRequested) {
+		textureSwapRequested = false;
+		textureIndex = (textureIndex + 1) % TEXTURE_FILENAMES.size();
+		textureLoader.load(TEXTURE_FILENAMES[textureIndex], VK_FORMAT_R8G8B8A8_SRGB, swapTexture, textureMipmaps);
+	}
+	textureLoader.poll();
+	if (descriptorTextureGenerations[currentFrame] == textureGeneration)
+		return;
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageInfo.imageView = textureImageView;
+	imageInfo.sampler = textureSampler;
+	VkWriteDescriptorSet descriptorWrite{};
+	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrite.dstSet = descriptorSets[currentFrame];
+	descriptorWrite.dstBinding = 1;
+	descriptorWrite.dstArrayElement = 0;
+	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrite.descriptorCount = 1;
+	descriptorWrite.pImageInfo = &imageInfo;
+	vkUpdateDescriptorSets(logicalDevice, 1, &descriptorWrite, 0, nullptr);
+	descriptorTextureGenerations[currentFrame] = textureGeneration;
 }
 
 void createTextureSampler() {
@@ -865,16 +1178,18 @@ void createTextureSampler() {
     samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
     samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
     samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    samplerInfo.anisotropyEnable = VK_TRUE;
-    samplerInfo.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
+    float anisotropy = samplerAnisotropy ? std::min(maxAnisotropy, properties.limits.maxSamplerAnisotropy) : 1.0f;
+    samplerInfo.anisotropyEnable = anisotropy > 1.0f ? VK_TRUE : VK_FALSE;
+    samplerInfo.maxAnisotropy = std::max(anisotropy, 1.0f);
     samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
     samplerInfo.unnormalizedCoordinates = VK_FALSE;
     samplerInfo.compareEnable = VK_FALSE;
     samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
     samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-    samplerInfo.mipLodBias = 0.0f;
+    samplerInfo.mipLodBias = clamp(lodBias, -properties.limits.maxSamplerLodBias, properties.limits.maxSamplerLodBias);
     samplerInfo.minLod = 0.0f;
-    samplerInfo.maxLod = 0.0f;
+    // Textures are swapped at runtime, so don't clamp to any one's level count
+    samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
     VkResult res = vkCreateSampler(logicalDevice, &samplerInfo, nullptr, &textureSampler);
     if (res != VK_SUCCESS)
         throw std::runtime_error("Failed to create texture sampler!");
@@ -882,63 +1197,99 @@ void createTextureSampler() {
 
 void createVertexBuffer() {
 	VkDeviceSize bufferSize = sizeof(Vertex) * vertices.size();
-	// Create staging buffer visible to host
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-	// Copy vertices to staging buffer as transfer source buffer, with host visible and coherent memory
-	void* data;
-	vkMapMemory(logicalDevice, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t)bufferSize);
-	vkUnmapMemory(logicalDevice, stagingBufferMemory);
 	// Create vertex buffer as transfer destination buffer, with device local memory
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferMemory);
-	// Copy from staging to vertex buffer 
-	copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-	// Destroy staging buffer and free memory
-	vkDestroyBuffer(logicalDevice, stagingBuffer, nullptr);
-	vkFreeMemory(logicalDevice, stagingBufferMemory, nullptr);
+	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferAllocation);
+	// Queue upload of vertices through the staging ring
+	stagingRing.uploadBuffer(vertexBuffer, 0, vertices.data(), bufferSize);
 }
 
 void createIndexBuffer() {
 	VkDeviceSize bufferSize = sizeof(uint32_t) * indices.size();
-	// Create staging buffer visible to host
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-	// Copy indices to staging buffer as transfer soruce buffer, with host visible and coherent memory
-	void* data;
-	vkMapMemory(logicalDevice, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t)bufferSize);
-	vkUnmapMemory(logicalDevice, stagingBufferMemory);
 	// Create index buffer as transfer destination buffer, with device local memory
-	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
-	// Copy from staging to index buffer
-	copyBuffer(stagingBuffer, indexBuffer, bufferSize);
-	// Destroy staging buffer and free memory
-	vkDestroyBuffer(logicalDevice, stagingBuffer, nullptr);
-	vkFreeMemory(logicalDevice, stagingBufferMemory, nullptr);
+	createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferAllocation);
+	// Queue upload of indices through the staging ring
+	stagingRing.uploadBuffer(indexBuffer, 0, indices.data(), bufferSize);
 }
 
 void createUniformBuffers() {
-	VkDeviceSize bufferSize = sizeof(UniformBufferObject);
-	uniformBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-	uniformBuffersMemory.resize(MAX_FRAMES_IN_FLIGHT);
+	// One persistently mapped region per frame in flight, UBOs are bound by dynamic offset
+	uniformArena.create(allocator, physicalDevice, MAX_FRAMES_IN_FLIGHT);
+}
+
+void createInstances() {
+	// Lay instances out in a cube shaped grid centered on the origin, a single
+	// instance sits at the origin without spinning, matching the non-instanced scene
+	uint32_t side = 1;
+	while (side * side * side < instanceCount)
+		side++;
+	float offset = (side - 1) * INSTANCE_SPACING * 0.5f;
+	for (std::vector<float>* stream : { &instances.x, &instances.y, &instances.z, &instances.spin, &instances.angle })
+		stream->resize(instanceCount);
+	for (uint32_t i = 0; i < instanceCount; i++) {
+		instances.x[i] = (i % side) * INSTANCE_SPACING - offset;
+		instances.y[i] = (i / side % side) * INSTANCE_SPACING - offset;
+		instances.z[i] = (i / (side * side)) * INSTANCE_SPACING - offset;
+		instances.spin[i] = instanceCount > 1 ? (float)(i * 2654435761u % 360u) - 180.0f : 0.0f;
+	}
+	// Matrix generation is split across cores for large grids, on threads that
+	// persist across frames
+	instanceThreads = std::max(1, (int)std::thread::hardware_concurrency());
+	if (ParallelChunkCount(instanceCount, instanceThreads) > 1)
+		instancePool.create((uint32_t)instanceThreads);
+	// Pull the camera back far enough to fit the grid
+	sceneScale = 1.0f + (side - 1) * INSTANCE_SPACING * 0.6f;
+	// One persistently mapped buffer of model matrices per frame in flight
+	VkDeviceSize bufferSize = sizeof(mat4) * instanceCount;
+	instanceBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	instanceBufferAllocations.resize(MAX_FRAMES_IN_FLIGHT);
 	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
-		createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffers[i], uniformBuffersMemory[i]);
+		createBuffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, instanceBuffers[i], instanceBufferAllocations[i]);
+	// Culling pass output, also one set per frame in flight
+	cullBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+	for (CullBuffers& cull : cullBuffers) {
+		createBuffer(sizeof(uint32_t) * instanceCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, cull.visibleBuffer, cull.visibleAllocation);
+		createBuffer(sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, cull.indirectBuffer, cull.indirectAllocation);
+		createBuffer(sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, cull.statsBuffer, cull.statsAllocation);
+	}
+	// Draws recorded per instance pass its index as firstInstance, so their visible
+	// list maps every index to itself
+	if (recordThreads > 0) {
+		std::vector<uint32_t> identity(instanceCount);
+		for (uint32_t i = 0; i < instanceCount; i++)
+			identity[i] = i;
+		for (CullBuffers& cull : cullBuffers)
+			stagingRing.uploadBuffer(cull.visibleBuffer, 0, identity.data(), sizeof(uint32_t) * instanceCount);
+		stagingRing.submit();
+	}
+}
+
+void computeMeshRadius() {
+	// Bound the cube mesh by the sphere through the furthest corner of its AABB
+	std::vector<float> x(vertices.size()), y(vertices.size()), z(vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++) {
+		x[i] = vertices[i].pos.x;
+		y[i] = vertices[i].pos.y;
+		z[i] = vertices[i].pos.z;
+	}
+	vec3 min, max;
+	ComputeAABB(x.data(), y.data(), z.data(), vertices.size(), min, max);
+	vec3 corner(std::max(fabsf(min.x), fabsf(max.x)), std::max(fabsf(min.y), fabsf(max.y)), std::max(fabsf(min.z), fabsf(max.z)));
+	meshRadius = length(corner);
 }
 
 void createDescriptorPool() {
-    std::vector<VkDescriptorPoolSize> poolSizes(2);
-    poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    std::vector<VkDescriptorPoolSize> poolSizes(3);
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     poolSizes[0].descriptorCount = (uint32_t)MAX_FRAMES_IN_FLIGHT;
     poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     poolSizes[1].descriptorCount = (uint32_t)MAX_FRAMES_IN_FLIGHT;
+	poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizes[2].descriptorCount = (uint32_t)MAX_FRAMES_IN_FLIGHT * 5;
 	VkDescriptorPoolCreateInfo poolInfo{};
 	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	poolInfo.poolSizeCount = (uint32_t)poolSizes.size();
 	poolInfo.pPoolSizes = poolSizes.data();
-	poolInfo.maxSets = (uint32_t)MAX_FRAMES_IN_FLIGHT;
+	poolInfo.maxSets = (uint32_t)MAX_FRAMES_IN_FLIGHT * 2;
 	VkResult res = vkCreateDescriptorPool(logicalDevice, &poolInfo, nullptr, &descriptorPool);
 	if (res != VK_SUCCESS)
 		throw std::runtime_error("Failed to create descriptor pool!");
@@ -952,13 +1303,20 @@ void allocateDescriptorSets() {
 	allocInfo.descriptorSetCount = (uint32_t)MAX_FRAMES_IN_FLIGHT;
 	allocInfo.pSetLayouts = layouts.data();
 	descriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+	descriptorTextureGenerations.assign(MAX_FRAMES_IN_FLIGHT, textureGeneration);
 	VkResult res = vkAllocateDescriptorSets(logicalDevice, &allocInfo, descriptorSets.data());
 	if (res != VK_SUCCESS)
 		throw std::runtime_error("Failed to allocate descriptor sets!");
+	std::vector<VkDescriptorSetLayout> cullLayouts(MAX_FRAMES_IN_FLIGHT, cullDescriptorSetLayout);
+	allocInfo.pSetLayouts = cullLayouts.data();
+	cullDescriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+	res = vkAllocateDescriptorSets(logicalDevice, &allocInfo, cullDescriptorSets.data());
+	if (res != VK_SUCCESS)
+		throw std::runtime_error("Failed to allocate cull descriptor sets!");
 	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         // Create UBO descriptor info
 		VkDescriptorBufferInfo bufferInfo{};
-		bufferInfo.buffer = uniformBuffers[i];
+		bufferInfo.buffer = uniformArena.getBuffer();
 		bufferInfo.offset = 0;
 		bufferInfo.range = sizeof(UniformBufferObject);
         // Create sampler descriptor info
@@ -966,13 +1324,27 @@ void allocateDescriptorSets() {
         imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
         imageInfo.imageView = textureImageView;
         imageInfo.sampler = textureSampler;
+		// Create instance buffer descriptor info
+		VkDescriptorBufferInfo instanceInfo{};
+		instanceInfo.buffer = instanceBuffers[i];
+		instanceInfo.offset = 0;
+		instanceInfo.range = VK_WHOLE_SIZE;
+		// Create culling pass buffer descriptor infos
+		VkDescriptorBufferInfo visibleInfo{};
+		visibleInfo.buffer = cullBuffers[i].visibleBuffer;
+		visibleInfo.offset = 0;
+		visibleInfo.range = VK_WHOLE_SIZE;
+		VkDescriptorBufferInfo indirectInfo{};
+		indirectInfo.buffer = cullBuffers[i].indirectBuffer;
+		indirectInfo.offset = 0;
+		indirectInfo.range = VK_WHOLE_SIZE;
         // Create descriptor writes for descriptor set allocations
-        std::vector<VkWriteDescriptorSet> descriptorWrites(2);
+        std::vector<VkWriteDescriptorSet> descriptorWrites(7);
 		descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		descriptorWrites[0].dstSet = descriptorSets[i];
 		descriptorWrites[0].dstBinding = 0;
 		descriptorWrites[0].dstArrayElement = 0;
-		descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		descriptorWrites[0].descriptorCount = 1;
 		descriptorWrites[0].pBufferInfo = &bufferInfo;
         descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -982,6 +1354,24 @@ void allocateDescriptorSets() {
         descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
         descriptorWrites[1].descriptorCount = 1;
         descriptorWrites[1].pImageInfo = &imageInfo;
+		descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[2].dstSet = descriptorSets[i];
+		descriptorWrites[2].dstBinding = 2;
+		descriptorWrites[2].dstArrayElement = 0;
+		descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		descriptorWrites[2].descriptorCount = 1;
+		descriptorWrites[2].pBufferInfo = &instanceInfo;
+		descriptorWrites[3] = descriptorWrites[2];
+		descriptorWrites[3].dstBinding = 3;
+		descriptorWrites[3].pBufferInfo = &visibleInfo;
+		// Culling pass reads instances, writes the visible list and indirect draw
+		const VkDescriptorBufferInfo* cullInfos[] = { &instanceInfo, &visibleInfo, &indirectInfo };
+		for (uint32_t j = 0; j < 3; j++) {
+			descriptorWrites[4 + j] = descriptorWrites[2];
+			descriptorWrites[4 + j].dstSet = cullDescriptorSets[i];
+			descriptorWrites[4 + j].dstBinding = j;
+			descriptorWrites[4 + j].pBufferInfo = cullInfos[j];
+		}
 		vkUpdateDescriptorSets(logicalDevice, (uint32_t)descriptorWrites.size(), descriptorWrites.data(), 0, nullptr);
 	}
 }
@@ -1017,104 +1407,324 @@ void allocateCommandBuffers() {
 		throw std::runtime_error("Failed to create command buffers!");
 }
 
+void destroyRetiredSwapchain(RetiredSwapchain& retired) {
+	for (VkFramebuffer framebuffer : retired.framebuffers)
+		vkDestroyFramebuffer(logicalDevice, framebuffer, nullptr);
+	for (VkImageView imageView : retired.imageViews)
+		vkDestroyImageView(logicalDevice, imageView, nullptr);
+	vkDestroyImageView(logicalDevice, retired.depthImageView, nullptr);
+	allocator.destroyImage(retired.depthImage, retired.depthImageAllocation);
+	if (retired.colorImageView != VK_NULL_HANDLE) {
+		vkDestroyImageView(logicalDevice, retired.colorImageView, nullptr);
+		allocator.destroyImage(retired.colorImage, retired.colorImageAllocation);
+	}
+	vkDestroySwapchainKHR(logicalDevice, retired.swapchain, nullptr);
+}
+
+// Counts down the frames retired swapchains wait on, destroying those done with.
+// Called once per frame, after its fence has been waited on.
+void releaseRetiredSwapchains() {
+	for (size_t i = 0; i < retiredSwapchains.size();) {
+		if (--retiredSwapchains[i].frames > 0) {
+			i++;
+			continue;
+		}
+		destroyRetiredSwapchain(retiredSwapchains[i]);
+		retiredSwapchains.erase(retiredSwapchains.begin() + i);
+	}
+}
+
+// Replaces the swapchain after a resize, handing the old one over through
+// oldSwapchain, and rebuilds only what's sized to it: image views, depth and MSAA
+// color targets and framebuffers. The old ones are retired instead of waiting for
+// the device to idle. The render pass, pipelines, descriptors and uniforms carry
+// over, viewport and scissor being dynamic.
 void recreateSwapchain() {
+	TALOS_ZONE("recreate swapchain");
 	int width = 0, height = 0;
 	glfwGetFramebufferSize(window, &width, &height);
 	while (width == 0 || height == 0) {
 		glfwGetFramebufferSize(window, &width, &height);
 		glfwWaitEvents();
 	}
-	// Wait for device to idle
-	vkDeviceWaitIdle(logicalDevice);
-	// Clean up previous swapchain related resources
-	for (size_t i = 0; i < swapchainFramebuffers.size(); i++)
-		vkDestroyFramebuffer(logicalDevice, swapchainFramebuffers[i], nullptr);
-	vkDestroyPipeline(logicalDevice, graphicsPipeline, nullptr);
-	vkDestroyPipelineLayout(logicalDevice, pipelineLayout, nullptr);
-	vkDestroyRenderPass(logicalDevice, renderPass, nullptr);
-	for (size_t i = 0; i < swapchainImageViews.size(); i++)
-		vkDestroyImageView(logicalDevice, swapchainImageViews[i], nullptr);
-	vkDestroySwapchainKHR(logicalDevice, swapchain, nullptr);
-	for (size_t i = 0; i < uniformBuffers.size(); i++) {
-		vkDestroyBuffer(logicalDevice, uniformBuffers[i], nullptr);
-		vkFreeMemory(logicalDevice, uniformBuffersMemory[i], nullptr);
-	}
-	vkDestroyDescriptorPool(logicalDevice, descriptorPool, nullptr);
-	// Recreate swapchain and dependent resources
+	// Frames in flight may still render to the old images, and the last present of
+	// the old swapchain isn't covered by any fence, so it waits on one more frame
+	retiredSwapchains.push_back({ swapchain, swapchainImageViews, swapchainFramebuffers, depthImage, depthImageAllocation, depthImageView,
+		colorImage, colorImageAllocation, colorImageView, (uint32_t)MAX_FRAMES_IN_FLIGHT + 1 });
+	colorImageView = VK_NULL_HANDLE;
+	VkFormat previousFormat = swapchainImageFormat;
 	createSwapchain();
 	createImageViews();
-	createRenderPass();
-	createGraphicsPipeline();
+	// A different surface format needs a new render pass and pipeline, rare enough
+	// to wait on the frames in flight for
+	if (swapchainImageFormat != previousFormat) {
+		vkWaitForFences(logicalDevice, (uint32_t)inFlightFences.size(), inFlightFences.data(), VK_TRUE, UINT64_MAX);
+		vkDestroyPipeline(logicalDevice, graphicsPipeline, nullptr);
+		vkDestroyPipelineLayout(logicalDevice, pipelineLayout, nullptr);
+		vkDestroyRenderPass(logicalDevice, renderPass, nullptr);
+		createRenderPass();
+		createGraphicsPipeline();
+	}
+	createColorResources();
+	createDepthResources();
 	createFramebuffers();
-	createUniformBuffers();
-	createDescriptorPool();
-	allocateDescriptorSets();
-	allocateCommandBuffers();
 }
 
-void copyUniformBuffer(UniformBufferObject ubo, VkDeviceMemory bufferMem) {
-	void* data;
-	vkMapMemory(logicalDevice, bufferMem, 0, sizeof(ubo), 0, &data);
-	memcpy(data, &ubo, sizeof(ubo));
-	vkUnmapMemory(logicalDevice, bufferMem);
+// Extracts the frustum planes of a view projection matrix, normalized so that a
+// plane's distance to a point is in world units
+void extractFrustumPlanes(const mat4& m, vec4 planes[6]) {
+	planes[0] = m[3] + m[0]; // left
+	planes[1] = m[3] - m[0]; // right
+	planes[2] = m[3] + m[1]; // bottom
+	planes[3] = m[3] - m[1]; // top
+	planes[4] = m[3] + m[2]; // near
+	planes[5] = m[3] - m[2]; // far
+	for (int i = 0; i < 6; i++)
+		planes[i] = planes[i] / length(vec3(planes[i].x, planes[i].y, planes[i].z));
 }
 
-void drawFrame() {
-	VkResult res;
-	VkDeviceSize offset = 0;
-	// Wait for frame to stop being in flight
-	vkWaitForFences(logicalDevice, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
-	// Acquire next swapchain image
-	uint32_t imageIndex;
-	res = vkAcquireNextImageKHR(logicalDevice, swapchain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
-	if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR || framebufferResized) {
-		framebufferResized = false;
-		recreateSwapchain();
+// Writes the frame's UBO straight into the uniform arena, returning the dynamic
+// offset to bind it at. Also updates the culling pass's frustum to match.
+uint32_t updateUniformBuffer(float t) {
+	uint32_t offset;
+	UniformBufferObject* ubo = uniformArena.allocate<UniformBufferObject>(&offset);
+	mat4 view = LookAt(vec3(2, 2, 2) * sceneScale, vec3(0, 0, 0), vec3(0, 0, 1));
+	mat4 proj = Perspective(45, swapchainExtent.width / (float)swapchainExtent.height, 0.1f, 10.0f * sceneScale);
+	ubo->model = Scale(size, size, size) * RotateY(t * 90.0f) * RotateX(t * 90.0f);
+	ubo->view = Transpose(view);
+	ubo->proj = Transpose(proj);
+	ubo->proj[1][1] *= -1;
+	// Instances are spun around their center, so the mesh's bounding sphere bounds them at any angle
+	extractFrustumPlanes(proj * view, cullParams.planes);
+	cullParams.instanceCount = instanceCount;
+	cullParams.radius = size * meshRadius;
+	return offset;
+}
+
+// Adds the visible instance count from the frame's previous use, whose fence has
+// been waited on, to the stats
+void readCullStats() {
+	CullBuffers& cull = cullBuffers[currentFrame];
+	if (!cull.pending)
 		return;
-	} else if (res != VK_SUCCESS)
-		throw std::runtime_error("Failed to acquire swapchain image!");
-	// Reset in flight fences so next frame can begin rendering
-	vkResetFences(logicalDevice, 1, &inFlightFences[currentFrame]);
+	frameStats.visibleInstances += *(const uint32_t*)cull.statsAllocation.mapped;
+	frameStats.cullSamples++;
+	cull.pending = false;
+}
+
+// ParallelExecutor running VecMat's batch chunks on instancePool
+void runOnInstancePool(size_t chunks, const std::function<void(size_t)>& fn) {
+	instancePool.parallelFor(chunks, 1, [&fn](size_t begin, size_t end, uint32_t) {
+		for (size_t chunk = begin; chunk < end; chunk++)
+			fn(chunk);
+	});
+}
+
+// Writes every instance's model matrix, transposed for the shader, straight into
+// the frame's instance buffer
+void updateInstances(float t) {
+	TALOS_ZONE("update instances");
+	Clock::time_point start = Clock::now();
+	mat4* models = (mat4*)instanceBufferAllocations[currentFrame].mapped;
+	for (uint32_t i = 0; i < instanceCount; i++)
+		instances.angle[i] = t * instances.spin[i];
+	TranslateRotate(instances.x.data(), instances.y.data(), instances.z.data(), instances.angle.data(), vec3(0, 0, 1), models, instanceCount, true, instanceThreads, runOnInstancePool);
+	frameStats.instanceMs += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Counts a drawn frame for the benchmark, keeping its times once past the warmup
+// frames. Frame times run from the end of one frame to the end of the next.
+void recordBenchmarkFrame(double cpuMs) {
+	Clock::time_point now = Clock::now();
+	if (benchmark.frame >= benchmark.warmupFrames) {
+		benchmark.cpuMs.push_back(cpuMs);
+		if (benchmark.frame > 0)
+			benchmark.frameMs.push_back(std::chrono::duration<double, std::milli>(now - benchmark.lastFrame).count());
+	}
+	benchmark.lastFrame = now;
+	benchmark.frame++;
+}
+
+// Prints average frame and CPU times once a second, then starts a new interval
+void reportFrameStats() {
+	frameStats.frames++;
+	double intervalMs = std::chrono::duration<double, std::milli>(Clock::now() - frameStats.intervalStart).count();
+	if (intervalMs < 1000.0)
+		return;
+	double visible = frameStats.cullSamples > 0 ? (double)frameStats.visibleInstances / frameStats.cullSamples : 0.0;
+	printf("%u instances (%.0f visible, %.0f culled): %.2f ms/frame (%.1f fps), CPU %.2f ms/frame (%.2f ms instance update)\n",
+		instanceCount, visible, instanceCount - visible, intervalMs / frameStats.frames, frameStats.frames * 1000.0 / intervalMs,
+		frameStats.cpuMs / frameStats.frames, frameStats.instanceMs / frameStats.frames);
+	frameStats = FrameStats{};
+}
+
+// Records the frame's culling pass, appending visible instances to its indirect draw
+void recordCulling() {
+	gpuProfiler.beginScope(commandBuffers[currentFrame], "cull");
+	// Reset the frame's indirect draw to zero instances
+	CullBuffers& cull = cullBuffers[currentFrame];
+	VkDrawIndexedIndirectCommand drawCommand{};
+	drawCommand.indexCount = (uint32_t)indices.size();
+	vkCmdUpdateBuffer(commandBuffers[currentFrame], cull.indirectBuffer, 0, sizeof(drawCommand), &drawCommand);
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffers[currentFrame], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+	// Cull instances against the frustum, appending visible ones to the indirect draw
+	vkCmdBindPipeline(commandBuffers[currentFrame], VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+	vkCmdBindDescriptorSets(commandBuffers[currentFrame], VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &cullDescriptorSets[currentFrame], 0, nullptr);
+	vkCmdPushConstants(commandBuffers[currentFrame], cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullParams), &cullParams);
+	vkCmdDispatch(commandBuffers[currentFrame], (instanceCount + 63) / 64, 1, 1);
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffers[currentFrame], VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+	// Copy the visible count out for the stats
+	VkBufferCopy statsCopy{};
+	statsCopy.srcOffset = offsetof(VkDrawIndexedIndirectCommand, instanceCount);
+	statsCopy.dstOffset = 0;
+	statsCopy.size = sizeof(uint32_t);
+	vkCmdCopyBuffer(commandBuffers[currentFrame], cull.indirectBuffer, cull.statsBuffer, 1, &statsCopy);
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffers[currentFrame], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+	cull.pending = true;
+	gpuProfiler.endScope(commandBuffers[currentFrame]);
+}
+
+// Binds the graphics pipeline and the frame's drawing resources into cmd
+void bindDrawState(VkCommandBuffer cmd, uint32_t uniformOffset) {
+	VkDeviceSize offset = 0;
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+	VkViewport viewport{};
+	viewport.width = (float)swapchainExtent.width;
+	viewport.height = (float)swapchainExtent.height;
+	viewport.maxDepth = 1.0f;
+	vkCmdSetViewport(cmd, 0, 1, &viewport);
+	VkRect2D scissor{ { 0, 0 }, swapchainExtent };
+	vkCmdSetScissor(cmd, 0, 1, &scissor);
+	vkCmdBindVertexBuffers(cmd, 0, 1, &vertexBuffer, &offset);
+	vkCmdBindIndexBuffer(cmd, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentFrame], 1, &uniformOffset);
+}
+
+// Records a draw per instance inside the frame's frustum, culled on the CPU, across
+// the record threads. Each chunk of instances is recorded into its own secondary
+// command buffer, executed in order from the frame's command buffer.
+void recordInstanceDraws(VkFramebuffer framebuffer, uint32_t uniformOffset) {
+	commandRecorder.beginFrame(currentFrame);
+	VkCommandBufferInheritanceInfo inheritance{};
+	inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritance.renderPass = renderPass;
+	inheritance.subpass = 0;
+	inheritance.framebuffer = framebuffer;
+	// A few chunks per thread, so stealing evens out uneven culling
+	size_t grain = std::max<size_t>(64, instanceCount / (commandRecorder.getWorkerCount() * 4));
+	std::atomic<uint32_t> visibleCount{ 0 };
+	const std::vector<VkCommandBuffer>& secondaries = commandRecorder.record(instanceCount, grain, inheritance, [&](VkCommandBuffer cmd, size_t begin, size_t end, uint32_t worker) {
+		TALOS_ZONE("record instances");
+		bindDrawState(cmd, uniformOffset);
+		uint32_t visible = 0;
+		for (size_t i = begin; i < end; i++) {
+			// Same bounding sphere test as the culling shader
+			bool inside = true;
+			for (int p = 0; p < 6 && inside; p++) {
+				const vec4& plane = cullParams.planes[p];
+				inside = plane.x * instances.x[i] + plane.y * instances.y[i] + plane.z * instances.z[i] + plane.w >= -cullParams.radius;
+			}
+			if (!inside)
+				continue;
+			vkCmdDrawIndexed(cmd, (uint32_t)indices.size(), 1, 0, 0, (uint32_t)i);
+			visible++;
+		}
+		visibleCount += visible;
+	});
+	vkCmdExecuteCommands(commandBuffers[currentFrame], (uint32_t)secondaries.size(), secondaries.data());
+	frameStats.visibleInstances += visibleCount;
+	frameStats.cullSamples++;
+}
+
+void recordCommandBuffer(VkFramebuffer framebuffer, uint32_t uniformOffset) {
+	TALOS_ZONE("record");
+	VkResult res;
 	// Setup command buffer to begin
 	VkCommandBufferBeginInfo beginInfo{};
 	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 	beginInfo.flags = 0;
 	beginInfo.pInheritanceInfo = nullptr;
 	// Setup render pass
-	VkClearValue clearColor = { {{ 0.0f, 0.0f, 0.0f, 1.0f }} };
+	VkClearValue clearValues[2]{};
+	clearValues[0].color = { {0.0f, 0.0f, 0.0f, 1.0f} };
+	clearValues[1].depthStencil = { 1.0f, 0 };
 	VkRenderPassBeginInfo renderPassInfo{};
 	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
 	renderPassInfo.renderPass = renderPass;
-	renderPassInfo.framebuffer = swapchainFramebuffers[imageIndex];
+	renderPassInfo.framebuffer = framebuffer;
 	renderPassInfo.renderArea.offset = { 0, 0 };
 	renderPassInfo.renderArea.extent = swapchainExtent;
-	renderPassInfo.clearValueCount = 1;
-	renderPassInfo.pClearValues = &clearColor;
-	// Create and copy UBO
-    static Clock::time_point startTime = Clock::now();
-    Clock::time_point now = Clock::now();
-    float dt = std::chrono::duration<float, Period>(now - startTime).count();
-    UniformBufferObject ubo{};
-	ubo.model = Scale(size, size, size) * RotateY(dt * 90.0f) * RotateX(dt * 90.0f);
-	ubo.view = Transpose(LookAt(vec3(2, 2, 2), vec3(0, 0, 0), vec3(0, 0, 1)));
-	ubo.proj = Transpose(Perspective(45, swapchainExtent.width / (float)swapchainExtent.height, 0.1f, 10.0f));
-	ubo.proj[1][1] *= -1;
-	copyUniformBuffer(ubo, uniformBuffersMemory[currentFrame]);
-	// Bind graphics pipeline and other drawing resources
+	renderPassInfo.clearValueCount = 2;
+	renderPassInfo.pClearValues = clearValues;
 	vkResetCommandBuffer(commandBuffers[currentFrame], 0);
 	res = vkBeginCommandBuffer(commandBuffers[currentFrame], &beginInfo);
 	if (res != VK_SUCCESS)
 		throw std::runtime_error("Failed to begin recording to command buffer!");
-	vkCmdBindPipeline(commandBuffers[currentFrame], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-	vkCmdBindVertexBuffers(commandBuffers[currentFrame], 0, 1, &vertexBuffer, &offset);
-	vkCmdBindIndexBuffer(commandBuffers[currentFrame], indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-	vkCmdBindDescriptorSets(commandBuffers[currentFrame], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSets[currentFrame], 0, nullptr);
-	vkCmdBeginRenderPass(commandBuffers[currentFrame], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
-	vkCmdDrawIndexed(commandBuffers[currentFrame], (uint32_t)indices.size(), 1, 0, 0, 0);
+	gpuProfiler.beginFrame(commandBuffers[currentFrame]);
+	// Per instance draws cull on the CPU while recording instead
+	if (recordThreads == 0)
+		recordCulling();
+	gpuProfiler.beginScope(commandBuffers[currentFrame], "draw");
+	if (recordThreads > 0) {
+		vkCmdBeginRenderPass(commandBuffers[currentFrame], &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		recordInstanceDraws(framebuffer, uniformOffset);
+	} else {
+		bindDrawState(commandBuffers[currentFrame], uniformOffset);
+		vkCmdBeginRenderPass(commandBuffers[currentFrame], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+		vkCmdDrawIndexedIndirect(commandBuffers[currentFrame], cullBuffers[currentFrame].indirectBuffer, 0, 1, sizeof(VkDrawIndexedIndirectCommand));
+	}
 	vkCmdEndRenderPass(commandBuffers[currentFrame]);
+	gpuProfiler.endScope(commandBuffers[currentFrame]);
 	res = vkEndCommandBuffer(commandBuffers[currentFrame]);
 	if (res != VK_SUCCESS)
 		throw std::runtime_error("Failed to finalize recording command buffer!");
+}
+
+void drawFrame() {
+	TALOS_ZONE("frame");
+	VkResult res;
+	// Wait for frame to stop being in flight
+	{
+		TALOS_ZONE("wait for fence");
+		vkWaitForFences(logicalDevice, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+	}
+	// Acquire next swapchain image
+	uint32_t imageIndex;
+	{
+		TALOS_ZONE("acquire");
+		res = vkAcquireNextImageKHR(logicalDevice, swapchain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+	}
+	// A suboptimal swapchain still presents, it's recreated after this frame
+	if (res == VK_ERROR_OUT_OF_DATE_KHR) {
+		recreateSwapchain();
+		return;
+	} else if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR)
+		throw std::runtime_error("Failed to acquire swapchain image!");
+	// Reset in flight fences so next frame can begin rendering
+	vkResetFences(logicalDevice, 1, &inFlightFences[currentFrame]);
+	releaseRetiredSwapchains();
+	readCullStats();
+	updateTextureDescriptor();
+	// Write UBO and instances into the frame's buffers, no longer in use by the device
+    static Clock::time_point startTime = Clock::now();
+    Clock::time_point now = Clock::now();
+    float dt = std::chrono::duration<float, Period>(now - startTime).count();
+	// Benchmarks animate at a fixed timestep, so every run draws the same frames
+	if (benchmark.frames > 0)
+		dt = benchmark.frame * benchmark.timestep;
+	uniformArena.beginFrame(currentFrame);
+	uint32_t uniformOffset = updateUniformBuffer(dt);
+	updateInstances(dt);
+	// Record drawing commands into the frame's command buffer
+	recordCommandBuffer(swapchainFramebuffers[imageIndex], uniformOffset);
 	// Submit command buffer
 	VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame] };
 	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
@@ -1128,9 +1738,14 @@ void drawFrame() {
 	submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
 	submitInfo.signalSemaphoreCount = 1;
 	submitInfo.pSignalSemaphores = signalSemaphores;
-	res = vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]);
+	{
+		TALOS_ZONE("submit");
+		res = vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]);
+	}
 	if (res != VK_SUCCESS)
 		throw std::runtime_error("Failed to submit draw command buffer!");
+	double cpuMs = std::chrono::duration<double, std::milli>(Clock::now() - now).count();
+	frameStats.cpuMs += cpuMs;
 	// Present result to swapchain
 	VkPresentInfoKHR presentInfo{};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1140,79 +1755,418 @@ void drawFrame() {
 	presentInfo.pSwapchains = &swapchain;
 	presentInfo.pImageIndices = &imageIndex;
 	presentInfo.pResults = nullptr;
-	vkQueuePresentKHR(presentQueue, &presentInfo);
+	{
+		TALOS_ZONE("present");
+		res = vkQueuePresentKHR(presentQueue, &presentInfo);
+	}
+	if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR || framebufferResized) {
+		framebufferResized = false;
+		recreateSwapchain();
+	} else if (res != VK_SUCCESS)
+		throw std::runtime_error("Failed to present swapchain image!");
+	reportFrameStats();
+	if (benchmark.frames > 0)
+		recordBenchmarkFrame(cpuMs);
+	if (!cpuTraceFilename.empty())
+		Talos::collectTrace();
 	currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
 }
 
-int main() {
-	// GLFW setup
-	if (!glfwInit()) { printf("Error initializing GLFW! Exiting...\n"); return 1; }
-	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-	window = glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, "Vulkan Playground", nullptr, nullptr);
-	if (!window) { printf("Failed to create GLFW window! Exiting...\n"); glfwTerminate(); return 1; }
-	glfwSetKeyCallback(window, kbdCallback);
-	glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
-	glfwSetScrollCallback(window, scrollCallback);
-	// Vulkan setup
-	createVkInstance();
-	createSurface();
-	selectPhysicalDevice();
-	createLogicalDevice();
-	createSwapchain();
-	createImageViews();
-	createRenderPass();
-	createDescriptorSetLayout();
-	createGraphicsPipeline();
-	createFramebuffers();
-	createCommandPool();
-    createTextureImage();
-    createTextureSampler();
-	createVertexBuffer();
-	createIndexBuffer();
-	createUniformBuffers();
-	createDescriptorPool();
-	allocateDescriptorSets();
-	allocateCommandBuffers();
-	createSyncObjects();
-	// Render loop
-	while(!glfwWindowShouldClose(window)) {
-		drawFrame();
-		glfwPollEvents();
+// Renders a frame into the offscreen target at time t, then queues a readback of
+// it if there's a callback for it. No semaphores needed, the readback is submitted
+// to the same queue.
+void drawFrameHeadless(float t, Talos::ReadbackCallback callback) {
+	TALOS_ZONE("frame");
+	// Wait for frame to stop being in flight
+	{
+		TALOS_ZONE("wait for fence");
+		vkWaitForFences(logicalDevice, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+	}
+	vkResetFences(logicalDevice, 1, &inFlightFences[currentFrame]);
+	readCullStats();
+	updateTextureDescriptor();
+	Clock::time_point cpuStart = Clock::now();
+	uniformArena.beginFrame(currentFrame);
+	uint32_t uniformOffset = updateUniformBuffer(t);
+	updateInstances(t);
+	recordCommandBuffer(offscreenTarget.framebuffer, uniformOffset);
+	// Submit command buffer
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+	VkResult res;
+	{
+		TALOS_ZONE("submit");
+		res = vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]);
+	}
+	if (res != VK_SUCCESS)
+		throw std::runtime_error("Failed to submit draw command buffer!");
+	double cpuMs = std::chrono::duration<double, std::milli>(Clock::now() - cpuStart).count();
+	frameStats.cpuMs += cpuMs;
+	// Read back rendered image
+	if (callback)
+		readbackRing.readImage(offscreenTarget.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, offscreenTarget.extent, 4, callback);
+	readbackRing.poll();
+	if (benchmark.frames > 0)
+		recordBenchmarkFrame(cpuMs);
+	if (!cpuTraceFilename.empty())
+		Talos::collectTrace();
+	currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+}
+
+// Prints the GPU time table of the frames so far and writes their trace if asked
+// to, once the device is idle
+void reportGpuProfile() {
+	gpuProfiler.collect();
+	gpuProfiler.printTable();
+	if (gpuTraceFilename.empty() || !gpuProfiler.enabled())
+		return;
+	if (gpuProfiler.writeChromeTrace(gpuTraceFilename, "triangle"))
+		printf("Wrote GPU trace to '%s'.\n", gpuTraceFilename.c_str());
+	else
+		printf("Failed to write '%s'!\n", gpuTraceFilename.c_str());
+}
+
+TimeStats summarizeTimes(std::vector<double> times) {
+	TimeStats stats;
+	stats.count = times.size();
+	if (times.empty())
+		return stats;
+	std::sort(times.begin(), times.end());
+	double sum = 0.0;
+	for (double time : times)
+		sum += time;
+	// Nearest rank percentiles
+	auto percentile = [&times](double p) {
+		size_t rank = (size_t)std::ceil(p / 100.0 * times.size());
+		return times[rank > 0 ? rank - 1 : 0];
+	};
+	stats.min = times.front();
+	stats.avg = sum / times.size();
+	stats.p50 = percentile(50);
+	stats.p95 = percentile(95);
+	stats.p99 = percentile(99);
+	stats.max = times.back();
+	return stats;
+}
+
+// Prints the benchmark's CPU, frame and GPU time distributions and writes them as
+// JSON if asked to, once the device is idle. GPU times come from the profiler's
+// frame scope, missing if the queue has no timestamps.
+void reportBenchmark() {
+	gpuProfiler.collect();
+	std::vector<double> gpuMs;
+	const std::vector<std::string>& scopeNames = gpuProfiler.getScopeNames();
+	uint32_t frameScope = (uint32_t)(std::find(scopeNames.begin(), scopeNames.end(), "frame") - scopeNames.begin());
+	for (const Talos::GpuScopeSample& sample : gpuProfiler.getSamples())
+		if (sample.name == frameScope && sample.frame >= benchmark.warmupFrames)
+			gpuMs.push_back(sample.durationMs);
+	const char* SERIES_NAMES[] = { "cpu", "frame", "gpu" };
+	TimeStats series[] = { summarizeTimes(benchmark.cpuMs), summarizeTimes(benchmark.frameMs), summarizeTimes(gpuMs) };
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	printf("Benchmark of %u frames (%u warmup) at %ux%u, %u instances, %ux MSAA, %s on '%s':\n", (uint32_t)benchmark.cpuMs.size(), benchmark.warmupFrames,
+		swapchainExtent.width, swapchainExtent.height, instanceCount, (uint32_t)msaaSamples, headless ? "headless" : "windowed", properties.deviceName);
+	printf("\t%-8s %10s %10s %10s %10s %10s %10s\n", "", "min", "avg", "p50", "p95", "p99", "max");
+	for (size_t i = 0; i < 3; i++) {
+		const TimeStats& stats = series[i];
+		if (stats.count == 0)
+			printf("\t%-8s %10s\n", SERIES_NAMES[i], "n/a");
+		else
+			printf("\t%-8s %7.3f ms %7.3f ms %7.3f ms %7.3f ms %7.3f ms %7.3f ms\n", SERIES_NAMES[i], stats.min, stats.avg, stats.p50, stats.p95, stats.p99, stats.max);
+	}
+	if (benchmark.jsonFilename.empty())
+		return;
+	// A single line, so it can be picked out of stdout
+	FILE* file = benchmark.jsonFilename == "-" ? stdout : fopen(benchmark.jsonFilename.c_str(), "w");
+	if (!file) {
+		printf("Failed to write '%s'!\n", benchmark.jsonFilename.c_str());
+		return;
+	}
+	fprintf(file, "{\"device\":\"%s\",\"headless\":%s,\"frames\":%u,\"warmup_frames\":%u,\"timestep\":%g,\"width\":%u,\"height\":%u,\"instances\":%u,\"msaa\":%u",
+		Talos::escapeJson(properties.deviceName).c_str(), headless ? "true" : "false", (uint32_t)benchmark.cpuMs.size(), benchmark.warmupFrames, benchmark.timestep,
+		swapchainExtent.width, swapchainExtent.height, instanceCount, (uint32_t)msaaSamples);
+	for (size_t i = 0; i < 3; i++) {
+		const TimeStats& stats = series[i];
+		if (stats.count == 0)
+			fprintf(file, ",\"%s_ms\":null", SERIES_NAMES[i]);
+		else
+			fprintf(file, ",\"%s_ms\":{\"min\":%.4f,\"avg\":%.4f,\"p50\":%.4f,\"p95\":%.4f,\"p99\":%.4f,\"max\":%.4f}",
+				SERIES_NAMES[i], stats.min, stats.avg, stats.p50, stats.p95, stats.p99, stats.max);
+	}
+	fprintf(file, "}\n");
+	if (file == stdout)
+		fflush(stdout);
+	else if (fclose(file) == 0)
+		printf("Wrote benchmark results to '%s'.\n", benchmark.jsonFilename.c_str());
+	else
+		printf("Failed to write '%s'!\n", benchmark.jsonFilename.c_str());
+}
+
+// Prints the CPU zone table and writes the trace of every zone recorded
+void reportCpuTrace() {
+	if (!Talos::traceEnabled()) {
+		printf("CPU tracing is compiled out, rebuild with -DTALOS_ENABLE_TRACING to write '%s'.\n", cpuTraceFilename.c_str());
+		return;
+	}
+	Talos::collectTrace();
+	Talos::printTraceSummary();
+	if (Talos::writeTrace(cpuTraceFilename, "triangle"))
+		printf("Wrote CPU trace to '%s' (%llu zones dropped).\n", cpuTraceFilename.c_str(), (unsigned long long)Talos::traceDroppedZones());
+	else
+		printf("Failed to write '%s'!\n", cpuTraceFilename.c_str());
+}
+
+void printUsage(const char* program) {
+	printf("Usage: %s [--headless] [--frames N] [--output FILE.ppm] [--instances N] [--cold-texture-cache] [--bench-textures N]\n", program);
+	printf("\t[--no-mipmaps] [--anisotropy N] [--lod-bias BIAS] [--profile-gpu] [--pipeline-stats] [--gpu-trace FILE.json]\n");
+	printf("\t[--cpu-trace FILE.json] [--resolution WxH] [--msaa N] [--record-threads N] [--bench N] [--warmup N] [--timestep SECONDS] [--bench-json FILE.json|-]\n");
+}
+
+int main(int argc, char** argv) {
+	// Parse arguments
+	uint32_t headlessFrames = 60;
+	std::string outputFilename = "triangle.ppm";
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--headless") == 0)
+			headless = true;
+		else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			headlessFrames = (uint32_t)atoi(argv[++i]);
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+			outputFilename = argv[++i];
+		else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc)
+			instanceCount = (uint32_t)std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--cold-texture-cache") == 0)
+			coldTextureCache = true;
+		else if (strcmp(argv[i], "--no-mipmaps") == 0)
+			textureMipmaps = false;
+		else if (strcmp(argv[i], "--anisotropy") == 0 && i + 1 < argc)
+			maxAnisotropy = (float)atof(argv[++i]); // 1 disables anisotropic filtering
+		else if (strcmp(argv[i], "--lod-bias") == 0 && i + 1 < argc)
+			lodBias = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--profile-gpu") == 0)
+			gpuProfiling = true;
+		else if (strcmp(argv[i], "--pipeline-stats") == 0)
+			gpuProfiling = pipelineStatistics = true;
+		else if (strcmp(argv[i], "--gpu-trace") == 0 && i + 1 < argc) {
+			gpuProfiling = true;
+			gpuTraceFilename = argv[++i];
+		}
+		else if (strcmp(argv[i], "--cpu-trace") == 0 && i + 1 < argc)
+			cpuTraceFilename = argv[++i];
+		else if (strcmp(argv[i], "--resolution") == 0 && i + 1 < argc) {
+			if (sscanf(argv[++i], "%ux%u", &windowWidth, &windowHeight) != 2 || windowWidth == 0 || windowHeight == 0) {
+				printf("Resolution must be given as WIDTHxHEIGHT!\n");
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "--record-threads") == 0 && i + 1 < argc)
+			recordThreads = (uint32_t)std::max(0, atoi(argv[++i])); // 0 uses GPU culling and a single indirect draw
+		else if (strcmp(argv[i], "--msaa") == 0 && i + 1 < argc)
+			requestedSamples = (uint32_t)std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+			benchmark.frames = (uint32_t)std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+			benchmark.warmupFrames = (uint32_t)std::max(0, atoi(argv[++i]));
+		else if (strcmp(argv[i], "--timestep") == 0 && i + 1 < argc)
+			benchmark.timestep = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--bench-json") == 0 && i + 1 < argc)
+			benchmark.jsonFilename = argv[++i];
+		else if (strcmp(argv[i], "--bench-textures") == 0 && i + 1 < argc) {
+			// Needs no device, runs on its own
+			benchmarkTextureCache(std::max(1, atoi(argv[++i])));
+			return 0;
+		}
+		else { printUsage(argv[0]); return 1; }
+	}
+	// Benchmarks draw their warmup and measured frames, headless or not
+	if (benchmark.frames > 0)
+		headlessFrames = benchmark.warmupFrames + benchmark.frames;
+	TALOS_TRACE_THREAD("main");
+	{
+		TALOS_ZONE("initialize");
+		// GLFW setup
+		if (!headless) {
+			if (!glfwInit()) { printf("Error initializing GLFW! Exiting...\n"); return 1; }
+			glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+			window = glfwCreateWindow(windowWidth, windowHeight, "Vulkan Playground", nullptr, nullptr);
+			if (!window) { printf("Failed to create GLFW window! Exiting...\n"); glfwTerminate(); return 1; }
+			glfwSetKeyCallback(window, kbdCallback);
+			glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+			glfwSetScrollCallback(window, scrollCallback);
+		}
+		// Vulkan setup
+		createVkInstance();
+		if (!headless)
+			createSurface();
+		selectPhysicalDevice();
+		createLogicalDevice();
+		allocator.create(physicalDevice, logicalDevice);
+		pipelineCache.create(physicalDevice, logicalDevice, PIPELINE_CACHE_FILENAME);
+		if (!headless) {
+			createSwapchain();
+			createImageViews();
+		} else {
+			// Render to an offscreen image of the window's size instead
+			swapchainImageFormat = OFFSCREEN_FORMAT;
+			swapchainExtent = { windowWidth, windowHeight };
+		}
+		depthFormat = findDepthFormat();
+		createColorResources();
+		createDepthResources();
+		createRenderPass();
+		createDescriptorSetLayout();
+		// Time pipeline creation to compare cold and warm pipeline cache starts
+		Clock::time_point pipelineStart = Clock::now();
+		createGraphicsPipeline();
+		printf("Graphics pipeline created in %.2f ms (%s pipeline cache).\n",
+			std::chrono::duration<double, std::milli>(Clock::now() - pipelineStart).count(), pipelineCache.warm ? "warm" : "cold");
+		createCullPipeline();
+		if (!headless)
+			createFramebuffers();
+		else
+			offscreenTarget = Talos::createOffscreenTarget(allocator, logicalDevice, renderPass, swapchainImageFormat, swapchainExtent, depthImageView, colorImageView);
+		createCommandPool();
+		// Scene uploads are batched into a single staging submission
+		stagingRing.create(allocator, logicalDevice, getQueueFamilies(physicalDevice).graphicsFamily.value(), graphicsQueue);
+		createTextureImage();
+		createTextureSampler();
+		createVertexBuffer();
+		createIndexBuffer();
+		stagingRing.submit();
+		createUniformBuffers();
+		createInstances();
+		computeMeshRadius();
+		createDescriptorPool();
+		allocateDescriptorSets();
+		allocateCommandBuffers();
+		createSyncObjects();
+		// Frame slots come around again once their fence has been waited on, benchmarks
+		// take their GPU frame times from it
+		if (gpuProfiling || benchmark.frames > 0)
+			gpuProfiler.create(physicalDevice, logicalDevice, getQueueFamilies(physicalDevice).graphicsFamily.value(), MAX_FRAMES_IN_FLIGHT, pipelineStatistics);
+		// Each record thread gets a command pool per frame in flight
+		if (recordThreads > 0) {
+			recordPool.create(recordThreads);
+			commandRecorder.create(logicalDevice, getQueueFamilies(physicalDevice).graphicsFamily.value(), MAX_FRAMES_IN_FLIGHT, recordPool);
+		}
+	}
+	allocator.printStats();
+	if (!headless) {
+		// Render loop
+		// Benchmarks start with the real texture in place, as headless runs do
+		if (benchmark.frames > 0)
+			textureLoader.flush();
+		while(!glfwWindowShouldClose(window) && (benchmark.frames == 0 || benchmark.frame < headlessFrames)) {
+			drawFrame();
+			glfwPollEvents();
+		}
+	} else {
+		// Render a fixed number of frames at a fixed timestep, reading every frame back
+		// through the staging ring and keeping the last one. Benchmarks only read back
+		// the last frame.
+		readbackRing.create(allocator, logicalDevice, getQueueFamilies(physicalDevice).graphicsFamily.value(), graphicsQueue);
+		// Every frame renders with the real texture, for output that doesn't depend on decode timing
+		textureLoader.flush();
+		std::vector<uint8_t> lastFrame;
+		Clock::time_point renderStart = Clock::now();
+		for (uint32_t frame = 0; frame < headlessFrames; frame++) {
+			bool last = frame + 1 == headlessFrames;
+			Talos::ReadbackCallback readback;
+			if (last || benchmark.frames == 0)
+				readback = [&lastFrame, last](const void* data, VkDeviceSize size) {
+					if (last)
+						lastFrame.assign((const uint8_t*)data, (const uint8_t*)data + size);
+				};
+			drawFrameHeadless(frame * benchmark.timestep, readback);
+		}
+		readbackRing.flush();
+		vkDeviceWaitIdle(logicalDevice);
+		for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++, currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT)
+			readCullStats();
+		double renderMs = std::chrono::duration<double, std::milli>(Clock::now() - renderStart).count();
+		printf("Rendered %s%u frames in %.2f ms (%.2f ms/frame, %.1f fps).\n", benchmark.frames > 0 ? "" : "and read back ",
+			headlessFrames, renderMs, headlessFrames > 0 ? renderMs / headlessFrames : 0.0, renderMs > 0.0 ? headlessFrames * 1000.0 / renderMs : 0.0);
+		if (headlessFrames > 0) {
+			double visible = (double)frameStats.visibleInstances / headlessFrames;
+			printf("%u instances (%.0f visible, %.0f culled): CPU %.2f ms/frame (%.2f ms instance update).\n",
+				instanceCount, visible, instanceCount - visible, frameStats.cpuMs / headlessFrames, frameStats.instanceMs / headlessFrames);
+		}
+		if (!lastFrame.empty()) {
+			if (Talos::writePPM(outputFilename, lastFrame.data(), swapchainExtent.width, swapchainExtent.height))
+				printf("Wrote last frame to '%s'.\n", outputFilename.c_str());
+			else
+				printf("Failed to write '%s'!\n", outputFilename.c_str());
+		}
+		readbackRing.destroy();
 	}
 	// Vulkan cleanup
 	vkDeviceWaitIdle(logicalDevice);
+	if (benchmark.frames > 0)
+		reportBenchmark();
+	if (gpuProfiling)
+		reportGpuProfile();
+	if (!cpuTraceFilename.empty())
+		reportCpuTrace();
+	gpuProfiler.destroy();
+	commandRecorder.destroy();
+	recordPool.destroy();
+	instancePool.destroy();
 	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
 		vkDestroySemaphore(logicalDevice, imageAvailableSemaphores[i], nullptr);
 		vkDestroySemaphore(logicalDevice, renderFinishedSemaphores[i], nullptr);
 		vkDestroyFence(logicalDevice, inFlightFences[i], nullptr);
-		vkDestroyBuffer(logicalDevice, uniformBuffers[i], nullptr);
-		vkFreeMemory(logicalDevice, uniformBuffersMemory[i], nullptr);
+		allocator.destroyBuffer(instanceBuffers[i], instanceBufferAllocations[i]);
+		allocator.destroyBuffer(cullBuffers[i].visibleBuffer, cullBuffers[i].visibleAllocation);
+		allocator.destroyBuffer(cullBuffers[i].indirectBuffer, cullBuffers[i].indirectAllocation);
+		allocator.destroyBuffer(cullBuffers[i].statsBuffer, cullBuffers[i].statsAllocation);
+	}
+	uniformArena.destroy();
+	stagingRing.destroy();
+	textureLoader.destroy();
+	for (RetiredSwapchain& retired : retiredSwapchains)
+		destroyRetiredSwapchain(retired);
+	for (RetiredTexture& retired : retiredTextures) {
+		vkDestroyImageView(logicalDevice, retired.imageView, nullptr);
+		allocator.destroyImage(retired.image, retired.allocation);
 	}
-	vkDestroyBuffer(logicalDevice, indexBuffer, nullptr);
-	vkFreeMemory(logicalDevice, indexBufferMemory, nullptr);
-	vkDestroyBuffer(logicalDevice, vertexBuffer, nullptr);
-	vkFreeMemory(logicalDevice, vertexBufferMemory, nullptr);
+	allocator.destroyBuffer(indexBuffer, indexBufferAllocation);
+	allocator.destroyBuffer(vertexBuffer, vertexBufferAllocation);
     vkDestroySampler(logicalDevice, textureSampler, nullptr);
     vkDestroyImageView(logicalDevice, textureImageView, nullptr);
-    vkDestroyImage(logicalDevice, textureImage, nullptr);
-    vkFreeMemory(logicalDevice, textureImageMemory, nullptr);
+    allocator.destroyImage(textureImage, textureImageAllocation);
 	vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
 	for (VkFramebuffer framebuffer : swapchainFramebuffers)
 		vkDestroyFramebuffer(logicalDevice, framebuffer, nullptr);
+	if (headless)
+		Talos::destroyOffscreenTarget(allocator, logicalDevice, offscreenTarget);
+	destroyDepthResources();
+	destroyColorResources();
 	vkDestroyPipeline(logicalDevice, graphicsPipeline, nullptr);
+	vkDestroyPipeline(logicalDevice, cullPipeline, nullptr);
+	pipelineCache.save();
+	pipelineCache.destroy();
 	vkDestroyDescriptorPool(logicalDevice, descriptorPool, nullptr);
 	vkDestroyDescriptorSetLayout(logicalDevice, descriptorSetLayout, nullptr);
+	vkDestroyDescriptorSetLayout(logicalDevice, cullDescriptorSetLayout, nullptr);
 	vkDestroyPipelineLayout(logicalDevice, pipelineLayout, nullptr);
+	vkDestroyPipelineLayout(logicalDevice, cullPipelineLayout, nullptr);
 	vkDestroyRenderPass(logicalDevice, renderPass, nullptr);
 	for (VkImageView imageView : swapchainImageViews)
 		vkDestroyImageView(logicalDevice, imageView, nullptr);
-	vkDestroySwapchainKHR(logicalDevice, swapchain, nullptr);
+	if (!headless)
+		vkDestroySwapchainKHR(logicalDevice, swapchain, nullptr);
+	allocator.destroy();
 	vkDestroyDevice(logicalDevice, nullptr);
-	vkDestroySurfaceKHR(instance, surface, nullptr);
+	if (!headless)
+		vkDestroySurfaceKHR(instance, surface, nullptr);
 	vkDestroyInstance(instance, nullptr);
 	// GLFW cleanup
-	glfwDestroyWindow(window);
-	glfwTerminate();
+	if (!headless) {
+		glfwDestroyWindow(window);
+		glfwTerminate();
+	}
 	return 0;
 }
 
@@ -1220,5 +2174,4 @@ int main() {
 --- TODO ---
 - Enable / setup vulkan validation layers
 - Set up specific debug messenger for instance creation/destruction
-- Add better device suitability checks (score devices, prioritize discrete GPUs)
 */
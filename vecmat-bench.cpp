@@ -0,0 +1,195 @@
+// vecmat-bench.cpp: micro-benchmark of the VecMat mat4 kernels against the plain
+// loops they replaced and against VecMat's own scalar fallback, and of the batch
+// SoA operations single and multi threaded. Build with optimizations, e.g.
+//     clang++ -std=c++17 -O2 -I include/ vecmat-bench.cpp -o vecmat-bench.exe
+// adding -mavx (or -march=native) for the AVX batch operations, -DVECMAT_NO_SIMD for scalar.
+
+#include <VecMat.h>
+
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+typedef std::chrono::high_resolution_clock Clock;
+
+const int COUNT = 1024; // Matrices / vectors per pass, small enough to stay in cache
+const size_t BATCH_COUNT = 1 << 20; // Elements per batch call, large enough to stream from memory
+
+// Reference versions, as VecMat implemented them before the SIMD kernels
+mat4 referenceMultiply(const mat4& a, const mat4& b) {
+	mat4 r(0);
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+			for (int k = 0; k < 4; k++)
+				r[i][j] += a[i][k]*b[k][j];
+	return r;
+}
+
+vec4 referenceTransform(const mat4& m, const vec4& v) {
+	return vec4(dot(m[0], v), dot(m[1], v), dot(m[2], v), dot(m[3], v));
+}
+
+// The VECMAT_NO_SIMD fallback, so the SIMD gain is measured against the same algorithm
+mat4 scalarMultiply(const mat4& a, const mat4& b) {
+	float r[16];
+	MultiplyMat4Scalar(a.data(), b.data(), r);
+	return mat4(vec4(r), vec4(r + 4), vec4(r + 8), vec4(r + 12));
+}
+
+mat4 scalarTranspose(const mat4& m) {
+	mat4 r(0);
+	TransposeMat4Scalar(m.data(), r.data());
+	return r;
+}
+
+float randomFloat() { return (float)rand() / RAND_MAX * 2.0f - 1.0f; }
+
+// Runs a batch call until at least minMs have passed, returning ns per element
+template <typename Fn>
+double measureBatch(Fn fn, double minMs = 200.0) {
+	uint64_t elements = 0;
+	Clock::time_point start = Clock::now();
+	double ms = 0.0;
+	do {
+		fn();
+		elements += BATCH_COUNT;
+		ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	} while (ms < minMs);
+	return ms * 1e6 / elements;
+}
+
+// Checks the batch operations against the per-element ones, then times them
+int benchBatch(int threads) {
+	std::vector<float> x(BATCH_COUNT), y(BATCH_COUNT), z(BATCH_COUNT), ox(BATCH_COUNT), oy(BATCH_COUNT), oz(BATCH_COUNT), angles(BATCH_COUNT);
+	std::vector<mat4> mats(BATCH_COUNT), outs(BATCH_COUNT);
+	for (size_t i = 0; i < BATCH_COUNT; i++) {
+		x[i] = randomFloat() * 100.0f;
+		y[i] = randomFloat() * 100.0f;
+		z[i] = randomFloat() * 100.0f;
+		angles[i] = randomFloat() * 180.0f;
+	}
+	mat4 m = Translate(1, 2, 3) * RotateY(30) * Scale(2, 2, 2);
+	// Check against the per-element operations
+	float maxError = 0.0f;
+	TransformPoints(m, x.data(), y.data(), z.data(), ox.data(), oy.data(), oz.data(), BATCH_COUNT, threads);
+	for (size_t i = 0; i < BATCH_COUNT; i += 997) {
+		vec4 p = m * vec4(x[i], y[i], z[i], 1);
+		maxError = fmaxf(maxError, fmaxf(fabsf(p.x - ox[i]), fmaxf(fabsf(p.y - oy[i]), fabsf(p.z - oz[i]))) / 100.0f);
+	}
+	TranslateRotate(x.data(), y.data(), z.data(), angles.data(), vec3(0, 0, 1), mats.data(), BATCH_COUNT, false, threads);
+	for (size_t i = 0; i < BATCH_COUNT; i += 997) {
+		mat4 e = Translate(x[i], y[i], z[i]) * RotateZ(angles[i]);
+		for (int j = 0; j < 4; j++)
+			for (int k = 0; k < 4; k++)
+				maxError = fmaxf(maxError, fabsf(e[j][k] - mats[i][j][k]) / 100.0f);
+	}
+	vec3 lo, hi, elo(FLT_MAX), ehi(-FLT_MAX);
+	ComputeAABB(x.data(), y.data(), z.data(), BATCH_COUNT, lo, hi, threads);
+	for (size_t i = 0; i < BATCH_COUNT; i++) {
+		elo = vec3(fminf(elo.x, x[i]), fminf(elo.y, y[i]), fminf(elo.z, z[i]));
+		ehi = vec3(fmaxf(ehi.x, x[i]), fmaxf(ehi.y, y[i]), fmaxf(ehi.z, z[i]));
+	}
+	maxError = fmaxf(maxError, length(lo - elo) + length(hi - ehi));
+	if (maxError > 1e-5f) {
+		printf("Batch results don't match the per-element operations (error %g)!\n", maxError);
+		return 1;
+	}
+	// Time them
+	double points = measureBatch([&]() { TransformPoints(m, x.data(), y.data(), z.data(), ox.data(), oy.data(), oz.data(), BATCH_COUNT, threads); });
+	double normals = measureBatch([&]() { TransformNormals(m, x.data(), y.data(), z.data(), ox.data(), oy.data(), oz.data(), BATCH_COUNT, threads); });
+	double compose = measureBatch([&]() { MultiplyMat4s(m, mats.data(), outs.data(), BATCH_COUNT, threads); });
+	double generate = measureBatch([&]() { TranslateRotate(x.data(), y.data(), z.data(), angles.data(), vec3(0, 0, 1), outs.data(), BATCH_COUNT, true, threads); });
+	double aabb = measureBatch([&]() { ComputeAABB(x.data(), y.data(), z.data(), BATCH_COUNT, lo, hi, threads); });
+	// Throughput counts the bytes read and written per element
+	auto row = [](const char* name, double ns, double bytes) { printf("%-24s %7.2f ns %7.2f GB/s\n", name, ns, bytes / ns); };
+	printf("Batch of %zu, %d thread(s):\n", BATCH_COUNT, threads);
+	row("TransformPoints", points, 24);
+	row("TransformNormals", normals, 24);
+	row("MultiplyMat4s", compose, 128);
+	row("TranslateRotate", generate, 80);
+	row("ComputeAABB", aabb, 12);
+	return 0;
+}
+
+// Runs fn over all elements until at least minMs have passed, returning ns per element
+template <typename Fn>
+double measure(Fn fn, double minMs = 200.0) {
+	uint64_t elements = 0;
+	Clock::time_point start = Clock::now();
+	double ms = 0.0;
+	do {
+		for (int i = 0; i < COUNT; i++)
+			fn(i);
+		elements += COUNT;
+		ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	} while (ms < minMs);
+	return ms * 1e6 / elements;
+}
+
+int main(int argc, char** argv) {
+	srand(1);
+	std::vector<mat4> a(COUNT), b(COUNT), out(COUNT);
+	std::vector<vec4> v(COUNT), vout(COUNT);
+	for (int i = 0; i < COUNT; i++) {
+		for (int j = 0; j < 4; j++) {
+			a[i][j] = vec4(randomFloat(), randomFloat(), randomFloat(), randomFloat());
+			b[i][j] = vec4(randomFloat(), randomFloat(), randomFloat(), randomFloat());
+		}
+		v[i] = vec4(randomFloat(), randomFloat(), randomFloat(), 1.0f);
+	}
+	// Check the kernels against the reference before timing them
+	float maxError = 0.0f;
+	for (int i = 0; i < COUNT; i++) {
+		mat4 m = a[i] * b[i], mr = referenceMultiply(a[i], b[i]);
+		vec4 t = a[i] * v[i], tr = referenceTransform(a[i], v[i]);
+		mat4 tt = Transpose(a[i]);
+		for (int j = 0; j < 4; j++)
+			for (int k = 0; k < 4; k++) {
+				maxError = fmaxf(maxError, fabsf(m[j][k] - mr[j][k]));
+				maxError = fmaxf(maxError, fabsf(tt[j][k] - a[i][k][j]));
+			}
+		for (int j = 0; j < 4; j++)
+			maxError = fmaxf(maxError, fabsf(t[j] - tr[j]));
+	}
+	printf("VecMat kernels: %s, max error vs reference %g\n", VECMAT_SIMD, maxError);
+	if (maxError > 1e-5f) {
+		printf("Kernel results don't match the reference!\n");
+		return 1;
+	}
+	// Time each kernel, chaining results through out so nothing is optimized away
+	double multiplyRef = measure([&](int i) { out[i] = referenceMultiply(a[i], b[i]); });
+	double multiplyScalar = measure([&](int i) { out[i] = scalarMultiply(a[i], b[i]); });
+	double multiply = measure([&](int i) { out[i] = a[i] * b[i]; });
+	double transformRef = measure([&](int i) { vout[i] = referenceTransform(a[i], v[i]); });
+	double transform = measure([&](int i) { vout[i] = a[i] * v[i]; });
+	double composeRef = measure([&](int i) { out[i] = referenceMultiply(referenceMultiply(a[i], b[i]), a[(i + 1) % COUNT]); });
+	double composeScalar = measure([&](int i) { out[i] = scalarMultiply(scalarMultiply(a[i], b[i]), a[(i + 1) % COUNT]); });
+	double compose = measure([&](int i) { out[i] = a[i] * b[i] * a[(i + 1) % COUNT]; });
+	double transposeScalar = measure([&](int i) { out[i] = scalarTranspose(a[i]); });
+	double transpose = measure([&](int i) { out[i] = Transpose(a[i]); });
+	// Speedup is SIMD over the scalar fallback; reference shows the loops before either
+	auto row = [](const char* name, double ref, double scalar, double simd) {
+		if (ref > 0.0)
+			printf("%-24s %7.2f ns %7.2f ns %7.2f ns %7.2fx\n", name, ref, scalar, simd, scalar / simd);
+		else
+			printf("%-24s %10s %7.2f ns %7.2f ns %7.2fx\n", name, "", scalar, simd, scalar / simd);
+	};
+	printf("%-24s %10s %10s %10s %8s\n", "", "reference", "scalar", VECMAT_SIMD, "speedup");
+	row("mat4 * mat4", multiplyRef, multiplyScalar, multiply);
+	printf("%-24s %7.2f ns %7.2f ns %10s\n", "mat4 * vec4", transformRef, transform, "(scalar)");
+	row("model * view * proj", composeRef, composeScalar, compose);
+	row("Transpose", 0.0, transposeScalar, transpose);
+	// Batch operations, single threaded then on every core
+	if (benchBatch(1) != 0)
+		return 1;
+	int threads = (int)std::thread::hardware_concurrency();
+	if (threads > 1 && benchBatch(threads) != 0)
+		return 1;
+	// Keep results observable
+	float sink = 0.0f;
+	for (int i = 0; i < COUNT; i++)
+		sink += out[i][0][0] + vout[i][0];
+	return sink == 12345.0f ? 2 : 0;
+}